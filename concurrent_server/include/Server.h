@@ -10,12 +10,38 @@
 #include <algorithm>
 #include <list>
 #include <unordered_map>
+#include <array>
 
 #include "net.h"
 #include "sockets_io.h"
 #include "concurrency_utils.h"
+#include "output_cache.h"
+#include "reactor.h"
+#include "shm_ring.h"
+#include "connection_table.h"
+#include "command_registry.h"
+#include "session_store.h"
+#include "capture.h"
+#include "slow_consumer.h"
+#include "udp_export.h"
 
 static const int MAXLINE = 256;
+static const int FLUSH_BLOCKS = 4; // number of output blocks ClientHandler passes to a single writev()
+static const int MAX_COMMAND_LEN = 50;
+static const int CONTROL_POLL_INTERVAL = 16; // handle() calls of the exporting ClientHandler between control reads
+static const int REBALANCE_INTERVAL_MS = 500; // how often ThreadPoolServer compares the load of the table shards
+static const int IMBALANCE_RATIO = 2; // the shards are rebalanced if the busiest one works this many times more
+static const int SUMMARY_INTERVAL_MS = 10000; // how often ThreadPoolServer prints the summary of its pools
+static const size_t IDLE_CLIENT_BYTES = 512; // memory of the server per connected client which sends nothing
+
+static const char * const PARSE_ERROR_MESSAGE =
+        "Error occurred parsing command. Please make sure the command is legit and try again...\n";
+static const char * const NOTHING_TO_SHOW_MESSAGE = "There's nothing to show. Abandoning...\n";
+static const char * const OVERLOADED_MESSAGE = "The server is overloaded, the export will start shortly...\n";
+static const char * const SHM_UNSUPPORTED_MESSAGE =
+        "The shared memory export needs a Unix socket connection to the thread pool server.\n";
+static const char * const UDP_UNSUPPORTED_MESSAGE =
+        "The UDP export needs a TCP connection to the thread pool server.\n";
 
 /**
  * ---- The design explanation ----
@@ -26,15 +52,22 @@ static const int MAXLINE = 256;
  * 4. ClientHandler frees the allocated resources upon destruction. There's no copy ctors and and copy assignments
  * operations defined for Server and ClientHandler. Copy/move the smart pointers to ClientHandler and Server rather than
  * the objects themselves.
- * 5. Server is able to define an optional new_handler to handle the cases when there's no enough memory for new Clients
+ * 5. ClientHandlers with the same sequences configuration share the rendered output through OutputCache, so formatting
+ * is done once per configuration rather than once per client.
+ * 6. CoroutineServer is the alternative to ThreadPoolServer: each client is a coroutine (see coro.h) driven by one of
+ * the epoll reactors, every reactor runs in its own thread. It takes the same setup commands through run_command(),
+ * but streams a reduced protocol, see CoroutineServer.
+ * 7. Server is able to define an optional new_handler to handle the cases when there's no enough memory for new Clients
  * this behaviour is obtained by the use of NewHandlerSupport class. User can use them to define their own handler functions
  *
  * Note: thread_pool object support arbitrary number of users, which can be much more than the number of available threads.
  *
  * ---- Important ----
  * 1. The maximum number the user can write to the server is 4 digits number as defined in the text of the task: xxxx or yyyy
- * 2. Go to concurrency_utils.cpp and change SEND_WITH_INTERRUPT to true if you want to make the sending process slower
- * 3. If the program cannot instantiate the number of thread defined by the hardware, it exits with throw.
+ * 2. Go to concurrency_utils.h and change SEND_WITH_INTERRUPT to true if you want to make the sending process slower
+ * 3. The workers of ThreadPoolServer are an elastic pool between --threads=MIN:MAX (1 and 4 per hardware thread by
+ * default): they are added while the handlers wait in the queue and retired when the load drops (see basic_thread_pool).
+ * If fewer than MIN threads can be created, the server goes on with those; it exits with throw only if it gets none.
  */
 
 template<class X>
@@ -42,6 +75,7 @@ class NewHandlerSupport{
 public:
     static std::new_handler set_new_handler(std::new_handler p); // function should exist even if the object don't
     static void* operator new(size_t size); // allocator should exist before the object is constructed
+    static void operator delete(void * p) noexcept; // pairs with operator new, defined out of line next to it
 private:
     static std::new_handler current_handler;
 };
@@ -51,7 +85,10 @@ enum class HandleStatus{
     fatal_error = -1,
     ok = 0,
     try_again = 1,
-    switch_mode = 2
+    switch_mode = 2,
+    switch_mode_shm = 3, // start sending seqs through the shared memory ring
+    moved = 4, // the connection is served by another handler now, this one is to be dropped
+    switch_mode_udp = 5 // start sending seqs in UDP datagrams, the connection stays for the control commands
 };
 
 class Handler{
@@ -60,15 +97,74 @@ public:
     virtual HandleStatus handle() = 0;
     virtual ~Handler() = default;
 
+    /**
+     * @return true while the handler waits for the client input, such handlers are scheduled with priority
+     */
+    virtual bool interactive() const { return false; }
+
+    /**
+     * @return the bytes transferred by the last handle() call, charged against the handler's quantum in thread_pool
+     */
+    size_t cost() const { return last_cost; }
+
+    /**
+     * @return true if the handler is done and is to be dropped by the pool
+     */
+    static bool finished(HandleStatus status){
+        return status == HandleStatus::disconnected || status == HandleStatus::fatal_error || status == HandleStatus::moved;
+    }
+
+    /**
+     * @return true if the handler can't make progress until the socket is ready again
+     */
+    static bool exhausted(HandleStatus status) { return status == HandleStatus::try_again; }
+
 protected:
     int fd;
+    size_t last_cost = 0;
+
+private:
+    template<typename> friend class basic_thread_pool;
+    long long deficit = 0; // deficit round-robin credit, owned by thread_pool
+    std::chrono::steady_clock::time_point enqueued; // when thread_pool queued the handler last time
+    uint64_t enqueued_tsc = 0; // the same in trace_clock() ticks, 0 unless the tracing was on
 };
 
-class ClientHandler: public Handler{
+/**
+ * Token bucket of the "rate" command: refilled with rate lines per second, at most a second of burst.
+ */
+class rate_limiter{
 public:
-    explicit ClientHandler(int connfd): Handler(connfd) {}
+    /**
+     * Refills the bucket, which starts empty whenever the rate changes.
+     * @return the number of bytes which may be sent now
+     */
+    size_t budget(unsigned long long rate, size_t line_size);
+    void spend(size_t bytes) { tokens -= std::min<unsigned long long>(bytes, tokens); }
+
+private:
+    unsigned long long applied_rate = 0; // the rate the bucket was filled for
+    unsigned long long tokens = 0; // bytes
+    std::chrono::steady_clock::time_point refill;
+};
+
+class ConnectionTableHandler;
 
-    // close the client upon destruction
+class ClientHandler final: public Handler{
+public:
+    /**
+     * @param overload - if given, the export is deferred while the server is overloaded
+     * @param table - if given, the connection is handed over to this shard table when the export starts
+     * @param sessions - if given, the client may open a session ("session") and resume it later ("resume <token>")
+     * @param capture - if given, everything the client sends is recorded there
+     * @param slow_consumers - if given, the export is sampled and the policy is applied while the client reads too slow
+     */
+    ClientHandler(int connfd, OutputCache& cache, const SocketProfile& profile = SocketProfile(),
+                  codel_controller * overload = nullptr, ConnectionTableHandler * table = nullptr,
+                  SessionStore * sessions = nullptr, CaptureWriter * capture = nullptr,
+                  slow_consumer_policy * slow_consumers = nullptr);
+
+    // close the client upon destruction, unless it was moved to the connection table. The session is kept.
     ~ClientHandler() override;
 
     ClientHandler(const ClientHandler&) = delete;
@@ -80,45 +176,134 @@ public:
      */
     HandleStatus handle() override;
 
+    bool interactive() const override { return mode == ch_mode::reading; }
+
 private:
     /**
-     * The funtion which is used by handle() in the writing mode.
+     * The funtion which is used by handle() in the writing mode. Sends as much of the next FLUSH_BLOCKS output blocks
+     * as the socket accepts with a single writev() (or MSG_ZEROCOPY sendmsg()) and remembers the offset.
      * @return
      */
     HandleStatus handle_writing();
 
     /**
-     * Helper function to avoid code copy.
-     * @param ss stream from where to read
-     * @return the integer result which was read from the stream
+     * handle_writing() of a slow consumer under the downsample policy: sends every SLOW_DOWNSAMPLE_FACTOR-th line of
+     * the next block, copied to the sampled buffer. The buffer is finished even if the consumer recovers meanwhile.
+     */
+    HandleStatus write_sampled(size_t budget);
+
+    /**
+     * Drops the first n blocks, which were sent or skipped.
+     */
+    void advance_blocks(int n);
+
+    /**
+     * Saves the position of the export to the session, if there's one. Called after every write.
      */
-    static unsigned long long get_number_from_stream(std::stringstream& ss);
+    void save_position();
 
     HandleStatus handle_reading();
 
     /**
-     * The function to handle the incoming string.
-     * @param input
-     * @return -1 means the read unsuccessful, the control thread will try to read again later, item.size() means the
-     * read is successful, and the number of processed chars is returned, 1 means command to start sending seqs was send.
-     *
-     * Note: Command: seq1 1 2 3 4 will be truncated to seq1 1 2 automatically. */
-    HandleStatus parse_command(const std::string& input);
+     * Switches to the requested export mode, or defers the switch while the server is overloaded.
+     */
+    HandleStatus start_export(HandleStatus request);
+
+    /**
+     * Continues the export from the position saved in the session, if the session was exported with the same config.
+     * Otherwise the session starts over with the current config. The export continues from the start of the line the
+     * position is in, the client drops the part of it it got before.
+     */
+    void restore_position();
+
+    /**
+     * Creates the shared memory ring and passes it to the client over the Unix socket. Over TCP the client gets an
+     * error message and stays in the reading mode.
+     */
+    HandleStatus start_shm();
+
+    /**
+     * The function which is used by handle() in the shm mode: fills the free part of the ring. The socket is only the
+     * control channel now, the client stops the export by closing it.
+     */
+    HandleStatus handle_shm();
+
+    /**
+     * Opens the UDP socket to the port the client asked for ("export udp <port> [gso]") and replies
+     * "udp <frames per datagram> <frame size>". If the connection is not over IP, the client gets an error message and
+     * stays in the reading mode.
+     */
+    HandleStatus start_udp();
+
+    /**
+     * The function which is used by handle() in the udp mode: sends the next batch of datagrams, within the rate.
+     */
+    HandleStatus handle_udp();
+
+    /**
+     * Moves the commands read after the export command to the control input of the export.
+     */
+    void take_control_input();
 
     /**
-     * Function for updating the current counter of the sequences to output to the client.
+     * Reads the control commands ("stop", "pause", "resume", "rate N") sent during the export, never blocks.
+     * The other commands are ignored: a reply would get in the middle of the output.
      */
-    void update();
+    HandleStatus poll_control();
 
     enum class ch_mode {
         reading = 0,
         writing = 1,
+        shm = 2,
+        udp = 3,
     };
     ch_mode mode = ch_mode::reading;
-    std::array<unsigned long long, 3> seq{0, 0, 0};
-    std::array<unsigned long long, 3> step{1, 1, 1};
-    std::array<bool, 3> seq_in_use{true, true, true};
-    std::array<unsigned long long, 3> inits{0, 0, 0};
+    SequenceConfig cfg;
+    codel_controller * overload;
+    ConnectionTableHandler * table;
+    HandleStatus deferred_export = HandleStatus::ok; // switch_mode(_shm, _udp) waiting for the overload to end
+
+    StreamControl control;
+    ioResult_t io_buf; // the commands are read through it, so the pipelined ones are not lost
+    std::string partial_line; // the command read so far
+    OutputCache& cache;
+    SessionHandle session; // the position is saved to the session after every write
+    CaptureWriter * capture;
+    slow_consumer_policy * slow_consumers;
+    SocketProfile profile;
+
+    /**
+     * The state of the export, allocated when it starts: an idle connection doesn't carry it.
+     */
+    struct ExportState{
+        explicit ExportState(slow_consumer_policy * slow_consumers): slow_monitor(slow_consumers) {}
+
+        std::string control_input; // incomplete control command
+        int handles_since_poll = 0;
+        rate_limiter rate;
+
+        std::array<std::shared_ptr<const OutputBlock>, FLUSH_BLOCKS> blocks; // blocks[0] is being sent
+        unsigned long long first_block = 0; // index of blocks[0]
+        size_t block_offset = 0; // number of bytes of blocks[0] already sent
+
+        slow_consumer_monitor slow_monitor;
+        unsigned long long written = 0; // bytes of the export written to the socket
+        std::string sampled; // downsampled lines of a block, reserved once
+        size_t sampled_offset = 0; // bytes of sampled already sent
+
+        std::unique_ptr<zerocopy_sender> zerocopy; // only allocated if the profile asks for MSG_ZEROCOPY
+        bool corked = false; // TCP_CORK is on, see handle_writing()
+
+        std::unique_ptr<ShmRingProducer> ring; // shm mode only
+        std::unique_ptr<UdpExporter> udp; // udp mode only
+        unsigned long long next_line = 1; // number of the next frame to put into the ring or the datagram
+    };
+    std::unique_ptr<ExportState> stream; // nullptr until the export starts
+
+    /**
+     * Allocates the export state.
+     */
+    void start_stream();
 };
 
 class Server{
@@ -129,17 +314,67 @@ public:
             throw std::runtime_error(std::string("Could not connect with the current configuration. Exiting..."));
         }
     };
-    Server(const char *port, const char *ip): port(port), ip(ip), listening_fd(), connected_fds() {
+    Server(const char *port, const char *ip, const SocketProfile& profile = SocketProfile()):
+            port(port), ip(ip), listening_fd(), connected_fds(), profile(profile) {
         listening_fd = open_listen_fd(port, ip);
         if (listening_fd == -1){
             throw std::runtime_error(std::string("Could not connect with the given IP, PORT. Exiting..."));
         }
     };
 
+    /**
+     * Serves the listening socket opened by the caller, e.g. the one the prefork master shares with its workers (see
+     * prefork.h). The server closes it on destruction.
+     */
+    Server(int listening_fd, const char *ip, const SocketProfile& profile):
+            listening_fd(listening_fd), connected_fds(), ip(ip), profile(profile) {}
+
     Server& operator=(const Server&) = delete;
     Server(Server&) = delete;
     virtual ~Server(){ // dtors are implicitly inline
         close_fd(listening_fd);
+        if (unix_listening_fd != -1){
+            close_fd(unix_listening_fd);
+            if (unix_path[0] != '@') unlink(unix_path.c_str());
+        }
+    }
+
+    /**
+     * Opens the additional listening Unix domain socket, the clients connected through it are served the same way as
+     * the TCP ones. Must be called before accept_connections().
+     * @param path - socket file path, or the abstract socket name prefixed with '@'
+     */
+    void listen_unix(const char *path){
+        unix_listening_fd = open_listen_unix_fd(path);
+        if (unix_listening_fd == -1){
+            throw std::runtime_error(std::string("Could not listen on the Unix socket ") + path + ". Exiting...");
+        }
+        unix_path = path;
+    }
+
+    /**
+     * Keeps the sessions of the clients in the file, they survive the restart of the server. Must be called before
+     * accept_connections().
+     */
+    void open_sessions(const char *path){
+        sessions = std::make_unique<SessionStore>(path);
+    }
+
+    /**
+     * Samples the exporting clients and applies the action to the ones which read slower than they asked to receive.
+     * Must be called before accept_connections(). CoroutineServer and the connection tables don't sample.
+     */
+    void handle_slow_consumers(SlowConsumerAction action, unsigned long long min_rate = SLOW_MIN_RATE){
+        slow_consumers.action = action;
+        slow_consumers.min_rate = min_rate;
+    }
+
+    /**
+     * Records the input of every client into the capture file for baum_replay. Must be called before
+     * accept_connections(). CoroutineServer doesn't record.
+     */
+    virtual void start_capture(const char *path){
+        capture = std::make_unique<CaptureWriter>(path);
     }
 
     virtual int listening_file_descriptor(){
@@ -155,6 +390,26 @@ protected:
     int listening_fd; // support fast removal in the middle: search + removal total O(N) time, much better than vector.
     std::list<int> connected_fds; // mapping listening_fd -> connected_fds
     std::string port, ip;
+    SocketProfile profile; // applied to every accepted socket
+    int unix_listening_fd = -1; // optional Unix domain socket endpoint
+    std::string unix_path;
+    std::unique_ptr<SessionStore> sessions; // nullptr unless open_sessions() was called
+    std::unique_ptr<CaptureWriter> capture; // nullptr unless start_capture() was called
+    slow_consumer_policy slow_consumers;
+
+    /**
+     * @return the listening sockets: TCP one and the Unix one if listen_unix() was called
+     */
+    std::vector<int> listening_fds() const{
+        std::vector<int> fds{listening_fd};
+        if (unix_listening_fd != -1) fds.push_back(unix_listening_fd);
+        return fds;
+    }
+
+    /**
+     * Prints the address of the new client, either (host,port) or the Unix socket it came through.
+     */
+    void print_client(const sockaddr_storage& addr, socklen_t addrlen) const;
 
     virtual void remove_disconnected_client(int fd){
         auto it = std::find(connected_fds.begin(), connected_fds.end(), fd);
@@ -162,18 +417,117 @@ protected:
     }
 };
 
+/**
+ * Streams the output of all the connections of one ConnectionTable shard. On every handle() the leftovers of the
+ * previous pass are flushed, then the ready rows are advanced LINES_PER_PASS times in vectorized passes, and the
+ * rendered lines are scattered to the sockets. The connections come from ClientHandlers which finished their setup,
+ * or from the other shards when ThreadPoolServer rebalances them.
+ */
+class ConnectionTableHandler final: public Handler{
+public:
+    static const int LINES_PER_PASS = 8;
+
+    ConnectionTableHandler(): Handler(-1) {}
+    ~ConnectionTableHandler() override; // closes the connections of the table
+
+    ConnectionTableHandler(const ConnectionTableHandler&) = delete;
+    ConnectionTableHandler& operator=(const ConnectionTableHandler&) = delete;
+
+    HandleStatus handle() override;
+
+    /**
+     * Takes over the connection, can be called from any thread. The rows are added by the next handle().
+     */
+    void adopt(int connfd, const SequenceConfig& cfg);
+    void adopt(ConnectionTable::Row&& row);
+
+    /**
+     * Asks the shard to hand n of its connections over to the other shard on its next handle(). The streams continue
+     * from the same line, the output not sent yet goes with them. Can be called from any thread.
+     */
+    void migrate(ConnectionTableHandler * to, size_t n);
+
+    size_t connections() const { return rows; }
+
+    /**
+     * The disconnections of the rows are recorded there. Must be called before the connections are adopted.
+     */
+    void record_to(CaptureWriter * writer) { capture = writer; }
+
+    /**
+     * @return the connections which were sent something by the last handle()
+     */
+    size_t active_connections() const { return active; }
+
+    /**
+     * @return nanoseconds spent in the passes which sent something since the previous call
+     */
+    unsigned long long take_busy_ns() { return busy_ns.exchange(0); }
+
+    /**
+     * @return nanoseconds spent in the passes which sent something since the start
+     */
+    unsigned long long total_busy_ns() const { return busy_total_ns.load(std::memory_order_relaxed); }
+
+    /**
+     * @return the connections this shard has handed over to the other shards
+     */
+    unsigned long long migrated() const { return migrated_rows.load(std::memory_order_relaxed); }
+
+private:
+    std::mutex incoming_mut;
+    std::vector<ConnectionTable::Row> incoming;
+    ConnectionTableHandler * migrate_to = nullptr; // guarded by incoming_mut
+    size_t migrate_count = 0;
+
+    std::atomic<size_t> rows{0}, active{0};
+    std::atomic<unsigned long long> busy_ns{0}, busy_total_ns{0};
+    std::atomic<unsigned long long> migrated_rows{0};
+    CaptureWriter * capture = nullptr;
+
+    ConnectionTable table;
+    std::vector<char> scratch; // LINES_PER_PASS lines per row
+    std::vector<size_t> rendered; // bytes of scratch used by the row
+    std::vector<size_t> dead; // rows to remove after the pass
+
+    /**
+     * @return bytes written, or -1 if the client is disconnected
+     */
+    ssize_t send_row(size_t row, const char * data, size_t size);
+};
+
 class ThreadPoolServer final: public Server, public NewHandlerSupport<Server> {
 public:
-    explicit ThreadPoolServer(const char *port): Server(port) {}
-    ThreadPoolServer(const char *port, const char *ip): Server(port, ip) {}
+    explicit ThreadPoolServer(const char *port): Server(port), working_threads(DRR_QUANTUM, {}, "clients") {}
+
+    /**
+     * @param table_shards - if not 0, the exporting connections are moved to that many ConnectionTable shards instead
+     * of being streamed by their own ClientHandlers
+     * @param workers - the bounds of the pool of the ClientHandlers, which is resized with the load
+     */
+    ThreadPoolServer(const char *port, const char *ip, const SocketProfile& profile = SocketProfile(),
+                     unsigned table_shards = 0, pool_limits workers = {});
 
     /**
      * Function attaches to the listening sockets opened at the Object construction, and waits for new connections.
      */
     void accept_connections() override;
 
+    void start_capture(const char *path) override;
+
+    ~ThreadPoolServer() override;
+
 private:
-    thread_pool working_threads;
+    OutputCache output_cache; // declared before the pool, so it outlives the ClientHandlers
+    std::vector<std::shared_ptr<ConnectionTableHandler>> tables;
+    std::chrono::steady_clock::time_point next_rebalance;
+    std::chrono::steady_clock::time_point next_summary = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point next_sizing = std::chrono::steady_clock::now();
+    std::atomic<unsigned long long> rebalances{0};
+    int metrics_id = -1; // "tables.*", registered if there are the tables
+    // both pools hold a single final handler type, so their workers call handle() without the virtual dispatch
+    std::unique_ptr<basic_thread_pool<ConnectionTableHandler>> table_threads; // one worker per shard
+    basic_thread_pool<ClientHandler> working_threads;
 
     /**
      * We could also implement the push/pop of the connected clients for example by passing the pointer to the Server to
@@ -182,6 +536,116 @@ private:
      * our scope.
      */
     void remove_client();
+
+    /**
+     * @return the shard with the fewest connections, nullptr if the connection tables are off
+     */
+    ConnectionTableHandler * least_loaded_table() const;
+
+    /**
+     * Compares the busy time of the table shards over the last interval and moves a part of the connections of the
+     * busiest shard to the idlest one if it works IMBALANCE_RATIO times more. A shard with a single active connection is
+     * left alone: moving it would only move the hot spot. The "metrics" command shows the outcome: tables.rebalances,
+     * tables.migrated and the rows, the active rows and the busy time of every tables.shard<n>.
+     */
+    void rebalance_tables();
+
+    /**
+     * Prints the interval summaries of the pools which did something since the previous one.
+     */
+    void print_summary();
+
+    /**
+     * @return milliseconds until the next rebalance or summary, for the poll of the accept loop
+     */
+    int poll_timeout() const;
+};
+
+/**
+ * The sessions are coroutines rather than ClientHandlers: read_commands() and stream_output() are a second, smaller
+ * copy of the protocol. The export takes the control commands (pause, resume, rate, stop), but there's neither the
+ * shared memory or the UDP export, the sessions, the capture nor the slow consumer policy. These stay with
+ * ThreadPoolServer; what this one is for is the cost of a connection.
+ *
+ * Measured against ThreadPoolServer (Release, 1 CPU, loopback; the "reactor.<n>.*" metrics, see Reactor, and the
+ * RSS and the context switches of the process):
+ * - 1000 idle connections: 1.7 KB of RSS each, 1177 bytes of them the coroutine frames with the 512 bytes read buffer
+ * of AsyncSocket; ThreadPoolServer 0.8-0.9 KB. A second thousand reuses the memory in both;
+ * - 8 baum_load clients for 3 s: 12.1-13.6M lines/s at 3.3K context switches/s; ThreadPoolServer --threads=1
+ * 14.5-15.1M at 2.9K/s, --threads=1:4 14.2-15.4M at 1.9-2.3K/s. With a single CPU the switches are those between the
+ * server and the clients, neither design adds its own.
+ */
+class CoroutineServer final: public Server, public NewHandlerSupport<Server> {
+public:
+    /**
+     * @param reactors - number of threads with their own Reactor, all of them accept on the same listening socket
+     */
+    CoroutineServer(const char *port, const char *ip, const SocketProfile& profile = SocketProfile(),
+                    unsigned reactors = std::thread::hardware_concurrency());
+
+    /**
+     * Accepts from the listening socket opened by the caller, see Server(int, const char *, const SocketProfile&).
+     */
+    CoroutineServer(int listening_fd, const char *ip, const SocketProfile& profile, unsigned reactors);
+
+    ~CoroutineServer() override;
+
+    /**
+     * Starts the reactors, the calling thread runs one of them. Never returns.
+     */
+    void accept_connections() override;
+
+    /**
+     * Low-latency mode for the clients of the port: they are served by the busy-polling reactors (see Reactor), one
+     * per CPU and pinned to it, ideally the CPUs isolated from the scheduler (isolcpus). The other reactors keep waiting
+     * in epoll as before. Must be called before accept_connections().
+     * Measured with baum --coro --busy-poll=0 and baum_load --gaps --rate=1000 --clients=4 --seconds=3 on a single
+     * CPU, which the busy reactor shares with the rest, two runs per port. The gaps between the recv() arrivals are
+     * p50 1.0 / p99 4.9-5.0 / p99.9 5.6-6.0 ms on the default port and p50 1.0 / p99 1.9-2.6 / p99.9 4.5-4.9 ms on the
+     * busy port. The p50 is the pacing of the rate itself; with a CPU of its own the busy port should do better still.
+     * @param port - TCP port on the IP of the server
+     * @param cpus - one busy-polling reactor for every CPU
+     */
+    void busy_poll(const char *port, const std::vector<int>& cpus);
+
+private:
+    OutputCache output_cache;
+    unsigned reactor_count;
+    int busy_listening_fd = -1;
+    std::vector<int> busy_cpus;
+
+    /**
+     * @param cpu - the CPU of the busy-polling reactor, -1 for the ordinary one
+     */
+    void run_reactor(int cpu = -1);
+
+    Task accept_loop(Reactor& reactor, int listenfd);
+
+    /**
+     * The coroutine version of ClientHandler: reads the commands until "export seq", then streams the output blocks.
+     */
+    Task client_session(Reactor& reactor, int connfd, SocketProfile client_profile);
+
+    /**
+     * @return true if the client asked to start sending seqs
+     */
+    Lazy<bool> read_commands(AsyncSocket& sock, SequenceConfig& cfg, StreamControl& control);
+
+    /**
+     * Streams the output blocks, applying the control commands sent meanwhile. A paused export waits for the next
+     * command, a rate limited one sleeps on the reactor until the bucket has something again. The cork and the
+     * zerocopy of the profile work as in ClientHandler::handle_writing().
+     * @return returns only when the client is disconnected or stopped the export
+     */
+    Lazy<bool> stream_output(AsyncSocket& sock, SequenceConfig& cfg, StreamControl& control,
+                             const SocketProfile& client_profile);
+
+    /**
+     * Runs the control commands which have arrived, never waits. The other commands are ignored, as by ClientHandler.
+     * @param input - the incomplete command left from the previous call
+     * @return false if the client is disconnected or sent "stop"
+     */
+    bool poll_control(AsyncSocket& sock, SequenceConfig& cfg, StreamControl& control, std::string& input);
 };
 
 #endif //BAUM_SERVER_H
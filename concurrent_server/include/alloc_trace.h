@@ -0,0 +1,44 @@
+#ifndef BAUM_ALLOC_TRACE_H
+#define BAUM_ALLOC_TRACE_H
+
+#include <cstddef>
+#include <string>
+
+/**
+ * ---- Description ----
+ * Allocation tracing, only built with -DBAUM_ALLOC_TRACE=ON. alloc_trace.cpp replaces the global operator new and
+ * operator delete of the program: every allocation is counted in the counters of the calling thread and attributed to
+ * its call site, the ALLOC_SITE_FRAMES return addresses above operator new. The "allocs [sites]" command of the server
+ * reports them, baum_load --check-allocs uses it to verify that the streaming allocates nothing once it's warmed up.
+ *
+ * The counters are relaxed atomics written by their own thread only, the call sites cost a backtrace() per allocation:
+ * the build is for the measurements, not for the production.
+ */
+
+static const int ALLOC_SITE_FRAMES = 8; // the allocator templates take the first few
+static const size_t ALLOC_SITES = 4096; // distinct call sites recorded, the rest are counted in the totals only
+static const int MAX_TRACED_THREADS = 256; // the threads above share the last counters
+
+struct alloc_stats{
+    unsigned long long allocations;
+    unsigned long long deallocations;
+    unsigned long long bytes; // allocated, never decreases
+};
+
+/**
+ * @return the sum of the counters of all the threads
+ */
+alloc_stats alloc_totals();
+
+/**
+ * @return the counters of the calling thread
+ */
+alloc_stats thread_alloc_stats();
+
+/**
+ * Appends a line per call site, the most allocating ones first: "site count=N bytes=B at f1 < f2 < ..."
+ * @param top - the number of the sites to report
+ */
+void dump_alloc_sites(std::string& out, size_t top);
+
+#endif //BAUM_ALLOC_TRACE_H
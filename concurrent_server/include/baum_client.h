@@ -0,0 +1,193 @@
+#ifndef BAUM_CLIENT_H
+#define BAUM_CLIENT_H
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "shm_ring.h"
+
+/**
+ * ---- Description ----
+ * Client library of the sequence protocol. The setup commands are collected and sent together with the export command
+ * in a single write, nothing waits for a reply in between. The output is read in CLIENT_READ_CHUNK chunks and all the
+ * complete lines of a chunk are parsed in one pass. Over a Unix socket the client can ask for the shared memory ring
+ * ("export shm") and then reads the binary frames without syscalls.
+ *
+ * Two ways to consume the lines:
+ * 1. pull: read() fills an array of lines, lines() is an input range for the range-based for;
+ * 2. callback: for_each() calls the function for every line until it returns false.
+ *
+ * Usage:
+ *     SequenceClient client("127.0.1.1", "1234");
+ *     client.seq(1, 1, 2).seq(2, 0, 0).seq(3, 0, 0).export_seq();
+ *     for (const SeqLine& line : client.lines()) { ... }
+ */
+
+static const size_t CLIENT_READ_CHUNK = 256 * 1024;
+static const int CLIENT_SEQ_COUNT = 3;
+
+/**
+ * One output line: the values of the sequences in use, in the order of their numbers.
+ */
+struct SeqLine{
+    unsigned long long line; // number of the line, starting from 1
+    std::array<unsigned long long, CLIENT_SEQ_COUNT> values;
+    int count; // number of the values in use
+};
+
+class SequenceClient{
+public:
+    /**
+     * Connects over TCP. Throws std::runtime_error on failure.
+     */
+    SequenceClient(const char *host, const char *port);
+
+    /**
+     * Connects over the Unix domain socket, '@' prefix for the abstract namespace. Throws std::runtime_error on failure.
+     */
+    explicit SequenceClient(const char *unix_path);
+
+    ~SequenceClient();
+    SequenceClient(const SequenceClient&) = delete;
+    SequenceClient& operator=(const SequenceClient&) = delete;
+
+    /**
+     * Queues "seqN start step [kind]". A zero turns the arithmetic sequence off, the other kinds turn it on. Nothing is
+     * sent before the export.
+     * @param n - 1, 2 or 3
+     * @param kind - the name of the generator, e.g. "pcg", empty for the arithmetic sequence
+     */
+    SequenceClient& seq(int n, unsigned long long start, unsigned long long step, const std::string& kind = "");
+
+    /**
+     * Queues any other command, e.g. "rate 1000". The line feed is added.
+     */
+    SequenceClient& command(const std::string& line);
+
+    /**
+     * Sends the command at once, with the queued ones before it, and waits for the first line of the reply. For the
+     * commands which reply before the export: "status", "session", "allocs".
+     * @return the line without the line feed, empty if the server is disconnected
+     */
+    std::string query(const std::string& line);
+
+    /**
+     * Waits for the next line of the reply without sending anything, e.g. the lines of "metrics" after the first.
+     * @return the line without the line feed, empty if the server is disconnected
+     */
+    std::string read_reply();
+
+    /**
+     * Sends the queued commands and "export seq" with one write.
+     * @return false if the server is disconnected
+     */
+    bool export_seq();
+
+    /**
+     * Sends the queued commands and "export shm", then maps the ring the server passes back. Unix sockets only.
+     * @return false if the server refused or is disconnected, see last_message()
+     */
+    bool export_shm();
+
+    /**
+     * Reads at most max lines, waits for the first one if block is set.
+     * @return number of lines read, 0 if the server is disconnected (or nothing arrived and block isn't set)
+     */
+    size_t read(SeqLine * out, size_t max, bool block = true);
+
+    /**
+     * Calls on_line for every line until it returns false, the server disconnects or max_lines are read (0 - no limit).
+     * @return number of lines passed to on_line
+     */
+    size_t for_each(const std::function<bool(const SeqLine&)>& on_line, size_t max_lines = 0);
+
+    class iterator{
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = SeqLine;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const SeqLine*;
+        using reference = const SeqLine&;
+
+        explicit iterator(SequenceClient * client = nullptr);
+        reference operator*() const { return current; }
+        pointer operator->() const { return &current; }
+        iterator& operator++();
+        void operator++(int) { ++*this; }
+        bool operator==(const iterator& other) const { return client == other.client; }
+
+    private:
+        SequenceClient * client; // nullptr for the end
+        SeqLine current{};
+    };
+
+    struct range{
+        SequenceClient * client;
+        iterator begin() const { return iterator(client); }
+        iterator end() const { return iterator(); }
+    };
+
+    /**
+     * Input range of the lines, ends when the server disconnects.
+     */
+    range lines() { return {this}; }
+
+    /**
+     * @return the last text line of the server which isn't output, e.g. the parse error message
+     */
+    const std::string& last_message() const { return message; }
+
+    /**
+     * @return when the recv() (or the ring read) that completed the lines returned by the last read() came back, all
+     * the lines of one chunk share it
+     */
+    std::chrono::steady_clock::time_point last_arrival() const { return arrival; }
+
+    int file_descriptor() const { return fd; }
+    bool connected() const { return fd != -1; }
+    unsigned long long bytes_received() const { return received; }
+
+private:
+    int fd = -1;
+    bool unix_socket = false;
+    std::string pending_commands;
+    std::array<bool, CLIENT_SEQ_COUNT> in_use{true, true, true};
+    int columns = CLIENT_SEQ_COUNT;
+    unsigned long long next_line = 1;
+    unsigned long long received = 0;
+    std::chrono::steady_clock::time_point arrival;
+    std::string message;
+
+    std::vector<char> buffer; // unparsed bytes are buffer[begin, end)
+    size_t begin = 0, end = 0;
+
+    std::unique_ptr<ShmRingConsumer> ring;
+    std::vector<seq_frame> frames;
+
+    std::vector<SeqLine> batch; // lines read but not returned by next() or for_each() yet
+    size_t batch_pos = 0;
+
+    bool send_commands(const std::string& last_command);
+    size_t parse(SeqLine * out, size_t max);
+    size_t read_ring(SeqLine * out, size_t max, bool block);
+    void disconnect();
+
+    /**
+     * Reads the next batch of lines.
+     * @return false if the server is disconnected
+     */
+    bool refill();
+
+    /**
+     * The next line for the iterator.
+     * @return false if the server is disconnected
+     */
+    bool next(SeqLine& line);
+};
+
+#endif //BAUM_CLIENT_H
@@ -0,0 +1,108 @@
+#ifndef BAUM_CAPTURE_H
+#define BAUM_CAPTURE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+/**
+ * ---- Description ----
+ * Capture of the client traffic: what every connection sent to the server and when, so baum_replay can drive the same
+ * sessions against another build. Only the inbound bytes are kept, the output is the server's own.
+ *
+ * File format: CAPTURE_MAGIC, then the records, the integers are LEB128 varints:
+ *     type (1 byte) | session | microseconds since the previous record | [length | bytes] for CaptureType::data
+ * A file cut in the middle of a record (e.g. the server was killed) is read up to the last complete record.
+ *
+ * The workers only append the records to the buffer under the lock. The writer thread of CaptureWriter takes the whole
+ * buffer (a swap) and writes it to the disk outside of the lock, so the workers never wait for the disk.
+ */
+
+static const char CAPTURE_MAGIC[8] = {'B', 'A', 'U', 'M', 'C', 'A', 'P', '1'};
+static const size_t CAPTURE_FLUSH_BYTES = 64 * 1024;
+static const int CAPTURE_FLUSH_MS = 1000; // the buffer is written at least this often while the traffic goes
+// the buffer is handed to the writer thread when it reaches CAPTURE_FLUSH_BYTES; it may grow past that if the disk
+// can't keep up
+
+enum class CaptureType: uint8_t{
+    open = 0,
+    data = 1,
+    close = 2
+};
+
+struct CaptureRecord{
+    CaptureType type;
+    uint32_t session; // sessions are numbered from 0 in the order of the connections
+    uint64_t time_us; // since the start of the capture
+    std::string data;
+};
+
+class CaptureWriter{
+public:
+    /**
+     * Creates or truncates the file. Throws std::runtime_error on failure.
+     */
+    explicit CaptureWriter(const char *path);
+    ~CaptureWriter(); // writes the rest of the buffer and stops the writer thread
+
+    CaptureWriter(const CaptureWriter&) = delete;
+    CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+    /**
+     * The events of the connection, can be called from any thread. The connection is identified by its socket until
+     * closed(), then the socket number may be reused by the next one.
+     */
+    void opened(int connfd);
+    void received(int connfd, const char * data, size_t size);
+    void closed(int connfd);
+
+private:
+    int fd;
+    std::mutex mut;
+    std::condition_variable wake_writer;
+    bool flush_requested = false; // guarded by mut, like the rest
+    bool stopping = false;
+    std::string buffer;
+    std::unordered_map<int, uint32_t> sessions; // socket -> session
+    uint32_t next_session = 0;
+    std::chrono::steady_clock::time_point last_record;
+    std::thread writer; // started last
+
+    void append(CaptureType type, uint32_t session, const char * data, size_t size);
+
+    /**
+     * Asks the writer thread to write the buffer now. Called under mut.
+     */
+    void flush();
+
+    /**
+     * The writer thread: writes the buffer when asked or every CAPTURE_FLUSH_MS, until the destructor stops it.
+     */
+    void write_loop();
+};
+
+class CaptureReader{
+public:
+    /**
+     * Throws std::runtime_error if the file can't be read or is not a capture.
+     */
+    explicit CaptureReader(const char *path);
+
+    /**
+     * @return false at the end of the capture
+     */
+    bool next(CaptureRecord& record);
+
+private:
+    std::string content;
+    size_t pos = 0;
+    uint64_t time_us = 0;
+
+    bool read_varint(uint64_t& value);
+};
+
+#endif //BAUM_CAPTURE_H
@@ -0,0 +1,87 @@
+#ifndef BAUM_COMMAND_REGISTRY_H
+#define BAUM_COMMAND_REGISTRY_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "output_cache.h"
+
+/**
+ * ---- Description ----
+ * The commands of the protocol: "seq1 x y", "export seq", "status", ... Every command is declared once in the table of
+ * command_registry.cpp with its verb, the types of its arguments and the function which applies it. The verb is looked
+ * up through a perfect hash computed at compile time, so the dispatch is one hash and one comparison however many
+ * commands there are. The arguments are parsed by the registry according to the declaration, without exceptions.
+ */
+
+enum class HandleStatus;
+class codel_controller;
+class OutputCache;
+class SessionStore;
+
+static const int MAX_COMMAND_ARGS = 3;
+static const int MAX_NUMBER_DIGITS = 6;
+
+/**
+ * Per-connection state of the export, changed by the control commands ("pause", "rate") even while it runs.
+ */
+struct StreamControl{
+    bool paused = false;
+    unsigned long long rate = 0; // lines per second, 0 - unlimited
+    uint16_t udp_port = 0; // "export udp <port> [gso]"
+    bool udp_gso = false;
+};
+
+/**
+ * The persistent session of the connection ("session", "resume <token>"), see session_store.h.
+ */
+struct SessionHandle{
+    SessionStore * store = nullptr; // nullptr if the server keeps no sessions
+    int slot = -1; // the record of the session, -1 until the connection creates or resumes one
+};
+
+/**
+ * Everything a command may read or change.
+ */
+struct CommandContext{
+    SequenceConfig& cfg;
+    StreamControl * control; // nullptr if the server can't control the export of this connection
+    std::string& reply; // the text to send back to the client, left empty if there's none
+    const OutputCache * cache = nullptr; // for "status", may be nullptr
+    const codel_controller * overload = nullptr; // for "status", may be nullptr
+    SessionHandle * session = nullptr; // nullptr if the session can't be changed now, e.g. during the export
+};
+
+enum class ArgType{
+    none = 0,
+    number, // decimal unsigned, at most MAX_NUMBER_DIGITS digits
+    word,
+    optional_word // a word which may be left out, the view is empty then
+};
+
+struct CommandArgs{
+    unsigned long long number[MAX_COMMAND_ARGS]{};
+    std::string_view word[MAX_COMMAND_ARGS];
+};
+
+using command_fn = HandleStatus (*)(CommandContext& ctx, const CommandArgs& args);
+
+struct Command{
+    std::string_view verb;
+    ArgType args[MAX_COMMAND_ARGS];
+    bool streaming; // may be sent while the export runs
+    command_fn run;
+};
+
+/**
+ * Parses the command line and applies it. The extra arguments are ignored: "seq1 1 2 pcg 4" is "seq1 1 2 pcg".
+ * @param line - the command, with or without the trailing "\r\n"
+ * @param streaming - true if the export of the connection runs, the commands not allowed then are rejected
+ * @return ok if the command was applied, try_again if the command is unknown or malformed, switch_mode or
+ * switch_mode_shm or switch_mode_udp to start the export ("export seq", "export shm", "export udp <port>"),
+ * disconnected to close the connection ("stop")
+ */
+HandleStatus run_command(std::string_view line, CommandContext& ctx, bool streaming = false);
+
+#endif //BAUM_COMMAND_REGISTRY_H
@@ -12,8 +12,17 @@
 #include <mutex>
 #include <memory>
 #include <iostream>
-#include <queue>
-#include <condition_variable>
+#include <algorithm>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <system_error>
+#include <pthread.h>
+#include <ctime>
+
+#include "event_trace.h"
+#include "metrics.h"
 
 /**
  * ---- Description ----
@@ -40,45 +49,626 @@ public:
     }
 };
 
+struct lock_stats{
+    unsigned long long acquisitions;
+    unsigned long long contended; // the acquisitions which had to wait for another holder
+    unsigned long long wait_ticks; // trace_clock() ticks spent waiting, see trace_ticks_per_us()
+    unsigned long long hold_ticks;
+    unsigned long long max_wait_ticks;
+};
+
+/**
+ * std::mutex which measures itself: the acquisitions, the contended ones, the time spent waiting for the lock and
+ * holding it. It's Lockable, so lock_guard and unique_lock work with it. The counters are only written by the holder;
+ * an uncontended lock/unlock costs two trace_clock() reads on top of the mutex.
+ */
+class instrumented_mutex{
+public:
+    void lock(){
+        if (!mut.try_lock()){
+            uint64_t start = trace_clock();
+            mut.lock();
+            uint64_t waited = trace_clock() - start;
+            add(contended, 1);
+            add(wait_ticks, waited);
+            if (waited > max_wait_ticks.load(std::memory_order_relaxed)){
+                max_wait_ticks.store(waited, std::memory_order_relaxed);
+            }
+        }
+        add(acquisitions, 1);
+        locked_at = trace_clock();
+    }
+
+    bool try_lock(){
+        if (!mut.try_lock()) return false;
+        add(acquisitions, 1);
+        locked_at = trace_clock();
+        return true;
+    }
+
+    void unlock(){
+        add(hold_ticks, trace_clock() - locked_at);
+        mut.unlock();
+    }
+
+    /**
+     * Can be called from any thread, the counters may be a few acquisitions apart from each other.
+     */
+    lock_stats stats() const{
+        return {acquisitions.load(std::memory_order_relaxed), contended.load(std::memory_order_relaxed),
+                wait_ticks.load(std::memory_order_relaxed), hold_ticks.load(std::memory_order_relaxed),
+                max_wait_ticks.load(std::memory_order_relaxed)};
+    }
+
+private:
+    // the holder is the only writer, so no locked read-modify-write is needed
+    static void add(std::atomic<unsigned long long>& counter, unsigned long long value){
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    std::mutex mut;
+    uint64_t locked_at = 0;
+    std::atomic<unsigned long long> acquisitions{0}, contended{0}, wait_ticks{0}, hold_ticks{0}, max_wait_ticks{0};
+};
+
 /**
  * We define a threadsafe_queue to safely push and pop from the server.
+ *
+ * The elements are kept in a ring which only grows: once it fits the largest queue seen, push and pop allocate nothing.
  * @tparam T
  */
 template<typename T>
 class threadsafe_queue
 {
 private:
-    mutable std::mutex mut;
-    std::queue<T> data_queue;
-    std::condition_variable data_cond;
+    mutable instrumented_mutex mut;
+    std::vector<T> ring;
+    size_t head = 0; // index of the front element
+    size_t count = 0;
 public:
     threadsafe_queue()
     = default;
     void push(T new_value);
     std::shared_ptr<T> try_pop();
+
+    /**
+     * Moves the front element to value, allocates nothing.
+     * @return false if the queue is empty
+     */
+    bool try_pop(T& value);
     bool empty() const;
+
+    lock_stats lock_statistics() const { return mut.stats(); }
+};
+
+/**
+ * Queue delay based overload detector in the spirit of CoDel: the server is overloaded when the sojourn time of the
+ * handlers in the queue stays above target for a whole interval, i.e. the queue doesn't drain even at its best moments.
+ * The short bursts, which are drained within the interval, don't count. While overloaded, the server sheds the new work
+ * (accepts and exports) to keep the latency of the existing clients bounded.
+ */
+class codel_controller{
+public:
+    explicit codel_controller(std::chrono::microseconds target = std::chrono::milliseconds(5),
+                              std::chrono::microseconds interval = std::chrono::milliseconds(100)):
+            target(target), interval(interval) {}
+
+    /**
+     * Called by the workers with the queue delay of each popped handler.
+     */
+    void on_dequeue(std::chrono::steady_clock::duration sojourn, std::chrono::steady_clock::time_point now);
+
+    bool overloaded() const { return dropping; }
+
+    /**
+     * @return false if the new work should be shed, counts the decision as shed
+     */
+    bool admit_accept();
+    bool admit_export();
+
+    struct stats_t{
+        unsigned long long overload_episodes;
+        unsigned long long shed_accepts;
+        unsigned long long deferred_exports;
+        long long max_sojourn_us;
+    };
+    stats_t stats() const;
+
+private:
+    const std::chrono::microseconds target, interval;
+    std::atomic<long long> first_above_time{0}; // ns since the clock epoch, 0 while the delay is below target
+    std::atomic_bool dropping{false};
+    std::atomic<unsigned long long> episodes{0}, shed_accepts{0}, deferred_exports{0};
+    std::atomic<long long> max_sojourn_ns{0};
+};
+
+static const size_t DRR_QUANTUM = 64 * 1024; // bytes a streaming handler may send per round
+static const int MAX_HANDLES_PER_ROUND = 64; // bounds the round of a handler which reports no cost
+static const bool SEND_WITH_INTERRUPT = false;
+static const int SLEEP_TIME_MS = 333;
+
+/**
+ * Where the time of a worker goes, in trace_clock() ticks. Written by the worker only.
+ */
+struct alignas(64) worker_stats{
+    std::atomic<unsigned long long> running_ticks{0}; // the rounds which ran a handler
+    std::atomic<unsigned long long> empty_ticks{0}; // the rounds which found both queues empty
+    std::atomic<unsigned long long> yield_ticks{0}; // std::this_thread::yield() after an empty round
+    std::atomic<unsigned long long> dequeues{0}; // the handlers popped from the queues
+    std::atomic<unsigned long long> sojourn_ns{0}; // their total queue delay
+};
+
+static const int POOL_SIZING_INTERVAL_MS = 100; // how often the owner calls adapt_size()
+static const unsigned POOL_MAX_WORKERS_PER_CPU = 4; // the default max_workers, room for the handlers which block
+static const long long POOL_GROW_DELAY_US = 2000; // below the codel target: the pool grows before the work is shed
+static const double POOL_GROW_UTILIZATION = 0.85;
+static const double POOL_IDLE_CPU = 0.5; // a worker is added only if the workers leave at least that much CPU idle
+static const long long POOL_SHRINK_DELAY_US = 500;
+static const double POOL_SHRINK_UTILIZATION = 0.5;
+static const int POOL_SHRINK_INTERVALS = 10; // consecutive intervals of low load before a worker is retired
+
+/**
+ * The bounds of the number of the workers of a pool. min_workers == max_workers is a pool of the fixed size.
+ */
+struct pool_limits{
+    unsigned min_workers = 1;
+    unsigned max_workers = 0; // 0: POOL_MAX_WORKERS_PER_CPU per hardware thread
 };
 
 /**
  * The class to make the threads work in concurrently, which supports to have number of users much more that available
  * number of threads
+ *
+ * Handlers are scheduled with deficit round-robin: the interactive ones (reading the commands) are in their own queue
+ * and get one handle() call each, while every streaming handler gets handle() calls until it has sent its quantum of
+ * bytes. A worker takes one interactive handler before each streaming round, so the commands of the new clients are
+ * parsed with bounded delay however heavy the exports are. Measured as the time from connect() to the reply to the
+ * first command of a new client, a probe every 20 ms while 64 clients export at full speed (Release, 1 CPU, two
+ * runs): p50 1.9-2.2 / p90 2.7-3.4 / p99 6.3-9.5 ms with the single FIFO queue before, 1.2-1.3 / 1.8-1.9 / 2.6-4.8 ms
+ * with deficit round-robin. The elastic pool and the overload control added since give 1.3-1.6 / 2.6-3.3 / 4.1-4.7
+ * ms, with a max of 40-57 ms against 16-19 ms. With 8 exporting clients all of them are at p50 0.4-0.6 ms.
+ *
+ * The pool is a template on the handler type H, which must provide handle(), interactive(), cost() and
+ * H::finished(status) (see Handler in Server.h). If H is a final class, the calls in the worker loop are resolved at
+ * compile time and can be inlined: with ClientHandler that's 4-6% more lines/s than basic_thread_pool<Handler>, which
+ * calls through the virtual functions (baum_load, 8 clients, one worker). thread_pool below, i.e.
+ * basic_thread_pool<Handler>, is the type-erased version for the pools which mix the handler types.
+ *
+ * The workers account their time (worker_stats) and the queues measure their locks; both are reported under
+ * "pool.<name>." by the "metrics" command and summarized by interval_summary(), the counters of the overload control
+ * (codel_controller) under "pool.<name>.overload.".
+ *
+ * The pool is elastic between pool_limits: it starts min_workers and adapt_size(), called by the owner every
+ * POOL_SIZING_INTERVAL_MS, adds a worker when the handlers wait in the queues (the average queue delay is above
+ * POOL_GROW_DELAY_US) while the workers are busy, as long as the workers leave a CPU idle, i.e. they are blocked in the
+ * handlers rather than computing. A worker is retired when the pool would stay lightly loaded without it, for
+ * POOL_SHRINK_INTERVALS intervals in a row. The gap between the thresholds keeps the size from oscillating. The
+ * retired worker finishes its round first, so no handler is lost.
+ * @tparam H
  */
-class thread_pool{
+template<typename H>
+class basic_thread_pool{
+    struct totals_t{
+        unsigned long long running, empty, yield;
+        lock_stats locks; // of both queues
+        unsigned long long dequeues, sojourn_ns;
+    };
+
     std::atomic_bool done;
-    threadsafe_queue<std::shared_ptr<Handler>> work_queue;
+    size_t quantum;
+    std::string name;
+    codel_controller overload;
+    threadsafe_queue<std::shared_ptr<H>> interactive_queue;
+    threadsafe_queue<std::shared_ptr<H>> work_queue;
+    pool_limits limits;
+    std::atomic<unsigned> worker_count{0}; // the workers with a smaller index run, the others exit
+    std::atomic<unsigned> peak_workers{0};
+    std::atomic<unsigned long long> grown{0}, shrunk{0};
+    std::unique_ptr<worker_stats[]> workers; // max_workers slots, a restarted worker continues the counters of its slot
+    totals_t last_summary{};
+    // the state of adapt_size()
+    totals_t last_sizing{};
+    std::chrono::steady_clock::time_point last_sizing_at;
+    std::vector<clockid_t> cpu_clocks; // of the worker threads
+    std::vector<unsigned long long> last_cpu_ns;
+    int low_load_intervals = 0;
+    int metrics_id = -1;
     std::vector<std::thread> threads;
-    join_threads joiner;
-    void worker_thread();
+    join_threads joiner; // declared last: the workers are joined before the rest is destroyed
+    void worker_thread(unsigned index);
+    bool start_worker();
+    totals_t totals() const;
+    void report_metrics(std::string& out) const;
+    bool run_interactive(worker_stats& stats);
+    bool run_streaming(worker_stats& stats);
+    void requeue(std::shared_ptr<H> handler);
+    std::shared_ptr<H> pop(threadsafe_queue<std::shared_ptr<H>>& queue, worker_stats& stats);
 public:
-    thread_pool();
-    ~thread_pool()
+    /**
+     * @param limits - the number of the workers, see adapt_size()
+     * @param name - of the pool in the metrics
+     */
+    explicit basic_thread_pool(size_t quantum_bytes = DRR_QUANTUM, pool_limits limits = {},
+                               std::string name = "pool");
+    ~basic_thread_pool()
     {
-        // call destructor explicitly
-        joiner.~join_threads();
+        unregister_metrics(metrics_id);
         done=true;
-    }
+    } // the joiner joins the workers
+
+    /**
+     * Adds or retires a worker, depending on the queue delay and the utilization of the workers since the previous
+     * call. Not thread safe: called every POOL_SIZING_INTERVAL_MS by the single thread which owns the pool.
+     */
+    void adapt_size();
+
+    /**
+     * Puts the handler to the queue of its class: interactive or streaming, and timestamps it.
+     */
+    void submit(std::shared_ptr<H>);
+
+    /**
+     * Overload state of the pool, measured on the queue delay of the handlers.
+     */
+    codel_controller& overload_control() { return overload; }
 
-    void submit(std::shared_ptr<Handler>);
+    /**
+     * One line on the workers time and the queue locks since the previous call, empty if the pool was idle. Not
+     * thread safe: called by the single thread which prints the summaries.
+     */
+    std::string interval_summary();
 };
 
+/**
+ * The pool of any handlers, calls them through the virtual functions of Handler. Instantiated in Server.cpp, where
+ * Handler is complete, so it keeps compiling although the servers use basic_thread_pool<ClientHandler>.
+ */
+using thread_pool = basic_thread_pool<Handler>;
+
+// ---- threadsafe_queue functions definition ----
+
+template<typename T>
+void threadsafe_queue<T>::push(T new_value){
+    std::lock_guard<instrumented_mutex> lk(mut);
+    if (count == ring.size()){ // full: unroll into a twice larger ring
+        std::vector<T> larger(std::max<size_t>(2 * ring.size(), 16));
+        for (size_t i = 0; i < count; ++i){
+            larger[i] = std::move(ring[(head + i) % ring.size()]);
+        }
+        ring.swap(larger);
+        head = 0;
+    }
+    ring[(head + count) % ring.size()] = std::move(new_value);
+    ++count;
+}
+
+template<typename T>
+bool threadsafe_queue<T>::try_pop(T& value){
+    std::lock_guard<instrumented_mutex> lk(mut);
+    if (count == 0)
+        return false;
+    value = std::move(ring[head]);
+    ring[head] = T(); // don't keep the moved-from element alive, e.g. a shared_ptr
+    head = (head + 1) % ring.size();
+    --count;
+    return true;
+}
+
+template<typename T>
+std::shared_ptr<T> threadsafe_queue<T>::try_pop(){
+    T value;
+    if (!try_pop(value))
+        return std::shared_ptr<T>();
+    return std::make_shared<T>(std::move(value));
+}
+
+template<typename T>
+bool threadsafe_queue<T>::empty() const{
+    std::lock_guard<instrumented_mutex> lk(mut);
+    return count == 0;
+}
+
+// ---- basic_thread_pool functions definition ----
+
+template<typename H>
+void basic_thread_pool<H>::worker_thread(unsigned index){
+    worker_stats& stats = workers[index];
+    auto add = [](std::atomic<unsigned long long>& counter, uint64_t ticks){
+        counter.store(counter.load(std::memory_order_relaxed) + ticks, std::memory_order_relaxed);
+    };
+    uint64_t now = trace_clock();
+    while(!done && index < worker_count.load(std::memory_order_relaxed)){
+        bool worked = run_interactive(stats);
+        worked = run_streaming(stats) || worked;
+        uint64_t after = trace_clock();
+        add(worked ? stats.running_ticks : stats.empty_ticks, after - now);
+        now = after;
+        if (!worked){
+            std::this_thread::yield();
+            after = trace_clock();
+            add(stats.yield_ticks, after - now);
+            now = after;
+        }
+    }
+}
+
+template<typename H>
+typename basic_thread_pool<H>::totals_t basic_thread_pool<H>::totals() const{
+    totals_t res{};
+    for (unsigned i = 0; i < limits.max_workers; ++i){ // the retired workers too, so the totals never go back
+        res.running += workers[i].running_ticks.load(std::memory_order_relaxed);
+        res.empty += workers[i].empty_ticks.load(std::memory_order_relaxed);
+        res.yield += workers[i].yield_ticks.load(std::memory_order_relaxed);
+        res.dequeues += workers[i].dequeues.load(std::memory_order_relaxed);
+        res.sojourn_ns += workers[i].sojourn_ns.load(std::memory_order_relaxed);
+    }
+    for (const lock_stats& q : {interactive_queue.lock_statistics(), work_queue.lock_statistics()}){
+        res.locks.acquisitions += q.acquisitions;
+        res.locks.contended += q.contended;
+        res.locks.wait_ticks += q.wait_ticks;
+        res.locks.hold_ticks += q.hold_ticks;
+        res.locks.max_wait_ticks = std::max(res.locks.max_wait_ticks, q.max_wait_ticks);
+    }
+    return res;
+}
+
+template<typename H>
+void basic_thread_pool<H>::report_metrics(std::string& out) const{
+    const double ticks_per_us = trace_ticks_per_us();
+    auto us = [ticks_per_us](unsigned long long ticks){ return static_cast<unsigned long long>(ticks / ticks_per_us); };
+    const std::string prefix = "pool." + name + ".";
+    append_metric(out, prefix + "workers", worker_count.load(std::memory_order_relaxed));
+    append_metric(out, prefix + "workers_min", limits.min_workers);
+    append_metric(out, prefix + "workers_max", limits.max_workers);
+    append_metric(out, prefix + "workers_added", grown.load(std::memory_order_relaxed));
+    append_metric(out, prefix + "workers_retired", shrunk.load(std::memory_order_relaxed));
+    const codel_controller::stats_t shedding = overload.stats();
+    append_metric(out, prefix + "overload.overloaded", overload.overloaded());
+    append_metric(out, prefix + "overload.episodes", shedding.overload_episodes);
+    append_metric(out, prefix + "overload.shed_accepts", shedding.shed_accepts);
+    append_metric(out, prefix + "overload.deferred_exports", shedding.deferred_exports);
+    append_metric(out, prefix + "overload.max_sojourn_us", shedding.max_sojourn_us);
+    for (unsigned i = 0; i < peak_workers.load(std::memory_order_relaxed); ++i){
+        const std::string worker = prefix + "worker" + std::to_string(i) + ".";
+        append_metric(out, worker + "running_us", us(workers[i].running_ticks.load(std::memory_order_relaxed)));
+        append_metric(out, worker + "empty_us", us(workers[i].empty_ticks.load(std::memory_order_relaxed)));
+        append_metric(out, worker + "yield_us", us(workers[i].yield_ticks.load(std::memory_order_relaxed)));
+    }
+    const std::pair<const char *, lock_stats> queues[] = {{"interactive_queue.", interactive_queue.lock_statistics()},
+                                                          {"work_queue.", work_queue.lock_statistics()}};
+    for (auto& [queue, stats] : queues){
+        append_metric(out, prefix + queue + "acquisitions", stats.acquisitions);
+        append_metric(out, prefix + queue + "contended", stats.contended);
+        append_metric(out, prefix + queue + "wait_us", us(stats.wait_ticks));
+        append_metric(out, prefix + queue + "hold_us", us(stats.hold_ticks));
+        append_metric(out, prefix + queue + "max_wait_us", us(stats.max_wait_ticks));
+    }
+}
+
+template<typename H>
+std::string basic_thread_pool<H>::interval_summary(){
+    totals_t now = totals();
+    totals_t d{now.running - last_summary.running, now.empty - last_summary.empty, now.yield - last_summary.yield,
+               {now.locks.acquisitions - last_summary.locks.acquisitions,
+                now.locks.contended - last_summary.locks.contended,
+                now.locks.wait_ticks - last_summary.locks.wait_ticks,
+                now.locks.hold_ticks - last_summary.locks.hold_ticks, now.locks.max_wait_ticks},
+               now.dequeues - last_summary.dequeues, now.sojourn_ns - last_summary.sojourn_ns};
+    last_summary = now;
+    if (d.running == 0) return {};
+
+    const double ticks_per_us = trace_ticks_per_us();
+    const double all = static_cast<double>(d.running + d.empty + d.yield);
+    const double locks = std::max<double>(d.locks.acquisitions, 1);
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1) << "Pool " << name << ": " << worker_count.load(std::memory_order_relaxed)
+        << " workers "
+        << 100 * d.running / all << "% running, " << 100 * d.empty / all << "% empty, " << 100 * d.yield / all
+        << "% yielding; queue locks: " << d.locks.acquisitions << " acquisitions, "
+        << 100 * d.locks.contended / locks << "% contended, wait " << std::setprecision(3)
+        << d.locks.wait_ticks / ticks_per_us / locks << " us avg (" << d.locks.max_wait_ticks / ticks_per_us
+        << " us max ever), hold " << d.locks.hold_ticks / ticks_per_us / locks << " us avg; queue delay "
+        << (d.dequeues ? d.sojourn_ns / 1000.0 / d.dequeues : 0.0) << " us avg";
+    return out.str();
+}
+
+template<typename H>
+void basic_thread_pool<H>::requeue(std::shared_ptr<H> handler){
+    if (SEND_WITH_INTERRUPT){
+        std::this_thread::sleep_for(std::chrono::milliseconds(SLEEP_TIME_MS));
+    }
+    submit(std::move(handler));
+}
+
+/**
+ * Pops the handler and reports its queue delay to the overload control.
+ * @return nullptr if the queue is empty
+ */
+template<typename H>
+std::shared_ptr<H> basic_thread_pool<H>::pop(threadsafe_queue<std::shared_ptr<H>>& queue, worker_stats& stats){
+    std::shared_ptr<H> handler;
+    if (!queue.try_pop(handler)) return nullptr; // the overload of try_pop() which doesn't allocate a wrapper
+    if (handler->enqueued_tsc){
+        trace_record("queue wait", handler->enqueued_tsc, trace_clock(), "fd", handler->fd);
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    overload.on_dequeue(now - handler->enqueued, now);
+    const auto sojourn = std::chrono::duration_cast<std::chrono::nanoseconds>(now - handler->enqueued).count();
+    stats.dequeues.store(stats.dequeues.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    stats.sojourn_ns.store(stats.sojourn_ns.load(std::memory_order_relaxed) + std::max<long long>(sojourn, 0),
+                           std::memory_order_relaxed);
+    return handler;
+}
+
+/**
+ * @return false if there was no interactive handler in the queue
+ */
+template<typename H>
+bool basic_thread_pool<H>::run_interactive(worker_stats& stats){
+    std::shared_ptr<H> handler = pop(interactive_queue, stats);
+    if (handler == nullptr) return false;
+
+    decltype(handler->handle()) status;
+    {
+        trace_span span("handle", "fd", handler->fd);
+        status = handler->handle();
+    }
+    if (H::finished(status)) return true; // we don't push it back, so the object will be destroyed.
+    requeue(std::move(handler));
+    return true;
+}
+
+/**
+ * @return false if there was no streaming handler in the queue
+ */
+template<typename H>
+bool basic_thread_pool<H>::run_streaming(worker_stats& stats){
+    std::shared_ptr<H> handler = pop(work_queue, stats);
+    if (handler == nullptr) return false;
+
+    handler->deficit += static_cast<long long>(quantum);
+    for (int i = 0; i < MAX_HANDLES_PER_ROUND && handler->deficit > 0; ++i){
+        decltype(handler->handle()) handle_res;
+        {
+            trace_span span("handle", "fd", handler->fd);
+            handle_res = handler->handle();
+        }
+        if (H::finished(handle_res)) return true;
+        handler->deficit -= static_cast<long long>(handler->cost());
+        if (H::exhausted(handle_res)){
+            handler->deficit = 0; // the socket is full: as in DRR, an idle flow doesn't save the credit for later
+            break;
+        }
+        if (handler->interactive()) break;
+    }
+    requeue(std::move(handler));
+    return true;
+}
+
+/**
+ * The constructor of a basic_thread_pool object. Starts min_workers; if only some of them can be started, the pool
+ * goes on with those, it throws only if it can't start any.
+ */
+template<typename H>
+basic_thread_pool<H>::basic_thread_pool(size_t quantum_bytes, pool_limits limits, std::string name):
+        done(false), quantum(quantum_bytes), name(std::move(name)), joiner(threads){
+    const unsigned cpus = std::max(std::thread::hardware_concurrency(), 1u);
+    if (limits.max_workers == 0) limits.max_workers = cpus * POOL_MAX_WORKERS_PER_CPU;
+    limits.max_workers = std::max(limits.max_workers, std::max(limits.min_workers, 1u));
+    limits.min_workers = std::clamp(limits.min_workers, 1u, limits.max_workers);
+    this->limits = limits;
+    workers.reset(new worker_stats[limits.max_workers]);
+    threads.resize(limits.max_workers);
+    cpu_clocks.resize(limits.max_workers);
+    last_cpu_ns.resize(limits.max_workers);
+    metrics_id = register_metrics([this](std::string& out){ report_metrics(out); });
+    while (worker_count < limits.min_workers && start_worker()){}
+    if (worker_count == 0){
+        done=true;
+        unregister_metrics(metrics_id);
+        throw std::runtime_error("Cannot start any worker of the pool " + this->name);
+    }
+    if (worker_count < limits.min_workers){
+        std::cerr << "Pool " << this->name << ": started " << worker_count << " of " << limits.min_workers
+                  << " workers, going on with them" << std::endl;
+        this->limits.min_workers = worker_count;
+    }
+}
+
+/**
+ * Starts the worker in the slot next to the running ones.
+ * @return false if the thread can't be created
+ */
+template<typename H>
+bool basic_thread_pool<H>::start_worker(){
+    const unsigned index = worker_count.load(std::memory_order_relaxed);
+    if (threads[index].joinable()) threads[index].join(); // the retired worker of the slot finishes its round
+    worker_count.store(index + 1); // before the thread starts, or it would exit at once
+    try{
+        threads[index] = std::thread(&basic_thread_pool::worker_thread, this, index);
+    }
+    catch(std::system_error&){
+        worker_count.store(index);
+        return false;
+    }
+    if (pthread_getcpuclockid(threads[index].native_handle(), &cpu_clocks[index]) != 0){
+        cpu_clocks[index] = CLOCK_THREAD_CPUTIME_ID; // unknown: reads the CPU time of the caller, i.e. none
+    }
+    timespec ts{};
+    clock_gettime(cpu_clocks[index], &ts);
+    last_cpu_ns[index] = static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+    peak_workers.store(std::max(peak_workers.load(std::memory_order_relaxed), index + 1), std::memory_order_relaxed);
+    return true;
+}
+
+template<typename H>
+void basic_thread_pool<H>::adapt_size(){
+    const auto now = std::chrono::steady_clock::now();
+    const unsigned n = worker_count.load(std::memory_order_relaxed);
+    for (unsigned i = n; i < limits.max_workers; ++i){
+        if (threads[i].joinable()) threads[i].join(); // retired in the previous interval, exited by now
+    }
+    double cpu_ns = 0; // used by the workers in the interval
+    for (unsigned i = 0; i < n; ++i){
+        timespec ts{};
+        if (clock_gettime(cpu_clocks[i], &ts) != 0) continue;
+        unsigned long long cpu = static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+        cpu_ns += static_cast<double>(cpu - std::min(cpu, last_cpu_ns[i]));
+        last_cpu_ns[i] = cpu;
+    }
+    totals_t t = totals();
+    const bool first = last_sizing_at == std::chrono::steady_clock::time_point();
+    const double wall_ns = std::chrono::duration<double, std::nano>(now - last_sizing_at).count();
+    const double all = static_cast<double>(t.running + t.empty + t.yield - last_sizing.running - last_sizing.empty -
+                                           last_sizing.yield);
+    const double utilization = all > 0 ? (t.running - last_sizing.running) / all : 0;
+    const unsigned long long dequeues = t.dequeues - last_sizing.dequeues;
+    const double delay_us = dequeues ? (t.sojourn_ns - last_sizing.sojourn_ns) / 1000.0 / dequeues : 0;
+    last_sizing = t;
+    last_sizing_at = now;
+    if (first || limits.min_workers == limits.max_workers) return;
+
+    const double cpus_used = cpu_ns / wall_ns;
+    const double cpus = std::max(std::thread::hardware_concurrency(), 1u);
+    auto report = [&](unsigned workers){
+        std::cout << std::fixed << std::setprecision(1) << "Pool " << name << ": " << n << " -> " << workers
+                  << " workers, queue delay " << delay_us / 1000 << " ms, " << 100 * utilization << "% running, "
+                  << cpus_used << " CPUs used" << std::endl;
+    };
+    if (n < limits.max_workers && delay_us >= POOL_GROW_DELAY_US && utilization >= POOL_GROW_UTILIZATION &&
+        cpus_used <= cpus - POOL_IDLE_CPU){
+        low_load_intervals = 0;
+        if (!start_worker()){
+            std::cerr << "Pool " << name << ": cannot start more than " << n << " workers" << std::endl;
+            limits.max_workers = n;
+            return;
+        }
+        grown.fetch_add(1, std::memory_order_relaxed);
+        report(n + 1);
+        return;
+    }
+
+    // the load with one worker less, if the same work is spread over the rest
+    const double scale = n > 1 ? static_cast<double>(n) / (n - 1) : 0;
+    if (n > limits.min_workers &&
+        (delay_us * scale < POOL_SHRINK_DELAY_US || utilization * scale < POOL_SHRINK_UTILIZATION)){
+        if (++low_load_intervals < POOL_SHRINK_INTERVALS) return;
+        low_load_intervals = 0;
+        worker_count.store(n - 1); // the last worker exits after its round, joined by the next call
+        shrunk.fetch_add(1, std::memory_order_relaxed);
+        report(n - 1);
+        return;
+    }
+    low_load_intervals = 0;
+}
+
+template<typename H>
+void basic_thread_pool<H>::submit(std::shared_ptr<H> ch){
+    ch->enqueued = std::chrono::steady_clock::now();
+    ch->enqueued_tsc = trace_enabled.load(std::memory_order_relaxed) ? trace_clock() : 0;
+    if (ch->interactive()) interactive_queue.push(std::move(ch));
+    else work_queue.push(std::move(ch));
+}
+
 #endif //BAUM_CONCURRENCY_UTILS_H
@@ -0,0 +1,83 @@
+#ifndef BAUM_CONNECTION_TABLE_H
+#define BAUM_CONNECTION_TABLE_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include "output_cache.h"
+
+/**
+ * ---- Description ----
+ * Struct-of-arrays state of the streaming connections of one shard. Instead of one heap object per client with its own
+ * seq/step/inits arrays, every field is a contiguous array indexed by the row of the connection, so advancing all the
+ * ready streams by one line is a single branch-free pass the compiler vectorizes.
+ * Only the arithmetic sequences are advanced this way, the connections of the other kinds stay with their
+ * ClientHandler.
+ */
+class ConnectionTable{
+public:
+    /**
+     * Everything the row consists of, to move the connection to another table without breaking its stream.
+     */
+    struct Row{
+        int fd;
+        SequenceConfig cfg; // cfg.seq holds the last sent values
+        std::string pending;
+    };
+
+    /**
+     * Adds the connection, its sequences start from the values of cfg (before the first update).
+     * @return the row of the connection
+     */
+    size_t add(int fd, const SequenceConfig& cfg);
+    size_t add(Row&& row);
+
+    /**
+     * Removes the row by moving the last row into its place, so the arrays stay dense.
+     */
+    void remove(size_t row);
+
+    /**
+     * Removes the row like remove() and returns its state.
+     */
+    Row take(size_t row);
+
+    size_t size() const { return fds.size(); }
+    int file_descriptor(size_t row) const { return fds[row]; }
+
+    /**
+     * ready[row] != 0 means the row takes part in the next advance(), the rest keep their values.
+     */
+    std::vector<uint8_t>& ready_mask() { return ready; }
+
+    /**
+     * Applies one update to every sequence of every ready row.
+     */
+    void advance();
+
+    /**
+     * Formats the current values of the row the same way as the output blocks.
+     * @param out - at least line_size(row) bytes
+     * @return the number of bytes written
+     */
+    size_t render(size_t row, char * out) const;
+
+    size_t line_size(size_t row) const;
+
+    /**
+     * Output of the row which didn't fit into the socket, it's sent before the row advances again.
+     */
+    std::string& pending(size_t row) { return pending_output[row]; }
+
+private:
+    std::vector<uint64_t> value[SEQ_COUNT];
+    std::vector<uint64_t> step[SEQ_COUNT];
+    std::vector<uint64_t> inits[SEQ_COUNT];
+    std::vector<uint8_t> in_use; // bit i is set if the sequence i is printed
+    std::vector<uint8_t> ready;
+    std::vector<int> fds;
+    std::vector<std::string> pending_output;
+};
+
+#endif //BAUM_CONNECTION_TABLE_H
@@ -0,0 +1,96 @@
+#ifndef BAUM_CORO_H
+#define BAUM_CORO_H
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <cstddef>
+#include <new>
+
+/**
+ * ---- Description ----
+ * Minimal coroutine types used by the reactor based server:
+ * 1. Task - detached coroutine, starts right ahead and frees its frame when it finishes. Used for the client sessions.
+ * 2. Lazy<T> - awaitable coroutine, starts on co_await and resumes the awaiting coroutine with the result.
+ * The frames of both are allocated from frame_pool, so a new connection doesn't go to the global allocator.
+ */
+
+/**
+ * Thread local free lists of coroutine frames, one list per FRAME_GRANULARITY bytes size class. The frames are freed
+ * on the same thread they were allocated (each reactor runs its sessions on its own thread), so no locking is needed.
+ */
+class frame_pool{
+public:
+    static const size_t FRAME_GRANULARITY = 64;
+    static const size_t MAX_POOLED_FRAME = 4096; // bigger frames go to the global operator new
+
+    static void* allocate(size_t size);
+    static void deallocate(void * p, size_t size);
+
+    static size_t live_frames(); // frames currently used by the coroutines of this thread
+    static size_t live_bytes();
+};
+
+struct pooled_frame{
+    static void* operator new(size_t size) { return frame_pool::allocate(size); }
+    static void operator delete(void * p, size_t size) { frame_pool::deallocate(p, size); }
+};
+
+class Task{
+public:
+    struct promise_type: pooled_frame{
+        Task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); } // sessions handle their errors themselves
+    };
+};
+
+template<typename T>
+class Lazy{
+public:
+    struct promise_type: pooled_frame{
+        T value{};
+        std::exception_ptr error;
+        std::coroutine_handle<> continuation;
+
+        Lazy get_return_object() noexcept { return Lazy(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct final_awaiter{
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                return h.promise().continuation; // symmetric transfer back to the awaiting coroutine
+            }
+            void await_resume() noexcept {}
+        };
+        final_awaiter final_suspend() noexcept { return {}; }
+
+        void return_value(T v) { value = std::move(v); }
+        void unhandled_exception() noexcept { error = std::current_exception(); }
+    };
+
+    explicit Lazy(std::coroutine_handle<promise_type> h): handle(h) {}
+    Lazy(Lazy&& other) noexcept: handle(std::exchange(other.handle, nullptr)) {}
+    Lazy(const Lazy&) = delete;
+    Lazy& operator=(const Lazy&) = delete;
+    ~Lazy(){
+        if (handle) handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume(){
+        if (handle.promise().error) std::rethrow_exception(handle.promise().error);
+        return std::move(handle.promise().value);
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+#endif //BAUM_CORO_H
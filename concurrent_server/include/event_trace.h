@@ -0,0 +1,82 @@
+#ifndef BAUM_EVENT_TRACE_H
+#define BAUM_EVENT_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/**
+ * ---- Description ----
+ * Timeline tracing of the server event path: accept, queue wait, handle, read, parse, format, write. Every thread
+ * records its spans into its own ring of TRACE_RING_EVENTS, the timestamps are TSC ticks, so a span costs two rdtsc and
+ * a store. While the tracing is off, a span is a relaxed load of trace_enabled.
+ *
+ * dump_trace() writes the spans of all the threads as the Chrome trace-event JSON, which chrome://tracing and Perfetto
+ * open as a timeline. The tracing is switched by baum --trace or, with baum --trace-control, by the "trace on|off" of
+ * the clients, dumped by SIGUSR1 or "trace dump". The clients' dumps overwrite one file, baum-trace-<pid>.json.
+ *
+ * Usage:
+ *     {
+ *         trace_span span("parse", "fd", fd);
+ *         ...
+ *     } // recorded here
+ */
+
+static const size_t TRACE_RING_EVENTS = 1 << 16; // per thread, the oldest events are overwritten
+
+inline std::atomic_bool trace_enabled{false};
+inline std::atomic_bool trace_control{false}; // whether the clients may switch and dump the tracing
+
+/**
+ * @return TSC ticks, or steady clock nanoseconds where there's no TSC
+ */
+uint64_t trace_clock();
+
+/**
+ * Records the span into the ring of the calling thread, the ring is created by the first call of the thread.
+ * @param name, arg_name - string literals, only the pointers are kept
+ */
+void trace_record(const char * name, uint64_t begin, uint64_t end, const char * arg_name = nullptr, long long arg = 0);
+
+class trace_span{
+public:
+    explicit trace_span(const char * name, const char * arg_name = nullptr, long long arg = 0):
+            name(trace_enabled.load(std::memory_order_relaxed) ? name : nullptr), arg_name(arg_name), arg(arg) {
+        if (this->name) begin = trace_clock();
+    }
+    ~trace_span(){
+        if (name) trace_record(name, begin, trace_clock(), arg_name, arg);
+    }
+    trace_span(const trace_span&) = delete;
+    trace_span& operator=(const trace_span&) = delete;
+
+private:
+    const char * name; // nullptr if the tracing was off when the span started
+    const char * arg_name;
+    long long arg;
+    uint64_t begin = 0;
+};
+
+/**
+ * @return trace_clock() ticks per microsecond, measured since the start of the program
+ */
+double trace_ticks_per_us();
+
+void set_tracing(bool on);
+
+void set_trace_control(bool allowed);
+
+/**
+ * Writes the recorded spans of all the threads as the Chrome trace-event JSON. The events which the threads overwrite
+ * during the dump are skipped. The dumps are serialized.
+ * @param path - the file to write, "baum-trace-<pid>-<n>.json" in the working directory if empty
+ * @return the number of the events written, -1 if the file couldn't be written
+ */
+long dump_trace(std::string& path);
+
+/**
+ * The signal makes a background thread call dump_trace() with the default path.
+ */
+void dump_trace_on_signal(int signo);
+
+#endif //BAUM_EVENT_TRACE_H
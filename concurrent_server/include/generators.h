@@ -0,0 +1,67 @@
+#ifndef BAUM_GENERATORS_H
+#define BAUM_GENERATORS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/**
+ * ---- Description ----
+ * The kinds of the sequences a slot may print, chosen by the third argument of "seqN x y [kind]". Every kind is
+ * declared once in the table of generators.cpp with its name and two functions: the seek, which computes the value
+ * after n updates directly, so OutputCache renders any block without the blocks before it, and the batch, which fills
+ * the values of the consecutive lines at once. The batches are written as independent passes over arrays wherever the
+ * recurrence allows it, so the compiler vectorizes them.
+ *
+ * The parameters x and y of the kinds, v0 = x is the value before the first update, the first line prints v1:
+ *     arithmetic - v(k+1) = v(k) + y, restarts from inits on overflow (the default)
+ *     geometric - v(k+1) = v(k) * y, restarts from x on overflow
+ *     fibonacci - v1 = y, v(k+1) = v(k) + v(k-1), restarts from x, y on overflow
+ *     xorshift - Marsaglia's xorshift64 seeded with x << 32 | y, every 64-bit value but 0 once per period. x and y
+ *                are the low and the high half of the seed, so each is taken modulo 2^32 (the protocol numbers have
+ *                6 digits, below 2^20); the zero seed, x = y = 0, is rejected as it stays 0 forever
+ *     pcg - the 64-bit PCG (LCG state, RXS M XS output) seeded with x on the stream y
+ *
+ * Only the arithmetic sequences are turned off by a zero x or y, the other kinds are defined for any x and y.
+ */
+
+enum class SeqKind : uint8_t{
+    arithmetic = 0,
+    geometric = 1,
+    fibonacci = 2,
+    xorshift = 3,
+    pcg = 4
+};
+
+static const int SEQ_KIND_COUNT = 5;
+
+/**
+ * What a generator depends on, the fields of SequenceConfig of one slot.
+ */
+struct SeqParams{
+    uint64_t start; // x
+    uint64_t step; // y
+    uint64_t inits; // arithmetic: the value to restart from on overflow
+};
+
+using seek_fn = uint64_t (*)(const SeqParams& p, uint64_t n);
+using batch_fn = void (*)(const SeqParams& p, uint64_t n, uint64_t * out, size_t count);
+
+struct SequenceGenerator{
+    std::string_view name;
+    seek_fn seek; // the value after n updates
+    batch_fn batch; // out[k] = the value after n + 1 + k updates, for k < count
+};
+
+/**
+ * @return the generator of the kind, the arithmetic one for the values out of the enum
+ */
+const SequenceGenerator& generator_of(SeqKind kind);
+
+/**
+ * @param kind - set to the kind of the name
+ * @return false if no kind has the name
+ */
+bool kind_from_name(std::string_view name, SeqKind& kind);
+
+#endif //BAUM_GENERATORS_H
@@ -0,0 +1,31 @@
+#ifndef BAUM_METRICS_H
+#define BAUM_METRICS_H
+
+#include <functional>
+#include <string>
+
+/**
+ * ---- Description ----
+ * Process-wide list of the metrics sources. A component registers a reporter for its lifetime, the "metrics" command
+ * collects the lines of all of them: "<name> <value>\n", e.g. "pool.clients.worker0.running_us 1200".
+ */
+
+using metrics_reporter = std::function<void(std::string& out)>;
+
+/**
+ * @return the id for unregister_metrics()
+ */
+int register_metrics(metrics_reporter reporter);
+void unregister_metrics(int id);
+
+/**
+ * Appends the lines of all the registered reporters.
+ */
+void report_metrics(std::string& out);
+
+/**
+ * Appends "<name> <value>\n", the helper for the reporters.
+ */
+void append_metric(std::string& out, const std::string& name, unsigned long long value);
+
+#endif //BAUM_METRICS_H
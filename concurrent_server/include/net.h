@@ -12,6 +12,61 @@
 
 static const int LISTENQ = 8; // max number of clients to wait connection in the queue for Unix listen() function
 
+enum class SocketMode{
+    standard = 0, // keep the kernel defaults
+    latency = 1,
+    throughput = 2
+};
+
+/**
+ * Options applied to every accepted socket. Use latency() or throughput() to get the predefined profiles.
+ * Zero buffer sizes keep the kernel defaults (and its autotuning).
+ *
+ * Over the loopback the profiles don't pay off (baum_load, Release, one worker, 1 CPU): 8 clients stream 8.9-9.6M
+ * lines/s with the standard profile, 8.0-8.4M with latency (TCP_NODELAY splits the bulk output) and 8.8-9.2M with
+ * throughput; the p50 gap between the lines at --rate=2000 is 0.59-0.64 ms for all three. They are for the real
+ * networks, where the segments and the buffers matter.
+ *
+ * The cork and the zerocopy alone, with the default buffers (8 clients for 3 s, two runs each, ThreadPoolServer /
+ * CoroutineServer): neither 10.5-18.1M / 11.7-14.1M lines/s, the cork 16.7-19.9M / 16.1-18.3M. An export batch is
+ * FLUSH_BLOCKS blocks, about 6 KB with one column, so with the default zerocopy_threshold nothing is sent with
+ * MSG_ZEROCOPY at all. Forced with the threshold 0 it costs: 12.4M / 9.3-9.7M, 11.4-11.8M / 11.1-11.4M together with
+ * the cork, and the "zerocopy.copied_sends" metric shows that the loopback copies nearly every send anyway.
+ */
+struct SocketProfile{
+    SocketMode mode = SocketMode::standard;
+    bool nodelay = false; // TCP_NODELAY: disable Nagle, every write goes to the wire right ahead
+    bool cork = false; // TCP_CORK while the export streams at full speed, so only full segments are sent
+    int sndbuf = 0; // SO_SNDBUF
+    int rcvbuf = 0; // SO_RCVBUF
+    bool zerocopy = false; // send large output with MSG_ZEROCOPY
+    size_t zerocopy_threshold = 16384; // smaller writes are cheaper to copy than to pin and notify
+
+    static SocketProfile latency();
+    static SocketProfile throughput();
+    static SocketProfile from_name(const std::string& name); // "latency", "throughput", anything else is standard
+};
+
+/**
+ * Applies the profile to the connected socket. Failures are not fatal: the socket keeps working with the defaults.
+ * Only the buffer sizes are applied to Unix domain sockets, the TCP options don't exist there.
+ * @param fd - connected socket
+ * @param profile - options to apply
+ * @return the profile which is actually in effect, e.g. zerocopy is switched off if the kernel doesn't support it
+ */
+SocketProfile apply_socket_profile(int fd, const SocketProfile& profile);
+
+/**
+ * Turns TCP_CORK on or off. Switching it off pushes the pending partial segment.
+ */
+void set_cork(int fd, bool on);
+
+/**
+ * SO_BUSY_POLL and SO_PREFER_BUSY_POLL: the reads of the socket spin on the device queue for up to usecs instead of
+ * waiting for the interrupt. Best effort, raising it above net.core.busy_read needs CAP_NET_ADMIN.
+ */
+void set_busy_poll(int fd, int usecs);
+
 void print_gai_error(int code, const std::string& msg);
 
 void print_error(const std::string& msg);
@@ -60,4 +115,15 @@ int accept_connection(int s, struct sockaddr *addr, socklen_t *addrlen);
  */
 int open_listen_fd(const char *port, const char *ip = nullptr);
 
+/**
+ * Function to open the listening Unix domain socket. Local clients connected through it skip the TCP/IP stack.
+ * Skipping it is not what limits the streaming though: 8 baum_load clients read 8.8M lines/s over it and 8.8-11.0M
+ * over the TCP loopback (Release, one worker, 1 CPU), the formatting of the lines dominates. What it enables is the
+ * shared memory export, 40-42M lines/s, whose ring is passed over it.
+ * @param path - filesystem path of the socket, a stale socket file is removed. If the path starts with '@', the socket
+ * is created in the abstract namespace (Linux), which leaves no file behind.
+ * @return file descriptor integer if success, -1 otherwise
+ */
+int open_listen_unix_fd(const char *path);
+
 #endif //BAUM_NET_H
@@ -0,0 +1,135 @@
+#ifndef BAUM_OUTPUT_CACHE_H
+#define BAUM_OUTPUT_CACHE_H
+
+#include <array>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <limits>
+
+#include "generators.h"
+
+/**
+ * ---- Description ----
+ * Clients which sent the same seq1/seq2/seq3 commands receive byte-identical output. Instead of formatting the lines
+ * once per connection, the output is split into blocks of LINES_PER_BLOCK lines, and every block is rendered once per
+ * distinct configuration into an immutable buffer. ClientHandlers share the buffers through std::shared_ptr and
+ * send from them at their own offsets. Once the cache is full, the evicted block which nobody sends from anymore is
+ * rendered again in place for the new one, so a steady stream allocates nothing.
+ */
+
+static const int SEQ_COUNT = 3;
+static const int SEQ_WIDTH = 25; // width of the single column of the output
+static const int LINES_PER_BLOCK = 64;
+static const size_t OUTPUT_CACHE_CAPACITY = 4096; // blocks kept alive by the cache itself, subscribers may keep more
+
+/**
+ * Everything the output of the client depends on. Two clients with equal configs get equal output.
+ */
+struct SequenceConfig{
+    std::array<unsigned long long, SEQ_COUNT> seq{0, 0, 0}; // value before the first update
+    std::array<unsigned long long, SEQ_COUNT> step{1, 1, 1};
+    std::array<bool, SEQ_COUNT> seq_in_use{true, true, true};
+    std::array<unsigned long long, SEQ_COUNT> inits{0, 0, 0}; // value to restart from on overflow
+    std::array<SeqKind, SEQ_COUNT> kind{}; // arithmetic by default, see generators.h
+
+    bool operator==(const SequenceConfig& other) const;
+
+    bool nothing_to_show() const;
+
+    /**
+     * @return the length of the single output line, including the line feed.
+     */
+    size_t line_size() const;
+
+    /**
+     * @return true if every sequence is arithmetic, the only kind ConnectionTable advances
+     */
+    bool arithmetic_only() const;
+
+    SeqParams params(int i) const { return SeqParams{seq[i], step[i], inits[i]}; }
+
+    /**
+     * Computes the value of the sequence after n updates without the updates before, see SequenceGenerator::seek.
+     * For the arithmetic sequences it's O(1): if the next step would overflow, the counter restarts from inits.
+     * @param i index of the sequence
+     * @param n number of updates
+     */
+    unsigned long long value_after(int i, unsigned long long n) const{
+        return generator_of(kind[i]).seek(params(i), n);
+    }
+
+    /**
+     * The values of the consecutive lines at once: out[k] is the value after n + 1 + k updates.
+     */
+    void values_after(int i, unsigned long long n, uint64_t * out, size_t count) const{
+        generator_of(kind[i]).batch(params(i), n, out, count);
+    }
+};
+
+struct SequenceConfigHash{
+    size_t operator()(const SequenceConfig& cfg) const;
+};
+
+/**
+ * Rendered piece of the output: lines [index * LINES_PER_BLOCK + 1, (index + 1) * LINES_PER_BLOCK]. Immutable for
+ * the subscribers, who get it as shared_ptr<const OutputBlock>; only OutputCache renders it again, when it's unused.
+ */
+struct OutputBlock{
+    OutputBlock(const SequenceConfig& cfg, unsigned long long index);
+
+    /**
+     * Renders the other block into the same buffer, allocates only if the lines of cfg are longer.
+     */
+    void render(const SequenceConfig& cfg, unsigned long long index);
+
+    unsigned long long index;
+    std::string data;
+};
+
+class OutputCache{
+public:
+    OutputCache();
+    OutputCache(const OutputCache&) = delete;
+    OutputCache& operator=(const OutputCache&) = delete;
+
+    /**
+     * Returns the block of the given configuration, rendering it only if no other client did it recently.
+     * @param cfg configuration of the client
+     * @param index number of the block
+     * @return shared immutable block, never nullptr (std::bad_alloc is propagated)
+     */
+    std::shared_ptr<const OutputBlock> acquire(const SequenceConfig& cfg, unsigned long long index);
+
+    unsigned long long rendered_blocks() const { return rendered; }
+    unsigned long long shared_blocks() const { return hits; }
+
+private:
+    static const int SHARDS = 16; // independent locks, so clients with different configs don't contend
+
+    struct Key{
+        SequenceConfig cfg;
+        unsigned long long index;
+        bool operator==(const Key& other) const { return index == other.index && cfg == other.cfg; }
+    };
+    struct KeyHash{
+        size_t operator()(const Key& key) const;
+    };
+    static const size_t SHARD_CAPACITY = OUTPUT_CACHE_CAPACITY / SHARDS;
+
+    struct Shard{
+        std::mutex mut;
+        std::unordered_map<Key, std::shared_ptr<OutputBlock>, KeyHash> blocks;
+        std::vector<Key> order; // ring of the keys in insertion order, the oldest block is evicted first
+        size_t oldest = 0; // index of the oldest key once the ring is full
+    };
+
+    std::array<Shard, SHARDS> shards;
+    std::atomic<unsigned long long> rendered{0};
+    std::atomic<unsigned long long> hits{0};
+};
+
+#endif //BAUM_OUTPUT_CACHE_H
@@ -0,0 +1,62 @@
+#ifndef BAUM_PREFORK_H
+#define BAUM_PREFORK_H
+
+#include <sys/types.h>
+#include <csignal>
+#include <chrono>
+#include <functional>
+#include <vector>
+
+/**
+ * ---- Description ----
+ * Multi-process mode: the master opens the listening socket and forks the workers, which inherit it and accept from it
+ * in their own event loops. Every worker has its own heap, its own output cache and its own crash domain: a worker
+ * which dies takes only its clients with it, and the master forks a new one in its place. The clients waiting in the
+ * backlog of the shared socket are not lost meanwhile, the other workers accept them.
+ *
+ * The workers wait for the socket with EPOLLEXCLUSIVE (see Reactor::add), so a new client wakes up one of them rather
+ * than all. The master only forks and waits; it must not start any threads of its own before run(), fork() copies just
+ * the calling thread.
+ */
+
+static const int PREFORK_CRASH_WINDOW_MS = 1000; // a worker which dies sooner than that after the start is crashing
+static const int PREFORK_RESTART_DELAY_MS = 1000; // the pause before the restart of a crashing worker
+
+class PreforkMaster{
+public:
+    /**
+     * @param worker_main - runs in the worker process with the index of the worker, the worker exits when it returns
+     */
+    using worker_fn = std::function<void(unsigned worker)>;
+
+    PreforkMaster(unsigned workers, worker_fn worker_main);
+    PreforkMaster(const PreforkMaster&) = delete;
+    PreforkMaster& operator=(const PreforkMaster&) = delete;
+
+    /**
+     * Forks the workers and restarts the ones which die, until the master gets SIGTERM or SIGINT. Then the workers are
+     * terminated and waited for. The master blocks these signals and SIGCHLD and takes them with sigwaitinfo(), so a
+     * stop signal can't slip in between a check and the wait.
+     * @return the exit code of the master
+     */
+    int run();
+
+private:
+    struct worker_slot{
+        pid_t pid = -1;
+        std::chrono::steady_clock::time_point started;
+    };
+
+    worker_fn worker_main;
+    std::vector<worker_slot> slots;
+    unsigned long long restarts = 0;
+    sigset_t worker_mask; // the signal mask before run(), restored in the workers
+
+    /**
+     * Forks the worker of the slot. Never returns in the child.
+     * @return false if fork() failed
+     */
+    bool spawn(unsigned worker);
+};
+
+#endif //BAUM_PREFORK_H
@@ -0,0 +1,93 @@
+#ifndef BAUM_PROXY_H
+#define BAUM_PROXY_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+
+#include "reactor.h"
+
+/**
+ * ---- Description ----
+ * L4 front proxy for several baum servers: accepts the clients on the public endpoint, connects each of them to one
+ * of the backend servers and moves the bytes both ways with splice() through a pipe, so the data never gets copied to
+ * the user space. The proxy knows nothing about the protocol. Every reactor thread runs its own share of the sessions,
+ * the same way as in CoroutineServer.
+ */
+
+enum class BalanceMode{
+    least_connections = 0, // the backend with the fewest sessions of this proxy
+    consistent_hash = 1 // by the client IP address, so a client host keeps its backend while the set doesn't change
+};
+
+struct Backend{
+    std::string host, port;
+    sockaddr_storage addr{};
+    socklen_t addrlen = 0;
+    std::atomic<int> connections{0}; // sessions of this proxy, including the connecting ones
+    std::atomic<long long> down_until{0}; // steady clock ns: after a failed connect the backend is tried last till then
+};
+
+class Proxy{
+public:
+    static const int VIRTUAL_NODES = 64; // points of every backend on the hash ring
+    static const int BACKEND_RETRY_MS = 1000;
+    static const size_t SPLICE_CHUNK = 65536; // the default pipe capacity
+
+    /**
+     * Opens the listening socket and resolves the backends. Throws std::runtime_error on failure.
+     * @param backends - "host:port" of every backend server
+     * @param reactors - number of threads with their own Reactor
+     */
+    Proxy(const char *port, const char *ip, const std::vector<std::string>& backends,
+          BalanceMode mode = BalanceMode::least_connections,
+          unsigned reactors = std::thread::hardware_concurrency());
+    ~Proxy();
+    Proxy(const Proxy&) = delete;
+    Proxy& operator=(const Proxy&) = delete;
+
+    /**
+     * Starts the reactors, the calling thread runs one of them. Never returns.
+     */
+    void accept_connections();
+
+private:
+    struct Session;
+
+    int listening_fd;
+    BalanceMode mode;
+    unsigned reactor_count;
+    std::vector<std::unique_ptr<Backend>> backends;
+    std::vector<std::pair<uint32_t, size_t>> ring; // (point, backend index), sorted by the point
+
+    void run_reactor();
+
+    Task accept_loop(Reactor& reactor);
+
+    /**
+     * Connects the client to the first backend which accepts the connection, then starts the pumps.
+     */
+    Task client_session(Reactor& reactor, int connfd, sockaddr_storage clientaddr);
+
+    /**
+     * Moves the bytes from one socket to the other until EOF, which is passed on with shutdown(SHUT_WR).
+     * On error both sockets are shut down, so the pump of the other direction ends as well.
+     * @param session - only held: the sockets are closed when the pumps of both directions have released it
+     */
+    Task pump(Reactor& reactor, std::shared_ptr<Session> session, int from, int to);
+
+    /**
+     * @return connected non-blocking socket registered in the reactor, -1 if the backend is unreachable
+     */
+    Lazy<int> connect_backend(Reactor& reactor, Backend& backend);
+
+    /**
+     * @return the indices of the backends in the order to try them for the client
+     */
+    std::vector<size_t> candidates(const sockaddr_storage& clientaddr) const;
+};
+
+#endif //BAUM_PROXY_H
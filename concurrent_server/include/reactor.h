@@ -0,0 +1,157 @@
+#ifndef BAUM_REACTOR_H
+#define BAUM_REACTOR_H
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <sys/uio.h>
+
+#include "coro.h"
+
+static const int BUSY_POLL_USECS = 50; // SO_BUSY_POLL of the sockets and the epoll busy poll of a busy-polling reactor
+static const int BUSY_POLL_BUDGET = 64; // packets per busy poll of the epoll instance
+static const int ACCEPT_RETRY_MS = 100; // the pause of an accept loop after accept() ran out of descriptors or memory
+
+/**
+ * ---- Description ----
+ * Single threaded epoll event loop which resumes the coroutines waiting for their sockets. Every socket is registered
+ * once in the edge-triggered mode; a coroutine tries the syscall first and suspends only after EAGAIN.
+ *
+ * Every reactor reports "reactor.<n>.resumptions", ".frames" and ".frame_bytes" (the coroutine frames of its thread,
+ * see frame_pool) to the "metrics" command. They are published once per round of the loop.
+ *
+ * A busy-polling reactor never sleeps in epoll_wait(): it polls with zero timeout in a loop and asks the kernel to busy
+ * poll the device queues of its sockets (epoll busy poll parameters), trading a whole core for the wake-up latency.
+ */
+class Reactor{
+public:
+    explicit Reactor(bool busy_poll = false);
+    ~Reactor();
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    /**
+     * Registers the non-blocking socket in the reactor.
+     * @param fd - socket to watch
+     * @param exclusive - EPOLLEXCLUSIVE, for the listening socket shared by several reactors
+     */
+    void add(int fd, bool exclusive = false);
+    void remove(int fd);
+
+    /**
+     * Runs the loop in the calling thread until stop() is called.
+     */
+    void run();
+    void stop() { done = true; }
+
+    struct io_awaiter{
+        Reactor& reactor;
+        int fd;
+        bool write;
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h);
+        void await_resume() const noexcept {}
+    };
+    io_awaiter readable(int fd) { return {*this, fd, false}; }
+    io_awaiter writable(int fd) { return {*this, fd, true}; }
+
+    /**
+     * Reschedules the coroutine after the other ready ones, so a client with a fast socket doesn't starve the others.
+     */
+    struct yield_awaiter{
+        Reactor& reactor;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) { reactor.ready.push_back(h); }
+        void await_resume() const noexcept {}
+    };
+    yield_awaiter yield() { return {*this}; }
+
+    /**
+     * Resumes the coroutine after the delay, e.g. to retry what failed for the lack of resources while the other
+     * coroutines of the reactor release them.
+     */
+    struct sleep_awaiter{
+        Reactor& reactor;
+        std::chrono::milliseconds delay;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h);
+        void await_resume() const noexcept {}
+    };
+    sleep_awaiter sleep_for(std::chrono::milliseconds delay) { return {*this, delay}; }
+
+    unsigned long long resumptions() const { return resumed; } // coroutine switches done by this reactor
+
+    bool busy_polling() const { return busy_poll; }
+
+private:
+    struct fd_state{
+        std::coroutine_handle<> reader, writer;
+        bool readable = false, writable = false; // edge reported while nobody was waiting
+    };
+
+    int epfd;
+    bool busy_poll;
+    bool done = false;
+    std::vector<fd_state> fds; // indexed by the file descriptor
+    std::vector<std::coroutine_handle<>> ready; // to be resumed by the next round
+    std::vector<std::coroutine_handle<>> running; // resumed by this round, swapped with ready so nothing is allocated
+    std::vector<std::pair<std::chrono::steady_clock::time_point, std::coroutine_handle<>>> sleeping; // few, unsorted
+
+    // the counters of the reactor thread, read by the "metrics" command from the other threads
+    std::atomic<unsigned long long> published_resumptions{0}, published_frames{0}, published_frame_bytes{0};
+    int metrics_id = -1;
+    unsigned long long resumed = 0;
+
+    fd_state& state(int fd);
+
+    /**
+     * Moves the sleeping coroutines which are due to ready.
+     * @return the epoll_wait() timeout until the next one is due, -1 if none sleeps
+     */
+    int wake_sleeping();
+};
+
+/**
+ * Non-blocking connected socket bound to a reactor. Closes the socket upon destruction, or if it can't be registered
+ * in the reactor, when the constructor throws std::runtime_error.
+ */
+class AsyncSocket{
+public:
+    static const int READ_BUFSIZE = 512; // commands are short, the buffer lives in the coroutine frame
+
+    AsyncSocket(Reactor& reactor, int fd);
+    ~AsyncSocket();
+    AsyncSocket(const AsyncSocket&) = delete;
+    AsyncSocket& operator=(const AsyncSocket&) = delete;
+
+    /**
+     * Reads the line including '\n', or at most max_len chars. The bytes after the line stay buffered for the next call.
+     * @return the length of the line, 0 on EOF with nothing read, -1 on error
+     */
+    Lazy<ssize_t> read_line(std::string& line, size_t max_len);
+
+    /**
+     * Reads what has arrived without waiting, the buffered bytes first.
+     * @return the number of bytes read, 0 if there's nothing, -1 on EOF or error
+     */
+    ssize_t read_available(char * data, size_t size);
+
+    /**
+     * Writes everything, suspending while the socket buffer is full.
+     * @return false if the client is disconnected
+     */
+    Lazy<bool> write_all(const char * data, size_t size);
+    Lazy<bool> write_all(struct iovec * iov, int iovcnt); // modifies iov
+
+    int file_descriptor() const { return fd; }
+    Reactor& owner() { return reactor; }
+
+private:
+    Reactor& reactor;
+    int fd;
+    int pos = 0, len = 0; // unread bytes are buffer[pos, len)
+    char buffer[READ_BUFSIZE];
+};
+
+#endif //BAUM_REACTOR_H
@@ -0,0 +1,96 @@
+#ifndef BAUM_SESSION_STORE_H
+#define BAUM_SESSION_STORE_H
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "output_cache.h"
+
+/**
+ * ---- Description ----
+ * Sessions which outlive the connections and the server process. Every session is a fixed size record of a memory
+ * mapped file: the sequences config and the position of the export in the output. The token given to the client holds
+ * the index of the record in its low bits, so "resume <token>" finds the record in O(1); the rest of the token is
+ * random and is compared with the one in the record. The position is written to the mapped memory after every write
+ * to the socket, so it survives a crash of the server as well. What the socket buffers held when the connection broke
+ * is lost though, the client misses it.
+ *
+ * Layout of the file: session_store_header, then SESSION_STORE_CAPACITY records.
+ */
+
+static const uint32_t SESSION_STORE_MAGIC = 0x62736573; // "bses"
+static const uint32_t SESSION_STORE_CAPACITY = 65536; // must be a power of two
+static const int SESSION_SLOT_BITS = 16; // log2(SESSION_STORE_CAPACITY)
+
+struct session_store_header{
+    uint32_t magic;
+    uint32_t capacity;
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+struct alignas(64) session_record{
+    uint64_t token; // 0 if the record is free
+    uint64_t first_block; // position: the first block not sent completely
+    uint64_t block_offset; // and the bytes of it already sent
+    int64_t last_seen; // unix time of the last attach or detach
+    uint64_t seq[SEQ_COUNT];
+    uint64_t step[SEQ_COUNT];
+    uint64_t inits[SEQ_COUNT];
+    uint32_t in_use; // bit i is set if the sequence i is printed
+    uint8_t kind[SEQ_COUNT]; // SeqKind, 0 (arithmetic) in the records of the older versions
+};
+
+class SessionStore{
+public:
+    /**
+     * Maps the store, creates the file if it doesn't exist. Throws std::runtime_error on failure.
+     */
+    explicit SessionStore(const char *path);
+    ~SessionStore();
+    SessionStore(const SessionStore&) = delete;
+    SessionStore& operator=(const SessionStore&) = delete;
+
+    /**
+     * Creates the session attached to the calling connection. If the store is full, the session seen the longest time
+     * ago is replaced.
+     * @param slot - set to the index of the record
+     * @return the token for the client, 0 if all the sessions are attached
+     */
+    uint64_t create(int& slot);
+
+    /**
+     * Attaches the existing session to the calling connection.
+     * @return the index of the record, -1 if the token is unknown or the session is attached to another connection
+     */
+    int attach(uint64_t token);
+    void detach(int slot);
+
+    uint64_t token(int slot) const { return records[slot].token; }
+
+    void save_config(int slot, const SequenceConfig& cfg);
+    SequenceConfig load_config(int slot) const;
+
+    /**
+     * Called after every write of the export, only a couple of stores to the mapped memory.
+     */
+    void save_position(int slot, unsigned long long first_block, size_t block_offset){
+        records[slot].first_block = first_block;
+        records[slot].block_offset = block_offset;
+    }
+    unsigned long long first_block(int slot) const { return records[slot].first_block; }
+    size_t block_offset(int slot) const { return records[slot].block_offset; }
+
+private:
+    int fd;
+    size_t size;
+    session_store_header * header;
+    session_record * records;
+
+    std::mutex mut; // guards the allocation and attached
+    std::vector<int> free_slots;
+    std::vector<bool> attached; // the record is used by a live connection, not persisted
+};
+
+#endif //BAUM_SESSION_STORE_H
@@ -0,0 +1,103 @@
+#ifndef BAUM_SHM_RING_H
+#define BAUM_SHM_RING_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * ---- Description ----
+ * Single producer single consumer ring of sequence frames in shared memory, the transport for the clients on the same
+ * host. The server creates the memory with memfd_create() and passes the memfd and an eventfd to the client over the
+ * Unix socket (SCM_RIGHTS). After that the values go through the ring without syscalls; the eventfd is written only
+ * when the consumer went to sleep on an empty ring.
+ *
+ * Layout of the memory: shm_ring_header, then capacity frames.
+ */
+
+static const uint32_t SHM_RING_MAGIC = 0x6261756d; // "baum"
+static const uint32_t SHM_RING_FRAMES = 65536; // must be a power of two
+
+/**
+ * One output line: values of the sequences, unused sequences are 0 and have their bit cleared in seq_mask.
+ */
+struct seq_frame{
+    uint64_t line; // number of the line, starting from 1
+    uint64_t values[3];
+};
+
+struct shm_ring_header{
+    uint32_t magic;
+    uint32_t capacity; // number of frames
+    uint32_t frame_size;
+    uint32_t seq_mask; // bit i is set if the sequence i is in use
+    alignas(64) std::atomic<uint64_t> head; // frames written by the producer
+    alignas(64) std::atomic<uint64_t> tail; // frames read by the consumer
+    alignas(64) std::atomic<uint32_t> consumer_waiting; // consumer sleeps on the eventfd
+};
+
+class ShmRingProducer{
+public:
+    /**
+     * Creates the shared memory and the eventfd. Throws std::runtime_error on failure.
+     */
+    ShmRingProducer(uint32_t capacity, uint32_t seq_mask);
+    ~ShmRingProducer();
+    ShmRingProducer(const ShmRingProducer&) = delete;
+    ShmRingProducer& operator=(const ShmRingProducer&) = delete;
+
+    /**
+     * @param n - set to the number of frames which can be written contiguously, 0 if the ring is full
+     * @return where to write the frames
+     */
+    seq_frame* claim(size_t& n);
+
+    /**
+     * Makes n claimed frames visible to the consumer and wakes it up if it sleeps.
+     */
+    void publish(size_t n);
+
+    int memory_fd() const { return memfd; }
+    int event_fd() const { return eventfd; }
+    size_t memory_size() const { return size; }
+
+private:
+    int memfd, eventfd;
+    size_t size;
+    shm_ring_header * header;
+    seq_frame * frames;
+};
+
+class ShmRingConsumer{
+public:
+    /**
+     * Maps the ring received from the server, takes the ownership of both descriptors.
+     */
+    ShmRingConsumer(int memfd, int eventfd);
+    ~ShmRingConsumer();
+    ShmRingConsumer(const ShmRingConsumer&) = delete;
+    ShmRingConsumer& operator=(const ShmRingConsumer&) = delete;
+
+    /**
+     * Copies up to n frames, never blocks.
+     * @return number of frames read
+     */
+    size_t read(seq_frame * out, size_t n);
+
+    /**
+     * Blocks on the eventfd until the producer publishes new frames.
+     * @param timeout_ms - -1 waits forever
+     * @return false on timeout
+     */
+    bool wait(int timeout_ms = -1);
+
+    uint32_t seq_mask() const { return header->seq_mask; }
+
+private:
+    int memfd, eventfd;
+    size_t size;
+    shm_ring_header * header;
+    const seq_frame * frames;
+};
+
+#endif //BAUM_SHM_RING_H
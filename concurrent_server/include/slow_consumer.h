@@ -0,0 +1,105 @@
+#ifndef BAUM_SLOW_CONSUMER_H
+#define BAUM_SLOW_CONSUMER_H
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+/**
+ * ---- Description ----
+ * Detection of the clients which read slower than they asked to receive. Without it the output of such a client sits in
+ * its socket buffer and in the output blocks it pins, and the writer keeps retrying. Every SLOW_SAMPLE_INTERVAL_MS the
+ * exporting connection is sampled from the kernel: the bytes still queued in the socket (SIOCOUTQ), and for TCP the
+ * TCP_INFO counters of the delivered bytes and of the time the peer's receive window held the sending back.
+ *
+ * A consumer is slow if it left the output unread over the interval (its window was closed at least half of the
+ * interval, or the queue is above SLOW_QUEUE_BYTES for the Unix sockets) while taking less than the minimum rate: half
+ * of its "rate" if it asked for one, slow_consumer_policy::min_rate otherwise. It's fast again after
+ * SLOW_RECOVER_SAMPLES samples in a row which are not slow.
+ *
+ * When a consumer is classified slow, its send buffer is cut to SLOW_SNDBUF for the rest of the connection, and while
+ * it stays slow the policy applies:
+ *     drop - the output block which doesn't fit into the socket is skipped instead of waited for, the client gets the
+ *            lines of the moment it reads, with gaps
+ *     downsample - only every SLOW_DOWNSAMPLE_FACTOR-th line is sent
+ *     disconnect - the client is disconnected
+ */
+
+static const int SLOW_SAMPLE_INTERVAL_MS = 250;
+static const unsigned long long SLOW_MIN_RATE = 64 * 1024; // bytes per second, when the client didn't ask for a rate
+static const unsigned SLOW_QUEUE_BYTES = 64 * 1024; // unread bytes of a Unix socket which mean the client isn't reading
+static const int SLOW_RECOVER_SAMPLES = 4;
+static const int SLOW_SNDBUF = 64 * 1024; // bounds the kernel memory pinned by a slow consumer
+static const int SLOW_DOWNSAMPLE_FACTOR = 8;
+
+enum class SlowConsumerAction{
+    none = 0, // the consumers are not sampled
+    drop = 1,
+    downsample = 2,
+    disconnect = 3
+};
+
+/**
+ * The policy of the server and the counters of its decisions, shared by all the connections. Reports the counters as
+ * "slow_consumers.*" metrics for its lifetime.
+ */
+class slow_consumer_policy{
+public:
+    slow_consumer_policy();
+    ~slow_consumer_policy();
+    slow_consumer_policy(const slow_consumer_policy&) = delete;
+    slow_consumer_policy& operator=(const slow_consumer_policy&) = delete;
+
+    /**
+     * @return the action named "drop", "downsample" or "disconnect", none for anything else
+     */
+    static SlowConsumerAction action_from_name(const std::string& name);
+
+    SlowConsumerAction action = SlowConsumerAction::none; // set before the server accepts the connections
+    unsigned long long min_rate = SLOW_MIN_RATE;
+
+    std::atomic<unsigned long long> samples{0};
+    std::atomic<unsigned long long> slow_now{0};
+    std::atomic<unsigned long long> classified{0}, recovered{0};
+    std::atomic<unsigned long long> dropped_lines{0}, skipped_lines{0}, disconnected{0}; // drop, downsample, disconnect
+
+private:
+    int metrics_id;
+};
+
+/**
+ * The state of one exporting connection.
+ */
+class slow_consumer_monitor{
+public:
+    explicit slow_consumer_monitor(slow_consumer_policy * policy): policy(policy) {}
+    ~slow_consumer_monitor();
+    slow_consumer_monitor(const slow_consumer_monitor&) = delete;
+    slow_consumer_monitor& operator=(const slow_consumer_monitor&) = delete;
+
+    /**
+     * Samples the socket if the interval has passed and classifies the consumer. Cheap between the samples.
+     * @param written - bytes written to the socket since the export started
+     * @param requested_rate - bytes per second the client asked for, 0 if it didn't
+     * @return the action to apply now: the policy's one while the consumer is slow, none otherwise
+     */
+    SlowConsumerAction check(int fd, unsigned long long written, unsigned long long requested_rate);
+
+    /**
+     * Starts over, e.g. after a pause: the samples taken before don't describe the consumer anymore.
+     */
+    void reset();
+
+    bool slow() const { return is_slow; }
+
+private:
+    slow_consumer_policy * policy; // nullptr: never sampled
+    bool is_slow = false;
+    bool started = false;
+    int good_samples = 0;
+    std::chrono::steady_clock::time_point last_sample;
+    unsigned long long last_delivered = 0;
+    unsigned long long last_rwnd_limited_us = 0;
+};
+
+#endif //BAUM_SLOW_CONSUMER_H
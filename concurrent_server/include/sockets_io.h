@@ -8,32 +8,64 @@
 #include <cstdio>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <cerrno>
 #include <cstring>
 #include <string>
+#include <deque>
+#include <memory>
 
 static const int BUFSIZE = 8192;
+static const int IO_INLINE_SIZE = 64; // unread bytes an idle connection keeps without a buffer, a pipelined command
+static const size_t RECV_BUFFER_POOL_MAX = 1024; // free buffers kept by the pool, the rest are freed
 enum class HandleStatus;
 
+/**
+ * The receive buffers of BUFSIZE bytes shared by all the connections. A connection borrows one only while it reads,
+ * so the memory is proportional to the connections which are sending, not to the connected ones.
+ */
+char * borrow_recv_buffer();
+void return_recv_buffer(char * buffer);
+
 /**
  * Helper struct to buffer the response from the Unix read() function.
  * It's used by robust_read() which decides whether to read from the buffer of ioResult_t (which was filled before)
- * or use Unix read() and fill the buffer of ioResult_t
+ * or use Unix read() and fill the buffer of ioResult_t. The buffer is borrowed from the pool for the read and given back
+ * by release(), the unread bytes are moved to the inline area then.
  */
 struct ioResult_t{
     explicit ioResult_t(int connfd){
         fd = connfd;
         cntLeft = 0;
-        pNextByte = buffer;
+        pNextByte = inline_buffer;
+    }
+    ~ioResult_t(){
+        if (buffer) return_recv_buffer(buffer);
     }
+    ioResult_t(const ioResult_t&) = delete;
+    ioResult_t& operator=(const ioResult_t&) = delete;
+
+    /**
+     * Gives the buffer back to the pool if the unread bytes fit into the inline area, e.g. after a complete command.
+     */
+    void release();
 
     int fd; // file descriptor from where the data comes
     int cntLeft; // number of unread bytes
     char * pNextByte; // next byte to read
-    char buffer[BUFSIZE]{};
+    char * buffer = nullptr; // BUFSIZE bytes borrowed while reading
+    char inline_buffer[IO_INLINE_SIZE];
 };
 
-HandleStatus readline_wrapper(int fd, std::string&);
+/**
+ * Reads the next line through the buffer of the connection. The bytes after the line stay in io_buf for the next call,
+ * so the commands the client sent in a single write are all read; an incomplete line stays in line. The receive buffer
+ * is released when the line is complete or the socket has nothing more.
+ * @param io_buf - the buffer which lives as long as the connection
+ * @param line - the line so far, complete if ok is returned
+ * @return ok, try_again if the line is not complete yet, disconnected on EOF
+ */
+HandleStatus readline_wrapper(ioResult_t& io_buf, std::string& line);
 
 /**
  * Handles the low level interaction with Unix read() function, using the structure defined above for buffering.
@@ -61,4 +93,66 @@ int robust_readline(ioResult_t * pResult, std::string& line, size_t maxLen);
  */
 int robust_write(int fd, const std::string& line);
 
+/**
+ * Single non-blocking attempt to write the buffers to the connected socket. Unlike robust_write() it doesn't wait until
+ * everything is sent, the caller keeps the offset and continues later.
+ * @param fd - file descriptor where to write
+ * @param iov - buffers to write
+ * @param iovcnt - number of buffers
+ * @return - number of bytes written, 0 if the socket is not ready, -1 on error (e.g. client disconnected)
+ */
+ssize_t robust_writev(int fd, const struct iovec * iov, int iovcnt);
+
+/**
+ * Sends the message together with the file descriptors (SCM_RIGHTS). Works only over Unix domain sockets.
+ * @param fd - connected Unix socket
+ * @param msg - non-empty message to accompany the descriptors
+ * @param fds - descriptors to pass, the receiver gets their duplicates
+ * @param nfds - number of descriptors, at most MAX_PASSED_FDS
+ * @return number of bytes of msg sent, -1 on error
+ */
+static const int MAX_PASSED_FDS = 4;
+ssize_t send_with_fds(int fd, const std::string& msg, const int * fds, int nfds);
+
+/**
+ * Receives the message sent with send_with_fds().
+ * @param fds - where to put the received descriptors
+ * @param nfds - in: capacity of fds, out: number of received descriptors
+ * @return number of bytes received into buf, 0 on EOF, -1 on error
+ */
+ssize_t recv_with_fds(int fd, char * buf, size_t len, int * fds, int& nfds);
+
+/**
+ * Book-keeping of the MSG_ZEROCOPY sends of one socket. The kernel reads the user memory after sendmsg() returns, so
+ * the buffers are kept alive by their owners until the completion notification is reaped from the error queue.
+ */
+class zerocopy_sender{
+public:
+    static const size_t MAX_IN_FLIGHT = 256; // above that the sends are copied until the completions are reaped
+
+    /**
+     * Single non-blocking attempt to send the buffers with MSG_ZEROCOPY, same return values as robust_writev().
+     * @param owners - iovcnt pointers which keep the memory of the corresponding buffers alive
+     */
+    ssize_t send(int fd, const struct iovec * iov, int iovcnt, const std::shared_ptr<const void> * owners);
+
+    /**
+     * Reads the completion notifications from the error queue of the socket and releases the completed buffers.
+     */
+    void reap(int fd);
+
+    bool can_send() const { return in_flight.size() < MAX_IN_FLIGHT; }
+    // sends where the kernel fell back to copying; all the sockets together are the zerocopy.* metrics
+    unsigned long long copied_sends() const { return copied; }
+
+private:
+    struct in_flight_send{
+        unsigned int id;
+        std::shared_ptr<const void> owner;
+    };
+    unsigned int next_id = 0; // the kernel numbers successful zerocopy sends of the socket from 0
+    std::deque<in_flight_send> in_flight;
+    unsigned long long copied = 0;
+};
+
 #endif //BAUM_SOCKETS_IO_H
@@ -0,0 +1,64 @@
+#ifndef BAUM_UDP_EXPORT_H
+#define BAUM_UDP_EXPORT_H
+
+#include <sys/types.h>
+#include <cstdint>
+#include <vector>
+
+#include "output_cache.h"
+#include "shm_ring.h"
+
+/**
+ * ---- Description ----
+ * Best-effort export for the consumers which tolerate the loss: "export udp <port> [gso]" sends the sequences in UDP
+ * datagrams to the port of the host the command came from, the TCP connection stays the control channel ("pause",
+ * "rate", "stop"; closing it ends the export). Nothing is retransmitted and the datagrams are not kept per connection.
+ *
+ * A datagram is udp_datagram_header followed by count seq_frame (shm_ring.h): the number of the line and its values,
+ * so the consumer sees the lost lines as the gaps in the numbers. UDP_BATCH_DATAGRAMS datagrams go to one sendmmsg()
+ * call. With gso they are grouped into messages of UDP_GSO_SEGMENTS datagrams which the kernel (or the NIC) splits
+ * (UDP_SEGMENT), so the stack is traversed once per message instead of once per datagram.
+ *
+ * The syscalls, the datagrams, the values and the CPU time of the export are reported as the "udp.*" metrics.
+ */
+
+static const uint32_t UDP_DATAGRAM_MAGIC = 0x62756470; // "budp"
+static const int UDP_FRAMES_PER_DATAGRAM = 40; // 1288 bytes, fits the usual MTU of 1500 with the IP and UDP headers
+static const int UDP_BATCH_DATAGRAMS = 64; // per sendmmsg()
+static const int UDP_GSO_SEGMENTS = 16; // datagrams per message with gso
+
+struct udp_datagram_header{
+    uint32_t magic;
+    uint32_t count; // number of the frames which follow
+};
+
+static const size_t UDP_DATAGRAM_SIZE = sizeof(udp_datagram_header) + UDP_FRAMES_PER_DATAGRAM * sizeof(seq_frame);
+
+class UdpExporter{
+public:
+    /**
+     * Opens the UDP socket connected to the given port of the peer of the control connection. Throws
+     * std::runtime_error if the control connection is not over IP or the socket can't be opened.
+     * @param gso - send with UDP_SEGMENT, falls back to the separate datagrams if the kernel refuses
+     */
+    UdpExporter(int control_fd, uint16_t port, bool gso);
+    ~UdpExporter();
+    UdpExporter(const UdpExporter&) = delete;
+    UdpExporter& operator=(const UdpExporter&) = delete;
+
+    /**
+     * Packs the lines starting from first_line into at most UDP_BATCH_DATAGRAMS datagrams and sends them with one
+     * sendmmsg(). The lines the consumer refused (ICMP port unreachable) are lost like any other datagram.
+     * @param max_lines - at most that many lines
+     * @return the number of the lines sent, 0 if the socket buffer is full, -1 on an error of the socket
+     */
+    ssize_t send_batch(const SequenceConfig& cfg, unsigned long long first_line, size_t max_lines);
+
+private:
+    int fd;
+    bool gso;
+    std::vector<char> buffer; // UDP_BATCH_DATAGRAMS datagrams, packed back to back
+    unsigned long long calls = 0, datagrams = 0, values = 0, cpu_ns = 0; // of this export, printed at the end
+};
+
+#endif //BAUM_UDP_EXPORT_H
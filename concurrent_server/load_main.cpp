@@ -0,0 +1,248 @@
+#include "include/baum_client.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+const char * HOST = "127.0.1.1";
+const char * PORT = "1234";
+
+static const int ALLOC_WARMUP_SECONDS = 1;
+static const unsigned long long ALLOC_CHECK_SLACK = 64; // the allocations of the control connections themselves
+static const unsigned long long PROGRESS_LINES = 1024; // how often the clients report the lines read so far
+static const size_t GAP_BUCKET_NS = 100;
+static const size_t GAP_BUCKETS = 100000; // 10 ms, the longer gaps are counted in the last bucket
+static const int OVERLOAD_PROBE_MS = 50; // how often --overload opens a new connection while the clients stream
+static const int OVERLOAD_SETTLE_MS = 5000; // the metrics connection is shed as well until the queues drain
+
+/**
+ * Asks the server for its allocation counter through a separate connection.
+ * @return false if the server isn't built with BAUM_ALLOC_TRACE
+ */
+static bool server_allocations(unsigned long long& count){
+    SequenceClient control(HOST, PORT);
+    std::string reply = control.query("allocs");
+    const std::string prefix = "allocs total=";
+    if (reply.rfind(prefix, 0) != 0) return false;
+    count = std::strtoull(reply.c_str() + prefix.size(), nullptr, 10);
+    return true;
+}
+
+/**
+ * Reads the "metrics" of the server through a separate connection.
+ * @return false if the server didn't reply, e.g. it shed the connection
+ */
+static bool server_metrics(std::map<std::string, unsigned long long>& metrics){
+    SequenceClient control(HOST, PORT);
+    std::string header = control.query("metrics");
+    const std::string prefix = "metrics ";
+    if (header.rfind(prefix, 0) != 0) return false;
+    for (int n = std::atoi(header.c_str() + prefix.size()); n > 0; --n){
+        std::string line = control.read_reply();
+        size_t space = line.rfind(' ');
+        if (space == std::string::npos) return false;
+        metrics[line.substr(0, space)] = std::strtoull(line.c_str() + space + 1, nullptr, 10);
+    }
+    return true;
+}
+
+/**
+ * @return the gap in microseconds which the share p of the gaps doesn't exceed, rounded up to GAP_BUCKET_NS
+ */
+static double gap_percentile(const std::vector<unsigned long long>& histogram, unsigned long long count, double p){
+    unsigned long long seen = 0;
+    size_t bucket = 0;
+    for (; bucket < histogram.size(); ++bucket){
+        seen += histogram[bucket];
+        if (seen >= p * count) break;
+    }
+    return (bucket + 1) * GAP_BUCKET_NS / 1000.0;
+}
+
+/**
+ * Usage: baum_load [--host=HOST] [--port=PORT] [--unix=PATH] [--shm] [--clients=N] [--seconds=S] [--rate=LINES]
+ *                  [--check-allocs] [--gaps] [--overload]
+ * Opens N clients, each in its own thread, streams for S seconds and prints the throughput. Every line is checked:
+ * client i exports "seq1 i step" with step 1, so the value of the line n must be i + n.
+ * --unix=PATH - connect over the Unix socket, --shm - and export through the shared memory ring
+ * --rate - ask the server to send at most LINES lines per second to every client
+ * --check-allocs - fail if the server allocated anything while streaming after the warm-up second. The server must be
+ * built with -DBAUM_ALLOC_TRACE=ON, the counter is read over TCP.
+ * --gaps - print the percentiles of the time between the arrivals of the consecutive lines, e.g. to compare the
+ * busy-polling port of baum --coro --busy-poll with the ordinary one. A line arrives with the recv() that completed
+ * it, so the lines of one chunk have the gap 0; use it with --rate, otherwise the chunks are full and the gaps only
+ * show how fast the client parses
+ * --overload - check the overload control of ThreadPoolServer: while the clients stream, a new connection asks for
+ * "status" every OVERLOAD_PROBE_MS; fail unless the "pool.clients.overload." metrics count an overload episode and at
+ * least the probes which were shed. It takes enough clients to keep the queue delay above the CoDel target, e.g.
+ * --clients=300 against baum --threads=1. The probes and the metrics go over TCP
+ */
+int main(int argc, char * argv[]) {
+    std::string unix_path;
+    bool shm = false, check_allocs = false, gaps = false, overload = false;
+    int clients = 4, seconds = 5;
+    unsigned long long rate = 0;
+    for (int i = 1; i < argc; ++i){
+        std::string arg = argv[i];
+        if (arg == "--shm") shm = true;
+        else if (arg == "--check-allocs") check_allocs = true;
+        else if (arg == "--gaps") gaps = true;
+        else if (arg == "--overload") overload = true;
+        else if (arg.rfind("--host=", 0) == 0) HOST = argv[i] + 7;
+        else if (arg.rfind("--port=", 0) == 0) PORT = argv[i] + 7;
+        else if (arg.rfind("--unix=", 0) == 0) unix_path = arg.substr(7);
+        else if (arg.rfind("--clients=", 0) == 0) clients = std::max(std::atoi(argv[i] + 10), 1);
+        else if (arg.rfind("--seconds=", 0) == 0) seconds = std::max(std::atoi(argv[i] + 10), 1);
+        else if (arg.rfind("--rate=", 0) == 0) rate = std::strtoull(argv[i] + 7, nullptr, 10);
+    }
+
+    std::map<std::string, unsigned long long> metrics_before, metrics_after;
+    if (overload && !server_metrics(metrics_before)){
+        std::cerr << "The server doesn't report its metrics" << std::endl;
+        return 1;
+    }
+
+    std::atomic<unsigned long long> lines{0}, bytes{0}, errors{0}, progress{0};
+    std::atomic_bool done{false};
+    std::mutex gaps_mut;
+    std::vector<unsigned long long> gap_histogram(gaps ? GAP_BUCKETS : 0);
+    std::vector<std::thread> threads;
+    for (int c = 0; c < clients; ++c){
+        threads.emplace_back([&, c](){
+            try{
+                std::unique_ptr<SequenceClient> client;
+                if (unix_path.empty()) client.reset(new SequenceClient(HOST, PORT));
+                else client.reset(new SequenceClient(unix_path.c_str()));
+                const unsigned long long start = c + 1;
+                client->seq(1, start, 1).seq(2, 0, 0).seq(3, 0, 0);
+                if (rate) client->command("rate " + std::to_string(rate));
+                if (!(shm ? client->export_shm() : client->export_seq())){
+                    std::cerr << "Client " << c << ": " << client->last_message() << std::endl;
+                    ++errors;
+                    return;
+                }
+                unsigned long long count = 0, bad = 0;
+                std::vector<unsigned long long> histogram(gap_histogram.size());
+                auto last_line = std::chrono::steady_clock::now();
+                client->for_each([&](const SeqLine& line){
+                    if (gaps){
+                        auto now = client->last_arrival();
+                        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_line).count();
+                        size_t bucket = std::min<size_t>(ns / GAP_BUCKET_NS, GAP_BUCKETS - 1);
+                        if (count > 0) ++histogram[bucket]; // the first line waited for the export to start
+                        last_line = now;
+                    }
+                    if (++count % PROGRESS_LINES == 0) progress += PROGRESS_LINES;
+                    if (line.values[0] != start + line.line) ++bad;
+                    return !done;
+                });
+                if (gaps){
+                    std::lock_guard<std::mutex> lk(gaps_mut);
+                    for (size_t i = 0; i < histogram.size(); ++i) gap_histogram[i] += histogram[i];
+                }
+                lines += count;
+                bytes += client->bytes_received();
+                errors += bad;
+            }
+            catch(std::exception& e){
+                std::cerr << "Client " << c << ": " << e.what() << std::endl;
+                ++errors;
+            }
+        });
+    }
+
+    std::atomic<unsigned long long> probes{0}, shed_probes{0};
+    if (overload){
+        threads.emplace_back([&](){
+            while (!done){
+                std::this_thread::sleep_for(std::chrono::milliseconds(OVERLOAD_PROBE_MS));
+                try{
+                    SequenceClient probe(HOST, PORT);
+                    ++probes;
+                    if (probe.query("status").empty()) ++shed_probes; // the server closes the shed connection
+                }
+                catch(std::exception&){} // not connected, e.g. the backlog is full: the server didn't see it
+            }
+        });
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    unsigned long long allocs_before = 0, allocs_after = 0, lines_before = 0, lines_after = 0;
+    bool allocs_counted = false;
+    if (check_allocs && seconds > ALLOC_WARMUP_SECONDS){
+        std::this_thread::sleep_for(std::chrono::seconds(ALLOC_WARMUP_SECONDS));
+        lines_before = progress;
+        allocs_counted = server_allocations(allocs_before);
+        std::this_thread::sleep_for(std::chrono::seconds(seconds - ALLOC_WARMUP_SECONDS));
+        lines_after = progress;
+        allocs_counted = allocs_counted && server_allocations(allocs_after);
+    }
+    else{
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    }
+    done = true;
+    for (auto& t : threads) t.join();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    std::cout << clients << " clients, " << lines << " lines, " << bytes / (1024 * 1024) << " MiB in " << elapsed
+              << " s: " << static_cast<unsigned long long>(lines / elapsed) << " lines/s, "
+              << static_cast<unsigned long long>(bytes / elapsed / (1024 * 1024)) << " MiB/s, " << errors
+              << " errors" << std::endl;
+    if (gaps){
+        unsigned long long count = 0;
+        for (unsigned long long n : gap_histogram) count += n;
+        std::cout << "Inter-line gaps: p50 " << gap_percentile(gap_histogram, count, 0.5) << " us, p99 "
+                  << gap_percentile(gap_histogram, count, 0.99) << " us, p99.9 "
+                  << gap_percentile(gap_histogram, count, 0.999) << " us, max "
+                  << gap_percentile(gap_histogram, count, 1) << " us" << std::endl;
+    }
+    if (check_allocs){
+        if (!allocs_counted){
+            std::cerr << "The allocations are not counted, run the server built with -DBAUM_ALLOC_TRACE=ON and "
+                         "--seconds above " << ALLOC_WARMUP_SECONDS << std::endl;
+            return 1;
+        }
+        unsigned long long allocs = allocs_after - allocs_before;
+        std::cout << "Server allocations after the warm-up: " << allocs << " for " << lines_after - lines_before
+                  << " lines" << std::endl;
+        if (allocs > ALLOC_CHECK_SLACK){
+            std::cerr << "The streaming allocates, see \"allocs sites\" of the server for the call sites"
+                      << std::endl;
+            return 1;
+        }
+    }
+    if (overload){
+        bool reported = false;
+        for (int waited = 0; !reported && waited < OVERLOAD_SETTLE_MS; waited += OVERLOAD_PROBE_MS){
+            reported = server_metrics(metrics_after);
+            if (!reported) std::this_thread::sleep_for(std::chrono::milliseconds(OVERLOAD_PROBE_MS));
+        }
+        const std::string prefix = "pool.clients.overload.";
+        if (!reported || !metrics_after.count(prefix + "episodes")){
+            std::cerr << "The server doesn't report the overload metrics, is it ThreadPoolServer?" << std::endl;
+            return 1;
+        }
+        auto delta = [&](const std::string& name){
+            return metrics_after[prefix + name] - metrics_before[prefix + name];
+        };
+        const unsigned long long episodes = delta("episodes"), shed_accepts = delta("shed_accepts");
+        std::cout << "Overload: " << episodes << " episodes, " << shed_accepts << " accepts shed (" << shed_probes
+                  << " of " << probes << " probes), " << delta("deferred_exports") << " exports deferred, max queue "
+                  << "delay " << metrics_after[prefix + "max_sojourn_us"] << " us" << std::endl;
+        if (episodes == 0){
+            std::cerr << "The pool wasn't driven into shedding, run more --clients or the server with fewer --threads"
+                      << std::endl;
+            return 1;
+        }
+        if (shed_accepts < shed_probes){
+            std::cerr << "The server shed more connections than it counted" << std::endl;
+            return 1;
+        }
+    }
+    return errors ? 1 : 0;
+}
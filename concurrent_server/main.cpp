@@ -1,4 +1,5 @@
 #include "include/Server.h"
+#include "include/prefork.h"
 #include <csignal>
 
 using namespace std;
@@ -6,9 +7,121 @@ using namespace std;
 const char * PORT = "1234";
 const char * IP = "127.0.1.1";
 
-int main() {
+static const char * const USAGE =
+        "Usage: baum [latency|throughput] [--coro] [--unix=PATH] [--table[=SHARDS]] [--port=PORT] [--ip=IP]\n"
+        "            [--sessions=PATH] [--trace] [--trace-control] [--capture=PATH]\n"
+        "            [--slow=drop|downsample|disconnect[:BYTES_PER_SEC]] [--busy-poll=CPU,CPU...] [--busy-port=PORT]\n"
+        "            [--prefork=WORKERS] [--threads=MIN[:MAX]]";
+
+/**
+ * Usage: baum [latency|throughput] [--coro] [--unix=PATH] [--table[=SHARDS]] [--port=PORT] [--ip=IP] [--sessions=PATH]
+ *             [--trace] [--trace-control] [--capture=PATH] [--slow=drop|downsample|disconnect[:BYTES_PER_SEC]]
+ *             [--busy-poll=CPU,CPU...] [--busy-port=PORT] [--prefork=WORKERS] [--threads=MIN[:MAX]]
+ * latency|throughput - the options profile of the accepted sockets
+ * --coro - serve the clients with CoroutineServer instead of ThreadPoolServer
+ * --unix=PATH - listen on the Unix domain socket as well, @name for the abstract namespace
+ * --table - stream the exports from the struct-of-arrays connection tables, one per hardware thread by default
+ * --port, --ip - the TCP endpoint, e.g. to run several servers behind baum_proxy
+ * --sessions=PATH - keep the resumable sessions of the clients in the file, ThreadPoolServer only
+ * --trace - record the event timeline from the start, SIGUSR1 or "trace dump" writes it as the Chrome trace JSON
+ * --trace-control - let the clients switch and dump the tracing with the "trace" command
+ * --capture=PATH - record the input of the clients for baum_replay, ThreadPoolServer only
+ * --slow=ACTION[:BYTES_PER_SEC] - what to do with the exporting clients which read slower than they asked for, or than
+ * BYTES_PER_SEC if they didn't ask for a rate (see slow_consumer.h), ThreadPoolServer only
+ * --busy-poll=CPUS - the clients of the busy port are served by the busy-polling reactors pinned to these CPUs, the
+ * low-latency mode of CoroutineServer. --busy-port - PORT + 1 by default
+ * --prefork=WORKERS - fork the worker processes which share the TCP listening socket, each with one CoroutineServer
+ * reactor, and restart the ones which die (see prefork.h). The Unix socket, the sessions, the capture, the tables, the
+ * busy polling and the slow consumers handling are not available then
+ * --threads=MIN[:MAX] - the bounds of the ThreadPoolServer workers, which are added and retired with the load (see
+ * basic_thread_pool). 1 and 4 per hardware thread by default, MIN alone is a pool of the fixed size
+ */
+int main(int argc, char * argv[]) {
     signal(SIGPIPE, SIG_IGN); // ignore the sigpipe, the class with handle the case of disconnection
-    ThreadPoolServer server(PORT, IP);
-    server.accept_connections();
+    SocketProfile profile;
+    bool use_coroutines = false;
+    unsigned table_shards = 0, prefork_workers = 0;
+    std::string unix_path, sessions_path, capture_path;
+    std::vector<int> busy_cpus;
+    std::string busy_port;
+    SlowConsumerAction slow_action = SlowConsumerAction::none;
+    unsigned long long slow_min_rate = SLOW_MIN_RATE;
+    pool_limits workers;
+    for (int i = 1; i < argc; ++i){
+        std::string arg = argv[i];
+        if (arg == "--coro") use_coroutines = true;
+        else if (arg == "--trace") set_tracing(true);
+        else if (arg == "--trace-control") set_trace_control(true);
+        else if (arg.rfind("--unix=", 0) == 0) unix_path = arg.substr(7);
+        else if (arg == "--table") table_shards = std::max(std::thread::hardware_concurrency(), 1u);
+        else if (arg.rfind("--port=", 0) == 0) PORT = argv[i] + 7;
+        else if (arg.rfind("--ip=", 0) == 0) IP = argv[i] + 5;
+        else if (arg.rfind("--sessions=", 0) == 0) sessions_path = arg.substr(11);
+        else if (arg.rfind("--capture=", 0) == 0) capture_path = arg.substr(10);
+        else if (arg.rfind("--busy-port=", 0) == 0) busy_port = arg.substr(12);
+        else if (arg.rfind("--busy-poll=", 0) == 0){
+            std::stringstream cpus(arg.substr(12));
+            std::string cpu;
+            while (std::getline(cpus, cpu, ',')) busy_cpus.push_back(std::atoi(cpu.c_str()));
+        }
+        else if (arg.rfind("--slow=", 0) == 0){
+            size_t colon = arg.find(':');
+            slow_action = slow_consumer_policy::action_from_name(arg.substr(7, colon == std::string::npos ? colon : colon - 7));
+            if (slow_action == SlowConsumerAction::none){
+                std::cerr << "Unknown slow consumer action in " << arg << "\n" << USAGE << std::endl;
+                return 2;
+            }
+            if (colon != std::string::npos) slow_min_rate = std::strtoull(arg.c_str() + colon + 1, nullptr, 10);
+        }
+        else if (arg.rfind("--table=", 0) == 0) table_shards = std::max(std::atoi(arg.c_str() + 8), 1);
+        else if (arg.rfind("--threads=", 0) == 0){
+            char * end;
+            workers.min_workers = std::max(static_cast<int>(std::strtol(arg.c_str() + 10, &end, 10)), 1);
+            workers.max_workers = *end == ':' ? std::max(std::atoi(end + 1), 1) : workers.min_workers;
+        }
+        else if (arg.rfind("--prefork=", 0) == 0) prefork_workers = std::max(std::atoi(arg.c_str() + 10), 1);
+        else if (arg == "latency" || arg == "throughput") profile = SocketProfile::from_name(arg);
+        else{
+            std::cerr << "Unknown argument " << arg << "\n" << USAGE << std::endl;
+            return 2;
+        }
+    }
+
+    if (prefork_workers > 0){
+        if (!unix_path.empty() || !sessions_path.empty() || !capture_path.empty() || table_shards != 0 ||
+            !busy_cpus.empty() || slow_action != SlowConsumerAction::none){
+            std::cerr << "--prefork serves TCP only, the other modes are ignored" << std::endl;
+        }
+        int listenfd = open_listen_fd(PORT, IP);
+        if (listenfd == -1){
+            std::cerr << "Could not listen on " << IP << ":" << PORT << ". Exiting..." << std::endl;
+            return 1;
+        }
+        signal(SIGUSR1, SIG_IGN); // the master has no trace, the workers dump their own
+        PreforkMaster master(prefork_workers, [&](unsigned){
+            dump_trace_on_signal(SIGUSR1);
+            CoroutineServer worker(listenfd, IP, profile, 1);
+            worker.accept_connections();
+        });
+        return master.run();
+    }
+
+    dump_trace_on_signal(SIGUSR1);
+    std::unique_ptr<Server> server;
+    if (use_coroutines){
+        auto * coro = new CoroutineServer(PORT, IP, profile);
+        server.reset(coro);
+        if (busy_port.empty()) busy_port = std::to_string(std::atoi(PORT) + 1);
+        if (!busy_cpus.empty()) coro->busy_poll(busy_port.c_str(), busy_cpus);
+    }
+    else{
+        if (!busy_cpus.empty()) std::cerr << "--busy-poll needs --coro, ignored" << std::endl;
+        server.reset(new ThreadPoolServer(PORT, IP, profile, table_shards, workers));
+    }
+    if (!unix_path.empty()) server->listen_unix(unix_path.c_str());
+    if (!sessions_path.empty()) server->open_sessions(sessions_path.c_str());
+    if (!capture_path.empty()) server->start_capture(capture_path.c_str());
+    server->handle_slow_consumers(slow_action, slow_min_rate);
+    server->accept_connections();
     return 0;
 }
\ No newline at end of file
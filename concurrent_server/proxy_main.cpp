@@ -0,0 +1,30 @@
+#include "include/proxy.h"
+#include <csignal>
+
+using namespace std;
+
+const char * PORT = "1234";
+const char * IP = "127.0.1.1";
+
+/**
+ * Usage: baum_proxy [--port=PORT] [--ip=IP] [--hash] HOST:PORT...
+ * --port, --ip - the public endpoint, the same as of a single server by default
+ * --hash - pick the backend by consistent hashing of the client address instead of the least connections
+ * HOST:PORT - the backend baum servers
+ */
+int main(int argc, char * argv[]) {
+    signal(SIGPIPE, SIG_IGN); // the broken connections are detected by the pumps
+    BalanceMode mode = BalanceMode::least_connections;
+    std::vector<std::string> backends;
+    for (int i = 1; i < argc; ++i){
+        std::string arg = argv[i];
+        if (arg == "--hash") mode = BalanceMode::consistent_hash;
+        else if (arg.rfind("--port=", 0) == 0) PORT = argv[i] + 7;
+        else if (arg.rfind("--ip=", 0) == 0) IP = argv[i] + 5;
+        else backends.push_back(arg);
+    }
+
+    Proxy proxy(PORT, IP, backends, mode);
+    proxy.accept_connections();
+    return 0;
+}
@@ -0,0 +1,203 @@
+#include "include/baum_client.h"
+#include "include/capture.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+const char * HOST = "127.0.1.1";
+const char * PORT = "1234";
+
+static const size_t REPLAY_READ_CHUNK = 64 * 1024;
+
+struct ReplaySession{
+    std::vector<CaptureRecord> events; // open first, then the data, close at the end if the capture has it
+};
+
+struct ReplayStats{
+    std::mutex mut;
+    std::vector<long long> latencies_us; // from a send to the first byte of the answer
+    unsigned long long commands = 0, bytes_sent = 0, bytes_received = 0, errors = 0;
+};
+
+/**
+ * Replays one session: connects at its open time, sends every recorded chunk at its time and reads whatever the server
+ * answers in between. The session ends at its close time, or after its last chunk when the capture has no close.
+ */
+static void replay_session(const ReplaySession& session, double speed, std::chrono::steady_clock::time_point start,
+                           ReplayStats& stats){
+    auto at = [&](uint64_t time_us){
+        return start + std::chrono::microseconds(speed > 0 ? static_cast<long long>(time_us / speed) : 0);
+    };
+    std::vector<char> buf(REPLAY_READ_CHUNK);
+    std::vector<long long> latencies;
+    unsigned long long commands = 0, sent = 0, received = 0;
+    try{
+        std::this_thread::sleep_until(at(session.events.front().time_us));
+        SequenceClient client(HOST, PORT);
+        const int fd = client.file_descriptor();
+        bool waiting = false, open = true;
+        std::chrono::steady_clock::time_point sent_at;
+
+        // reads the answers until the deadline, @return false when the server closed the connection
+        auto drain_until = [&](std::chrono::steady_clock::time_point deadline){
+            while (open){
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        deadline - std::chrono::steady_clock::now()).count();
+                pollfd pfd{fd, POLLIN, 0};
+                int ready = poll(&pfd, 1, static_cast<int>(std::max<long long>(left, 0)));
+                if (ready < 0 && errno == EINTR) continue;
+                if (ready <= 0) return; // the deadline
+                ssize_t n = recv(fd, buf.data(), buf.size(), MSG_DONTWAIT);
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+                if (n <= 0){
+                    open = false;
+                    return;
+                }
+                if (waiting){
+                    latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - sent_at).count());
+                    waiting = false;
+                }
+                received += n;
+            }
+        };
+
+        for (const CaptureRecord& event : session.events){
+            drain_until(at(event.time_us));
+            if (!open || event.type == CaptureType::close) break;
+            if (event.type != CaptureType::data) continue;
+            if (!waiting){
+                sent_at = std::chrono::steady_clock::now();
+                waiting = true;
+            }
+            size_t done = 0;
+            while (done < event.data.size()){
+                ssize_t n = send(fd, event.data.data() + done, event.data.size() - done, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) throw std::runtime_error("The server closed the connection");
+                done += n;
+            }
+            ++commands;
+            sent += done;
+        }
+    }
+    catch(std::exception& e){
+        std::cerr << "Session " << session.events.front().session << ": " << e.what() << std::endl;
+        std::lock_guard<std::mutex> lk(stats.mut);
+        ++stats.errors;
+    }
+    std::lock_guard<std::mutex> lk(stats.mut);
+    stats.latencies_us.insert(stats.latencies_us.end(), latencies.begin(), latencies.end());
+    stats.commands += commands;
+    stats.bytes_sent += sent;
+    stats.bytes_received += received;
+}
+
+static long long percentile(std::vector<long long>& sorted, double p){
+    if (sorted.empty()) return 0;
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+/**
+ * Usage: baum_replay CAPTURE [--host=HOST] [--port=PORT] [--speed=X] [--report=FILE] [--baseline=FILE]
+ * Drives the sessions recorded by baum --capture=PATH against the server, every session from its own connection and
+ * thread, and prints the throughput and the latency of the answers.
+ * --speed=X - replay X times faster than recorded (1 by default), 0 sends everything without the pauses
+ * --report=FILE - save the results as "name value" lines
+ * --baseline=FILE - a report of an earlier run, e.g. of the other build: the differences to it are printed
+ */
+int main(int argc, char * argv[]) {
+    std::string capture_path, report_path, baseline_path;
+    double speed = 1;
+    for (int i = 1; i < argc; ++i){
+        std::string arg = argv[i];
+        if (arg.rfind("--host=", 0) == 0) HOST = argv[i] + 7;
+        else if (arg.rfind("--port=", 0) == 0) PORT = argv[i] + 7;
+        else if (arg.rfind("--speed=", 0) == 0) speed = std::max(std::atof(argv[i] + 8), 0.0);
+        else if (arg.rfind("--report=", 0) == 0) report_path = arg.substr(9);
+        else if (arg.rfind("--baseline=", 0) == 0) baseline_path = arg.substr(11);
+        else capture_path = arg;
+    }
+    if (capture_path.empty()){
+        std::cerr << "Usage: baum_replay CAPTURE [--host=HOST] [--port=PORT] [--speed=X] [--report=FILE] "
+                     "[--baseline=FILE]" << std::endl;
+        return 1;
+    }
+
+    std::map<uint32_t, ReplaySession> sessions;
+    try{
+        CaptureReader reader(capture_path.c_str());
+        CaptureRecord record;
+        while (reader.next(record)){
+            if (record.type == CaptureType::open || sessions.count(record.session)){
+                sessions[record.session].events.push_back(record);
+            }
+        }
+    }
+    catch(std::exception& e){
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    ReplayStats stats;
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (auto& [id, session] : sessions){
+        threads.emplace_back(replay_session, std::cref(session), speed, start, std::ref(stats));
+    }
+    for (auto& t : threads) t.join();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::sort(stats.latencies_us.begin(), stats.latencies_us.end());
+    std::vector<std::pair<std::string, double>> results{
+            {"sessions", sessions.size()},
+            {"commands", stats.commands},
+            {"bytes_sent", stats.bytes_sent},
+            {"bytes_received", stats.bytes_received},
+            {"seconds", elapsed},
+            {"mib_per_second", stats.bytes_received / elapsed / (1024 * 1024)},
+            {"latency_p50_us", percentile(stats.latencies_us, 0.5)},
+            {"latency_p99_us", percentile(stats.latencies_us, 0.99)},
+            {"errors", stats.errors},
+    };
+
+    std::map<std::string, double> baseline;
+    if (!baseline_path.empty()){
+        std::ifstream in(baseline_path);
+        if (!in) std::cerr << "Could not read the baseline " << baseline_path << std::endl;
+        std::string name;
+        double value;
+        while (in >> name >> value) baseline[name] = value;
+    }
+    std::cout << std::fixed << std::setprecision(2);
+    for (auto& [name, value] : results){
+        std::cout << std::setw(16) << std::left << name << value;
+        auto it = baseline.find(name);
+        if (it != baseline.end()){
+            std::cout << "  (baseline " << it->second;
+            if (it->second != 0) std::cout << ", " << std::showpos << (value - it->second) / it->second * 100
+                                           << std::noshowpos << "%";
+            std::cout << ")";
+        }
+        std::cout << std::endl;
+    }
+    if (!report_path.empty()){
+        std::ofstream out(report_path);
+        out << std::fixed << std::setprecision(2);
+        for (auto& [name, value] : results) out << name << " " << value << "\n";
+        if (!out) std::cerr << "Could not write the report " << report_path << std::endl;
+    }
+    return stats.errors ? 1 : 0;
+}
@@ -4,6 +4,9 @@
 
 #include "../include/Server.h"
 
+#include <fcntl.h>
+#include <poll.h>
+
 // ---- NewHandlerSupport functions definition ----
 
 template<class X>
@@ -34,15 +37,70 @@ void* NewHandlerSupport<X>::operator new(size_t size) {
     return memory;
 }
 
+/**
+ * Out of line, like operator new: inlined into main() the pair of the global functions is seen from one side only and
+ * GCC warns -Wmismatched-new-delete.
+ */
+template<class X>
+void NewHandlerSupport<X>::operator delete(void * p) noexcept {
+    ::operator delete(p);
+}
+
+template class NewHandlerSupport<Server>; // the servers are created with new in main.cpp
+template class basic_thread_pool<Handler>; // thread_pool, the type-erased pool, must keep compiling
+
+// ---- rate_limiter functions definition ----
+
+size_t rate_limiter::budget(unsigned long long rate, size_t line_size){
+    auto now = std::chrono::steady_clock::now();
+    if (applied_rate != rate){
+        applied_rate = rate;
+        tokens = 0;
+        refill = now;
+    }
+    const unsigned long long bytes_per_sec = rate * line_size;
+    long long elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(now - refill).count();
+    if (elapsed_us >= 1000000){
+        tokens = bytes_per_sec; // at most a second of burst
+        refill = now;
+        return tokens;
+    }
+    unsigned long long added = elapsed_us * bytes_per_sec / 1000000;
+    if (added > 0){
+        tokens = std::min(tokens + added, bytes_per_sec);
+        // only the time of the whole bytes is used up, so the frequent refills don't lose the fractions
+        refill += std::chrono::microseconds(added * 1000000 / bytes_per_sec);
+    }
+    return tokens;
+}
+
 // ---- ClientHandler functions definition ----
 
+// an idle client costs its handler, the control block of the shared_ptr and the slot in the queue of the pool. The
+// receive buffer and the export state are only allocated while it reads or exports.
+static_assert(sizeof(ClientHandler) + 2 * sizeof(std::shared_ptr<ClientHandler>) <= IDLE_CLIENT_BYTES,
+              "ClientHandler is too big for an idle connection");
+
+ClientHandler::ClientHandler(int connfd, OutputCache& cache, const SocketProfile& profile,
+                             codel_controller * overload, ConnectionTableHandler * table, SessionStore * sessions,
+                             CaptureWriter * capture, slow_consumer_policy * slow_consumers):
+        Handler(connfd), overload(overload), table(table), io_buf(connfd), cache(cache), capture(capture),
+        slow_consumers(slow_consumers), profile(profile) {
+    session.store = sessions;
+    if (capture) capture->opened(connfd);
+}
+
 ClientHandler::~ClientHandler() {
+    if (session.slot >= 0) session.store->detach(session.slot);
+    if (fd == -1) return; // the connection belongs to the connection table
+    if (capture) capture->closed(fd);
     std::cout << "Client " << fd << " disconnected. Freeing resources..." << std::endl;
     close_fd(fd);
 }
 
 HandleStatus ClientHandler::handle(){
     HandleStatus read_res, write_res;
+    last_cost = 0;
 
     switch (mode) {
         case ch_mode::reading:
@@ -51,140 +109,682 @@ HandleStatus ClientHandler::handle(){
         case ch_mode::writing:
             write_res = handle_writing();
             return write_res;
+        case ch_mode::shm:
+            return handle_shm();
+        case ch_mode::udp:
+            return handle_udp();
     }
+    return HandleStatus::fatal_error; // not a mode
 }
 
 HandleStatus ClientHandler::handle_reading() {
-    std::string line;
-    HandleStatus read_res = readline_wrapper(fd, line);
+    if (deferred_export != HandleStatus::ok){ // no more commands are read after the export command
+        return start_export(deferred_export);
+    }
+    HandleStatus read_res;
+    {
+        trace_span span("read", "fd", fd);
+        read_res = readline_wrapper(io_buf, partial_line);
+    }
     if (read_res == HandleStatus::try_again || read_res == HandleStatus::disconnected)
         return read_res;
     else{
-        HandleStatus parse_res = parse_command(line);
-        if (parse_res == HandleStatus::switch_mode){
-            std::cout << "Changing mode to writing from listening on client " << fd << "..." << std::endl;
-            mode = ch_mode::writing;
+        std::string line = std::move(partial_line);
+        partial_line.clear();
+        last_cost = line.size();
+        if (capture) capture->received(fd, line.data(), line.size());
+        std::string reply;
+        CommandContext ctx{cfg, &control, reply, &cache, overload, &session};
+        HandleStatus parse_res;
+        {
+            trace_span span("parse", "fd", fd);
+            parse_res = run_command(line, ctx);
+        }
+        if (!reply.empty()) robust_write(fd, reply);
+        if (parse_res == HandleStatus::switch_mode || parse_res == HandleStatus::switch_mode_shm ||
+            parse_res == HandleStatus::switch_mode_udp){
+            return start_export(parse_res);
         }
         else if (parse_res == HandleStatus::try_again){
-            robust_write(fd, "Error occurred parsing command. Please make sure the command is legit and try again...\n");
+            robust_write(fd, PARSE_ERROR_MESSAGE);
         }
         return parse_res; // if res is 1, the control thread will push it to the working_threads thread_pool
     }
 }
 
-HandleStatus ClientHandler::handle_writing(){
-    update();
-    std::stringstream ss;
-    std::string output;
-
-    if (std::all_of(seq_in_use.begin(), seq_in_use.end(), [](bool el){return !el;})){ // if all are false, don't do anything
-        output = "There's nothing to show. Abandoning...\n";
-        robust_write(fd, output);
-        return HandleStatus::fatal_error; // abandon the client if there's nothing to show;
+HandleStatus ClientHandler::start_export(HandleStatus request){
+    if (overload && !overload->admit_export()){
+        if (deferred_export == HandleStatus::ok){
+            robust_write(fd, OVERLOADED_MESSAGE);
+            deferred_export = request;
+        }
+        return HandleStatus::try_again;
     }
-    else{
-        for (int i = 0; i < 3; ++i){ // pick only those which should be used.
-            if (!seq_in_use[i]) continue;
-            ss << std::setw(25) << seq[i];
+    deferred_export = HandleStatus::ok;
+    if (request == HandleStatus::switch_mode_shm){
+        return start_shm();
+    }
+    if (request == HandleStatus::switch_mode_udp){
+        return start_udp();
+    }
+    // the table streams at full speed, reads no commands, doesn't keep the sessions and advances the arithmetic
+    // sequences only
+    if (table && !control.paused && control.rate == 0 && session.slot < 0 && cfg.arithmetic_only()){
+        if (cfg.nothing_to_show()){
+            robust_write(fd, NOTHING_TO_SHOW_MESSAGE);
+            return HandleStatus::fatal_error;
         }
-        ss << std::endl;
+        std::cout << "Moving client " << fd << " to the connection table..." << std::endl;
+        table->adopt(fd, cfg);
+        fd = -1;
+        return HandleStatus::moved;
     }
-    output = ss.str();
-    int write_res = robust_write(fd, output);
-    if (write_res == -1){
-        return HandleStatus::disconnected; // if write was unsuccessful, probably the client is disconnected, so we return 0 and cause a destruction of an object
+    std::cout << "Changing mode to writing from listening on client " << fd << "..." << std::endl;
+    start_stream();
+    take_control_input();
+    if (session.slot >= 0) restore_position();
+    mode = ch_mode::writing;
+    return HandleStatus::switch_mode;
+}
+
+void ClientHandler::take_control_input(){
+    // the commands sent right after the export command are the control commands of the export
+    std::string& control_input = stream->control_input;
+    control_input = std::move(partial_line);
+    control_input.append(io_buf.pNextByte, std::max(io_buf.cntLeft, 0));
+    io_buf.cntLeft = 0;
+    io_buf.release();
+    if (capture && !control_input.empty()) capture->received(fd, control_input.data(), control_input.size());
+    stream->handles_since_poll = CONTROL_POLL_INTERVAL; // apply them before the first write
+}
+
+void ClientHandler::start_stream(){
+    stream = std::make_unique<ExportState>(slow_consumers);
+    if (profile.zerocopy){
+        stream->zerocopy.reset(new zerocopy_sender());
+    }
+}
+
+void ClientHandler::restore_position(){
+    SessionStore& store = *session.store;
+    const size_t line = cfg.line_size();
+    if (store.load_config(session.slot) == cfg && store.block_offset(session.slot) < line * LINES_PER_BLOCK){
+        stream->first_block = store.first_block(session.slot);
+        stream->block_offset = store.block_offset(session.slot) / line * line; // the client drops a partial line
+        std::cout << "Client " << fd << " resumed the session from block " << stream->first_block << "..." << std::endl;
     }
     else{
-        return HandleStatus::ok;
+        store.save_config(session.slot, cfg);
+        store.save_position(session.slot, 0, 0);
     }
 }
 
-unsigned long long ClientHandler::get_number_from_stream(std::stringstream& ss){
-    std::string item;
-    std::getline(ss, item, ' ');
-    unsigned long long  value;
-    if (item.size() > 6) {
-        std::cerr << "Parsing client string: Too long number" << std::endl; // мы условились что максимум может быть 4 знака в числе, плюс 2 знака на пробел и перенос строки
-        return -1;
+HandleStatus ClientHandler::start_shm(){
+    sockaddr_storage addr{};
+    socklen_t addrlen = sizeof(addr);
+    if (getsockname(fd, (sockaddr *) &addr, &addrlen) < 0 || addr.ss_family != AF_UNIX){
+        robust_write(fd, SHM_UNSUPPORTED_MESSAGE);
+        return HandleStatus::try_again;
+    }
+    if (cfg.nothing_to_show()){
+        robust_write(fd, NOTHING_TO_SHOW_MESSAGE);
+        return HandleStatus::fatal_error;
+    }
+
+    uint32_t seq_mask = 0;
+    for (int i = 0; i < SEQ_COUNT; ++i){
+        if (cfg.seq_in_use[i]) seq_mask |= 1u << i;
     }
+    start_stream();
     try{
-        value = static_cast<unsigned long long>(std::stoll(item));
+        stream->ring.reset(new ShmRingProducer(SHM_RING_FRAMES, seq_mask));
     }
-    catch(std::exception&){
-        std::cerr << "Invalid input reading xxxx or yyyy" << std::endl;
-        return -1;
+    catch(std::exception& e){
+        std::cerr << "Client " << fd << ": " << e.what() << std::endl;
+        return HandleStatus::fatal_error;
     }
-    return value;
+
+    // "shm <frames> <frame size>" tells the client how to map the memfd, the eventfd goes second
+    int fds[2] = {stream->ring->memory_fd(), stream->ring->event_fd()};
+    std::string reply = "shm " + std::to_string(SHM_RING_FRAMES) + " " + std::to_string(sizeof(seq_frame)) + "\n";
+    if (send_with_fds(fd, reply, fds, 2) < 0){
+        return HandleStatus::disconnected;
+    }
+    std::cout << "Changing mode to shared memory from listening on client " << fd << "..." << std::endl;
+    mode = ch_mode::shm;
+    return HandleStatus::switch_mode_shm;
 }
 
-HandleStatus ClientHandler::parse_command(const std::string& input){
-    if (input.size() > 17) {
+HandleStatus ClientHandler::handle_shm(){
+    size_t n;
+    seq_frame * frames = stream->ring->claim(n);
+    if (n == 0){
+        // the ring is full: the client is slow or gone, check the control socket
+        char c;
+        ssize_t res = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (res == 0 || (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+            return HandleStatus::disconnected;
+        }
         return HandleStatus::try_again;
     }
-    std::stringstream ss(input);
-    std::string strcmp = "export seq";
-    strcmp += (char)13;
-    strcmp += (char)10;
-    std::string item;
-    int n;
 
-    std::getline(ss, item, ' ');
-    if ( item[0] == 's' && item[1] == 'e' && item[2] == 'q' ){
-        if ( item[3] == '1' || item[3] == '2' || item[3] == '3' ){
-            n = static_cast<int>(item[3] - '1');
-            auto init_value = get_number_from_stream(ss);
-            if (init_value == -1) return HandleStatus::try_again;
+    n = std::min<size_t>(n, LINES_PER_BLOCK * FLUSH_BLOCKS); // a bounded batch per handle(), as in handle_writing()
+    uint64_t values[SEQ_COUNT][LINES_PER_BLOCK]{};
+    for (size_t first = 0; first < n; first += LINES_PER_BLOCK){
+        const size_t count = std::min<size_t>(n - first, LINES_PER_BLOCK);
+        for (int i = 0; i < SEQ_COUNT; ++i){
+            if (cfg.seq_in_use[i]) cfg.values_after(i, stream->next_line + first - 1, values[i], count);
+        }
+        for (size_t k = 0; k < count; ++k){
+            frames[first + k].line = stream->next_line + first + k;
+            for (int i = 0; i < SEQ_COUNT; ++i) frames[first + k].values[i] = values[i][k];
+        }
+    }
+    stream->ring->publish(n);
+    stream->next_line += n;
+    last_cost = n * sizeof(seq_frame);
+    return HandleStatus::ok;
+}
 
-            auto stepn = get_number_from_stream(ss);
-            if (stepn == -1) return HandleStatus::try_again;
+HandleStatus ClientHandler::start_udp(){
+    if (cfg.nothing_to_show()){
+        robust_write(fd, NOTHING_TO_SHOW_MESSAGE);
+        return HandleStatus::fatal_error;
+    }
+    start_stream();
+    try{
+        stream->udp.reset(new UdpExporter(fd, control.udp_port, control.udp_gso));
+    }
+    catch(std::exception& e){
+        std::cerr << "Client " << fd << ": " << e.what() << std::endl;
+        stream.reset();
+        robust_write(fd, UDP_UNSUPPORTED_MESSAGE);
+        return HandleStatus::try_again;
+    }
+    robust_write(fd, "udp " + std::to_string(UDP_FRAMES_PER_DATAGRAM) + " " + std::to_string(sizeof(seq_frame)) + "\n");
+    take_control_input();
+    std::cout << "Changing mode to UDP port " << control.udp_port << " from listening on client " << fd << "..."
+              << std::endl;
+    mode = ch_mode::udp;
+    return HandleStatus::switch_mode_udp;
+}
 
-            if (init_value == 0 || stepn == 0) seq_in_use[n] = false; // if either is zero, don't use the sequence
-            seq[n] = init_value;
-            step[n] = stepn;
-            return HandleStatus::ok; // indicates that the command was read
-        }
-        else{
-            return HandleStatus::try_again;
+HandleStatus ClientHandler::handle_udp(){
+    if (control.paused || ++stream->handles_since_poll >= CONTROL_POLL_INTERVAL){
+        stream->handles_since_poll = 0;
+        if (poll_control() == HandleStatus::disconnected) return HandleStatus::disconnected;
+    }
+    if (control.paused) return HandleStatus::try_again;
+    const size_t line_size = cfg.line_size();
+    const size_t budget = control.rate ? stream->rate.budget(control.rate, line_size) / line_size : SIZE_MAX;
+    // under a rate the lines are saved up for a full datagram, unless the rate is lower than that
+    if (budget < std::min<unsigned long long>(UDP_FRAMES_PER_DATAGRAM, std::max(control.rate, 1ULL))){
+        return HandleStatus::try_again;
+    }
+
+    ssize_t lines = stream->udp->send_batch(cfg, stream->next_line, budget);
+    if (lines < 0){
+        std::cerr << "Client " << fd << ": the UDP export failed: " << strerror(errno) << std::endl;
+        return HandleStatus::fatal_error;
+    }
+    if (lines == 0) return HandleStatus::try_again; // the socket buffer is full
+    stream->next_line += lines;
+    if (control.rate) stream->rate.spend(lines * line_size);
+    last_cost = lines * sizeof(seq_frame);
+    return HandleStatus::ok;
+}
+
+HandleStatus ClientHandler::handle_writing(){
+    if (cfg.nothing_to_show()){ // if all are false, don't do anything
+        robust_write(fd, NOTHING_TO_SHOW_MESSAGE);
+        return HandleStatus::fatal_error; // abandon the client if there's nothing to show;
+    }
+    if (control.paused || ++stream->handles_since_poll >= CONTROL_POLL_INTERVAL){
+        stream->handles_since_poll = 0;
+        if (poll_control() == HandleStatus::disconnected) return HandleStatus::disconnected;
+    }
+    // the socket stays corked over the rounds of the full speed export, so the tail of a batch goes out in one segment
+    // with the head of the next one; switching it off for a paused or rate limited export pushes the tail right away
+    bool cork = profile.cork && !control.paused && !control.rate;
+    if (cork != stream->corked) set_cork(fd, stream->corked = cork);
+    if (control.paused){
+        stream->slow_monitor.reset(); // the client stopped the output itself
+        return HandleStatus::try_again;
+    }
+    SlowConsumerAction slow_action = stream->slow_monitor.check(fd, stream->written, control.rate * cfg.line_size());
+    if (slow_action == SlowConsumerAction::disconnect){
+        slow_consumers->disconnected.fetch_add(1, std::memory_order_relaxed);
+        std::cout << "Disconnecting the slow consumer " << fd << "..." << std::endl;
+        return HandleStatus::disconnected;
+    }
+    size_t budget = control.rate ? stream->rate.budget(control.rate, cfg.line_size()) : SIZE_MAX;
+    if (budget == 0) return HandleStatus::try_again;
+    if (stream->sampled_offset < stream->sampled.size() ||
+        (slow_action == SlowConsumerAction::downsample && stream->block_offset == 0)){
+        return write_sampled(budget);
+    }
+
+    // a slow consumer under the drop policy gets one block at a time, so its socket fills up at a block boundary
+    int iov_count = slow_action == SlowConsumerAction::drop ? 1 : FLUSH_BLOCKS;
+    iovec iov[FLUSH_BLOCKS];
+    size_t total = 0;
+    for (int i = 0; i < iov_count; ++i){
+        if (!stream->blocks[i]) stream->blocks[i] = cache.acquire(cfg, stream->first_block + i);
+        size_t skip = i == 0 ? stream->block_offset : 0;
+        iov[i].iov_base = const_cast<char *>(stream->blocks[i]->data.data() + skip);
+        iov[i].iov_len = stream->blocks[i]->data.size() - skip;
+        total += iov[i].iov_len;
+    }
+    if (total > budget){ // "rate" command: cut the batch at the budget, even in the middle of a line
+        size_t left = budget;
+        for (iov_count = 0; left > 0; ++iov_count){
+            iov[iov_count].iov_len = std::min(iov[iov_count].iov_len, left);
+            left -= iov[iov_count].iov_len;
         }
+        total = budget;
     }
-    else if(ss.str() == strcmp){
-        return HandleStatus::switch_mode; // indicates that you need to start sending.
+
+    ssize_t write_res;
+    if (stream->zerocopy) stream->zerocopy->reap(fd);
+    if (stream->zerocopy && stream->zerocopy->can_send() && total >= profile.zerocopy_threshold){
+        std::shared_ptr<const void> owners[FLUSH_BLOCKS];
+        std::copy(stream->blocks.begin(), stream->blocks.end(), owners);
+        write_res = stream->zerocopy->send(fd, iov, iov_count, owners);
     }
     else{
+        write_res = robust_writev(fd, iov, iov_count);
+    }
+    if (write_res == -1){
+        return HandleStatus::disconnected; // if write was unsuccessful, probably the client is disconnected, so we return 0 and cause a destruction of an object
+    }
+    else if (write_res == 0){
+        if (slow_action == SlowConsumerAction::drop && stream->block_offset == 0){ // don't wait for the slow consumer
+            slow_consumers->dropped_lines.fetch_add(stream->blocks[0]->data.size() / cfg.line_size(),
+                                                    std::memory_order_relaxed);
+            advance_blocks(1);
+            save_position();
+        }
         return HandleStatus::try_again;
     }
+
+    // drop the blocks which were sent completely
+    last_cost = write_res;
+    stream->written += write_res;
+    if (control.rate) stream->rate.spend(write_res);
+    stream->block_offset += write_res;
+    int sent = 0;
+    while (sent < iov_count && stream->block_offset >= stream->blocks[sent]->data.size()){
+        stream->block_offset -= stream->blocks[sent]->data.size();
+        ++sent;
+    }
+    advance_blocks(sent);
+    save_position();
+    return HandleStatus::ok;
 }
 
-void ClientHandler::update(){
-    for (int i = 0; i < 3; ++i){
-        if (!seq_in_use[i]) continue;
-        if ( (std::numeric_limits<unsigned long long>::max() - seq[i]) < step[i] ) { // переполнение счетчика
-            seq[i] = inits[i];
-            continue;
+HandleStatus ClientHandler::write_sampled(size_t budget){
+    if (stream->sampled_offset == stream->sampled.size()){
+        if (!stream->blocks[0]) stream->blocks[0] = cache.acquire(cfg, stream->first_block);
+        const std::string& data = stream->blocks[0]->data;
+        const size_t line = cfg.line_size();
+        if (stream->sampled.capacity() == 0) stream->sampled.reserve(data.size() / SLOW_DOWNSAMPLE_FACTOR + line);
+        stream->sampled.clear();
+        size_t lines = 0;
+        for (size_t offset = 0; offset + line <= data.size(); offset += line * SLOW_DOWNSAMPLE_FACTOR, ++lines){
+            stream->sampled.append(data, offset, line);
+        }
+        slow_consumers->skipped_lines.fetch_add(data.size() / line - lines, std::memory_order_relaxed);
+        stream->sampled_offset = 0;
+        advance_blocks(1);
+    }
+
+    std::string& sampled = stream->sampled;
+    iovec iov{sampled.data() + stream->sampled_offset, std::min(sampled.size() - stream->sampled_offset, budget)};
+    ssize_t write_res = robust_writev(fd, &iov, 1);
+    if (write_res == -1) return HandleStatus::disconnected;
+    if (write_res == 0) return HandleStatus::try_again;
+    last_cost = write_res;
+    stream->written += write_res;
+    if (control.rate) stream->rate.spend(write_res);
+    stream->sampled_offset += write_res;
+    save_position();
+    return HandleStatus::ok;
+}
+
+void ClientHandler::advance_blocks(int n){
+    std::rotate(stream->blocks.begin(), stream->blocks.begin() + n, stream->blocks.end());
+    for (int i = FLUSH_BLOCKS - n; i < FLUSH_BLOCKS; ++i){
+        stream->blocks[i].reset();
+    }
+    stream->first_block += n;
+}
+
+void ClientHandler::save_position(){
+    if (session.slot < 0) return;
+    if (stream->sampled_offset < stream->sampled.size()){
+        // the downsampled block is already advanced over: resume at the line of it which is being sent
+        const size_t line = cfg.line_size();
+        session.store->save_position(session.slot, stream->first_block - 1,
+                                     stream->sampled_offset / line * SLOW_DOWNSAMPLE_FACTOR * line);
+        return;
+    }
+    session.store->save_position(session.slot, stream->first_block, stream->block_offset);
+}
+
+HandleStatus ClientHandler::poll_control(){
+    char buf[MAXLINE];
+    ssize_t n;
+    {
+        trace_span span("read", "fd", fd);
+        n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    }
+    if (n == 0) return HandleStatus::disconnected;
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return HandleStatus::disconnected;
+    if (n > 0){
+        stream->control_input.append(buf, n);
+        if (capture) capture->received(fd, buf, n);
+    }
+
+    std::string reply; // not sent, see the declaration
+    CommandContext ctx{cfg, &control, reply, &cache, overload};
+    trace_span span(stream->control_input.find('\n') != std::string::npos ? "parse" : nullptr, "fd", fd);
+    size_t start = 0, end;
+    while ((end = stream->control_input.find('\n', start)) != std::string::npos){
+        std::string_view line(stream->control_input.data() + start, end + 1 - start);
+        start = end + 1;
+        if (run_command(line, ctx, true) == HandleStatus::disconnected){
+            std::cout << "Client " << fd << " stopped the export." << std::endl;
+            return HandleStatus::disconnected;
+        }
+    }
+    stream->control_input.erase(0, start);
+    if (stream->control_input.size() > MAX_COMMAND_LEN) stream->control_input.clear(); // not a command, drop it
+    return HandleStatus::ok;
+}
+
+// ---- ConnectionTableHandler functions definition ----
+
+ConnectionTableHandler::~ConnectionTableHandler(){
+    for (size_t row = 0; row < table.size(); ++row){
+        close_fd(table.file_descriptor(row));
+    }
+    for (auto& conn : incoming){
+        close_fd(conn.fd);
+    }
+}
+
+void ConnectionTableHandler::adopt(int connfd, const SequenceConfig& cfg){
+    adopt(ConnectionTable::Row{connfd, cfg, std::string()});
+}
+
+void ConnectionTableHandler::adopt(ConnectionTable::Row&& row){
+    std::lock_guard<std::mutex> lk(incoming_mut);
+    incoming.push_back(std::move(row));
+}
+
+void ConnectionTableHandler::migrate(ConnectionTableHandler * to, size_t n){
+    std::lock_guard<std::mutex> lk(incoming_mut);
+    migrate_to = to;
+    migrate_count = n;
+}
+
+ssize_t ConnectionTableHandler::send_row(size_t row, const char * data, size_t size){
+    trace_span span("write", "fd", table.file_descriptor(row));
+    ssize_t n;
+    while ((n = write(table.file_descriptor(row), data, size)) < 0){
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        if (errno != EINTR){
+            dead.push_back(row);
+            return -1;
+        }
+    }
+    return n;
+}
+
+HandleStatus ConnectionTableHandler::handle(){
+    auto start = std::chrono::steady_clock::now();
+    ConnectionTableHandler * to;
+    size_t to_migrate;
+    {
+        std::lock_guard<std::mutex> lk(incoming_mut);
+        for (auto& conn : incoming){
+            table.add(std::move(conn));
+        }
+        incoming.clear();
+        to = migrate_to;
+        to_migrate = std::min(migrate_count, table.size());
+        migrate_to = nullptr;
+        migrate_count = 0;
+    }
+    // the rows are only touched by handle(), so between the passes they can leave with their pending output.
+    // The rows without pending output go first: they are the consumers which keep up, i.e. the load to spread. If
+    // there are not enough of them, the rows with a backlog follow, their pending output moves with them.
+    for (bool with_pending : {false, true}){
+        for (size_t row = table.size(); row-- > 0 && to_migrate > 0;){
+            if (table.pending(row).empty() == with_pending) continue;
+            to->adopt(table.take(row)); // take() moves the last row here, which was visited already
+            --to_migrate;
+            migrated_rows.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    last_cost = 0;
+    const size_t rows = table.size();
+    this->rows = rows;
+    if (rows == 0) return HandleStatus::try_again;
+
+    // 1. the rows with leftovers of the previous pass don't advance until the leftovers are sent
+    std::vector<uint8_t>& ready = table.ready_mask();
+    for (size_t row = 0; row < rows; ++row){
+        std::string& pending = table.pending(row);
+        ready[row] = 1;
+        if (pending.empty()) continue;
+        ssize_t n = send_row(row, pending.data(), pending.size());
+        if (n < 0 || static_cast<size_t>(n) < pending.size()) ready[row] = 0;
+        if (n > 0){
+            pending.erase(0, n);
+            last_cost += n;
+        }
+    }
+
+    // 2. advance all the ready streams together, render each line right after its pass
+    const size_t stride = LINES_PER_PASS * (SEQ_COUNT * SEQ_WIDTH + 1);
+    scratch.resize(rows * stride);
+    rendered.assign(rows, 0);
+    {
+        trace_span span("format", "rows", static_cast<long long>(rows));
+        for (int line = 0; line < LINES_PER_PASS; ++line){
+            table.advance();
+            for (size_t row = 0; row < rows; ++row){
+                if (ready[row]) rendered[row] += table.render(row, scratch.data() + row * stride + rendered[row]);
+            }
         }
-        seq[i] += step[i];
     }
+
+    // 3. scatter the lines to the sockets
+    size_t sent_rows = 0;
+    for (size_t row = 0; row < rows; ++row){
+        if (!ready[row]) continue;
+        const char * data = scratch.data() + row * stride;
+        ssize_t n = send_row(row, data, rendered[row]);
+        if (n < 0) continue;
+        if (n > 0) ++sent_rows;
+        last_cost += n;
+        if (static_cast<size_t>(n) < rendered[row]) table.pending(row).assign(data + n, rendered[row] - n);
+    }
+
+    // remove from the highest row, so moving the last row into the removed one never moves a dead row
+    std::sort(dead.begin(), dead.end());
+    dead.erase(std::unique(dead.begin(), dead.end()), dead.end());
+    for (auto it = dead.rbegin(); it != dead.rend(); ++it){
+        int connfd = table.file_descriptor(*it);
+        std::cout << "Client " << connfd << " disconnected. Freeing resources..." << std::endl;
+        if (capture) capture->closed(connfd);
+        close_fd(connfd);
+        table.remove(*it);
+    }
+    dead.clear();
+    this->rows = table.size();
+    active = sent_rows;
+    if (last_cost == 0) return HandleStatus::try_again;
+    auto busy = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    busy_ns += busy;
+    busy_total_ns.fetch_add(busy, std::memory_order_relaxed);
+    return HandleStatus::ok;
+}
+
+// ---- Server functions definition ----
+
+void Server::print_client(const sockaddr_storage& addr, socklen_t addrlen) const{
+    if (addr.ss_family == AF_UNIX){ // getnameinfo() doesn't support Unix sockets
+        printf("Connected to (unix:%s) \n", unix_path.c_str());
+        return;
+    }
+    char client_hostname[MAXLINE], client_port[MAXLINE];
+    // out of descriptors the name lookup can't open its files, a numeric address will do then
+    if (getnameinfo((const sockaddr *) & addr, addrlen, client_hostname, MAXLINE, client_port, MAXLINE, 0) != 0){
+        get_name_info((const sockaddr *) & addr, addrlen, client_hostname, MAXLINE,
+                      client_port, MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV);
+    }
+    printf("Connected to (%s,%s) \n", client_hostname, client_port);
 }
 
 // ---- ThreadPoolServer functions definition ----
 
+ThreadPoolServer::ThreadPoolServer(const char *port, const char *ip, const SocketProfile& profile,
+                                   unsigned table_shards, pool_limits workers):
+        Server(port, ip, profile), working_threads(DRR_QUANTUM, workers, "clients") {
+    if (table_shards == 0) return;
+    table_threads = std::make_unique<basic_thread_pool<ConnectionTableHandler>>(
+            DRR_QUANTUM, pool_limits{table_shards, table_shards}, "tables"); // a worker per shard, never resized
+    for (unsigned i = 0; i < table_shards; ++i){
+        tables.push_back(std::make_shared<ConnectionTableHandler>());
+        table_threads->submit(tables.back());
+    }
+    next_rebalance = std::chrono::steady_clock::now() + std::chrono::milliseconds(REBALANCE_INTERVAL_MS);
+    metrics_id = register_metrics([this](std::string& out){
+        unsigned long long migrated = 0;
+        for (size_t i = 0; i < tables.size(); ++i){
+            const std::string prefix = "tables.shard" + std::to_string(i) + ".";
+            append_metric(out, prefix + "rows", tables[i]->connections());
+            append_metric(out, prefix + "active_rows", tables[i]->active_connections());
+            append_metric(out, prefix + "busy_us", tables[i]->total_busy_ns() / 1000);
+            migrated += tables[i]->migrated();
+        }
+        append_metric(out, "tables.rebalances", rebalances.load(std::memory_order_relaxed));
+        append_metric(out, "tables.migrated", migrated);
+    });
+}
+
+ThreadPoolServer::~ThreadPoolServer(){
+    unregister_metrics(metrics_id);
+}
+
+void ThreadPoolServer::start_capture(const char *path){
+    Server::start_capture(path);
+    for (auto& table : tables){
+        table->record_to(capture.get());
+    }
+}
+
+ConnectionTableHandler * ThreadPoolServer::least_loaded_table() const{
+    ConnectionTableHandler * res = nullptr;
+    for (auto& table : tables){
+        if (!res || table->connections() < res->connections()) res = table.get();
+    }
+    return res;
+}
+
+void ThreadPoolServer::rebalance_tables(){
+    std::vector<unsigned long long> busy;
+    for (auto& table : tables){
+        busy.push_back(table->take_busy_ns()); // every interval starts from zero, even if nothing is moved
+    }
+    if (tables.size() < 2) return;
+    size_t hi = std::max_element(busy.begin(), busy.end()) - busy.begin();
+    size_t lo = std::min_element(busy.begin(), busy.end()) - busy.begin();
+    size_t rows = tables[hi]->active_connections();
+    if (rows < 2 || busy[hi] <= busy[lo] * IMBALANCE_RATIO) return;
+
+    // move the share of the active connections which evens out the busy time, if the connections are alike
+    size_t n = std::max<size_t>(1, rows * (busy[hi] - busy[lo]) / (2 * busy[hi]));
+    tables[hi]->migrate(tables[lo].get(), n);
+    ++rebalances;
+    unsigned long long migrated = 0; // by the previous rebalances, this one is done by the next handle() of the shard
+    for (auto& table : tables){
+        migrated += table->migrated();
+    }
+    std::cout << "Rebalancing the connection tables: moving " << n << " of " << rows << " active connections from shard "
+              << hi << " (busy " << busy[hi] / 1000000 << "ms) to shard " << lo << " (busy " << busy[lo] / 1000000
+              << "ms). Moved " << migrated << " connections so far in " << rebalances.load() << " rebalances." << std::endl;
+}
+
+void ThreadPoolServer::print_summary(){
+    std::string line = working_threads.interval_summary();
+    if (!line.empty()) std::cout << line << std::endl;
+    if (table_threads){
+        line = table_threads->interval_summary();
+        if (!line.empty()) std::cout << line << std::endl;
+    }
+}
+
+int ThreadPoolServer::poll_timeout() const{
+    auto next = std::min(next_summary, next_sizing);
+    if (!tables.empty()) next = std::min(next, next_rebalance);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::steady_clock::now()).count();
+    return static_cast<int>(std::max<long long>(ms, 0) + 1); // +1: don't wake up just before the deadline
+}
+
 void ThreadPoolServer::accept_connections(){
     int connfd;
     socklen_t clientlen{};
     sockaddr_storage clientaddr{};
-    char client_hostname[MAXLINE], client_port[MAXLINE];
+    std::vector<int> fds = listening_fds();
+    std::vector<pollfd> pfds;
+    for (int listenfd : fds){
+        pfds.push_back({listenfd, POLLIN, 0});
+    }
+    size_t next = 0; // the listening sockets which are ready, but not accepted from yet, start from pfds[next]
 
     while(true) {
+        if (!tables.empty() && std::chrono::steady_clock::now() >= next_rebalance){
+            rebalance_tables();
+            next_rebalance = std::chrono::steady_clock::now() + std::chrono::milliseconds(REBALANCE_INTERVAL_MS);
+        }
+        if (std::chrono::steady_clock::now() >= next_sizing){
+            working_threads.adapt_size();
+            next_sizing = std::chrono::steady_clock::now() + std::chrono::milliseconds(POOL_SIZING_INTERVAL_MS);
+        }
+        if (std::chrono::steady_clock::now() >= next_summary){
+            print_summary();
+            next_summary = std::chrono::steady_clock::now() + std::chrono::milliseconds(SUMMARY_INTERVAL_MS);
+        }
+        while (next < pfds.size() && !(pfds[next].revents & POLLIN)) ++next;
+        if (next == pfds.size()){
+            if (poll(pfds.data(), pfds.size(), poll_timeout()) < 0 && errno != EINTR){
+                print_error("Poll error");
+            }
+            next = 0;
+            continue;
+        }
+        pfds[next].revents = 0;
+        trace_span span("accept"); // recorded at the end of the iteration, when the handler is queued
+
         clientlen = sizeof(sockaddr_storage);
-        connfd = accept_connection(listening_fd, (sockaddr *) & clientaddr, &clientlen);
-        get_name_info((sockaddr *) & clientaddr, clientlen, client_hostname, MAXLINE,
-                      client_port, MAXLINE, 0);
-        printf("Connected to (%s,%s) \n", client_hostname, client_port);
+        connfd = accept_connection(pfds[next].fd, (sockaddr *) & clientaddr, &clientlen);
+        if (!working_threads.overload_control().admit_accept()){
+            robust_write(connfd, "Sorry, the server is overloaded now, try again later.");
+            close_fd(connfd);
+            continue;
+        }
+        SocketProfile client_profile = apply_socket_profile(connfd, profile);
+        print_client(clientaddr, clientlen);
 
         // We wrote here the try/catch solution, but we could also use the functionality of NewHandlerSupport
         // to allocate some memory at a program startup, and free it later.
         try{
-            std::shared_ptr<Handler> ch = std::make_shared<ClientHandler>(connfd); // spawn new ClientHandler
+            std::shared_ptr<ClientHandler> ch = std::make_shared<ClientHandler>(
+                    connfd, output_cache, client_profile, &working_threads.overload_control(),
+                    least_loaded_table(), sessions.get(), capture.get(), &slow_consumers); // spawn new ClientHandler
             working_threads.submit(std::move(ch)); // Add this ClientHandler to the pool
         }
         catch(std::bad_alloc&){
@@ -193,4 +793,249 @@ void ThreadPoolServer::accept_connections(){
             continue;
         }
     }
-}
\ No newline at end of file
+}
+
+// ---- CoroutineServer functions definition ----
+
+CoroutineServer::CoroutineServer(const char *port, const char *ip, const SocketProfile& profile, unsigned reactors):
+        Server(port, ip, profile), reactor_count(std::max(reactors, 1u)) {
+}
+
+CoroutineServer::CoroutineServer(int listening_fd, const char *ip, const SocketProfile& profile, unsigned reactors):
+        Server(listening_fd, ip, profile), reactor_count(std::max(reactors, 1u)) {
+}
+
+CoroutineServer::~CoroutineServer(){
+    if (busy_listening_fd != -1) close_fd(busy_listening_fd);
+}
+
+void CoroutineServer::busy_poll(const char *port, const std::vector<int>& cpus){
+    busy_listening_fd = open_listen_fd(port, ip.c_str());
+    if (busy_listening_fd == -1){
+        throw std::runtime_error(std::string("Could not listen on the busy poll port ") + port + ". Exiting...");
+    }
+    busy_cpus = cpus;
+}
+
+void CoroutineServer::accept_connections(){
+    // the reactors wait for the listening sockets in epoll, accept() must not block them
+    std::vector<int> fds = listening_fds();
+    if (busy_listening_fd != -1) fds.push_back(busy_listening_fd);
+    for (int listenfd : fds){
+        fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    }
+    std::vector<std::thread> threads;
+    join_threads joiner(threads);
+    if (busy_listening_fd != -1){
+        for (int cpu : busy_cpus){
+            threads.emplace_back(&CoroutineServer::run_reactor, this, cpu);
+        }
+    }
+    for (unsigned i = 1; i < reactor_count; ++i){
+        threads.emplace_back(&CoroutineServer::run_reactor, this, -1);
+    }
+    run_reactor();
+}
+
+void CoroutineServer::run_reactor(int cpu){
+    Reactor reactor(cpu >= 0);
+    std::vector<int> fds = listening_fds();
+    if (cpu >= 0){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0){
+            std::cerr << "Could not pin the busy-polling reactor to CPU " << cpu << ", it runs unpinned" << std::endl;
+        }
+        fds = {busy_listening_fd};
+        set_busy_poll(busy_listening_fd, BUSY_POLL_USECS);
+    }
+    for (int listenfd : fds){
+        reactor.add(listenfd, true); // EPOLLEXCLUSIVE: a new client wakes up only one of the reactors
+        accept_loop(reactor, listenfd);
+    }
+    reactor.run();
+}
+
+Task CoroutineServer::accept_loop(Reactor& reactor, int listenfd){
+    while (true){
+        sockaddr_storage clientaddr{};
+        socklen_t clientlen = sizeof(sockaddr_storage);
+        int connfd = accept4(listenfd, (sockaddr *) & clientaddr, &clientlen, SOCK_NONBLOCK);
+        if (connfd < 0){
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                co_await reactor.readable(listenfd);
+            }
+            else if (errno != EINTR && errno != ECONNABORTED){
+                // EMFILE, ENFILE, ENOBUFS, ENOMEM: the sessions of this reactor have to run to release something
+                std::cerr << "Accept error " << errno << std::endl;
+                co_await reactor.sleep_for(std::chrono::milliseconds(ACCEPT_RETRY_MS));
+            }
+            continue;
+        }
+        trace_span span("accept", "fd", connfd); // until the session suspends for the first time
+        print_client(clientaddr, clientlen);
+        if (reactor.busy_polling()) set_busy_poll(connfd, BUSY_POLL_USECS);
+
+        try{
+            client_session(reactor, connfd, apply_socket_profile(connfd, profile)); // runs until the first suspension
+        }
+        catch(std::bad_alloc&){
+            robust_write(connfd, "Sorry, the server is full now, try again later.");
+            close_fd(connfd);
+        }
+    }
+}
+
+Task CoroutineServer::client_session(Reactor& reactor, int connfd, SocketProfile client_profile){
+    try{
+        AsyncSocket sock(reactor, connfd);
+        SequenceConfig cfg;
+        StreamControl control;
+        if (co_await read_commands(sock, cfg, control)){
+            std::cout << "Changing mode to writing from listening on client " << connfd << "..." << std::endl;
+            co_await stream_output(sock, cfg, control, client_profile);
+        }
+    }
+    catch(std::bad_alloc&){
+        std::cerr << "Failed to allocate the output for client " << connfd << std::endl;
+    }
+    catch(std::runtime_error& e){ // the socket couldn't be added to epoll, AsyncSocket closed it
+        std::cerr << "Client " << connfd << ": " << e.what() << std::endl;
+    }
+    std::cout << "Client " << connfd << " disconnected. Freeing resources..." << std::endl;
+}
+
+Lazy<bool> CoroutineServer::read_commands(AsyncSocket& sock, SequenceConfig& cfg, StreamControl& control){
+    std::string line, reply;
+    while (co_await sock.read_line(line, MAX_COMMAND_LEN) > 0){
+        reply.clear();
+        CommandContext ctx{cfg, &control, reply, &output_cache};
+        HandleStatus parse_res;
+        {
+            trace_span span("parse", "fd", sock.file_descriptor());
+            parse_res = run_command(line, ctx);
+        }
+        if (!reply.empty() && !co_await sock.write_all(reply.data(), reply.size())) co_return false;
+        if (parse_res == HandleStatus::disconnected){
+            co_return false;
+        }
+        else if (parse_res == HandleStatus::switch_mode){
+            co_return true;
+        }
+        else if (parse_res == HandleStatus::switch_mode_shm){
+            if (!co_await sock.write_all(SHM_UNSUPPORTED_MESSAGE, strlen(SHM_UNSUPPORTED_MESSAGE))) co_return false;
+        }
+        else if (parse_res == HandleStatus::switch_mode_udp){
+            if (!co_await sock.write_all(UDP_UNSUPPORTED_MESSAGE, strlen(UDP_UNSUPPORTED_MESSAGE))) co_return false;
+        }
+        else if (parse_res == HandleStatus::try_again){
+            if (!co_await sock.write_all(PARSE_ERROR_MESSAGE, strlen(PARSE_ERROR_MESSAGE))) co_return false;
+        }
+    }
+    co_return false;
+}
+
+Lazy<bool> CoroutineServer::stream_output(AsyncSocket& sock, SequenceConfig& cfg, StreamControl& control,
+                                          const SocketProfile& client_profile){
+    if (cfg.nothing_to_show()){
+        co_await sock.write_all(NOTHING_TO_SHOW_MESSAGE, strlen(NOTHING_TO_SHOW_MESSAGE));
+        co_return false;
+    }
+
+    const int fd = sock.file_descriptor();
+    std::string control_input;
+    rate_limiter rate;
+    bool corked = false;
+    std::unique_ptr<zerocopy_sender> zerocopy(client_profile.zerocopy ? new zerocopy_sender() : nullptr);
+    std::array<std::shared_ptr<const OutputBlock>, FLUSH_BLOCKS> blocks;
+    iovec iov[FLUSH_BLOCKS];
+    unsigned long long first_block = 0; // index of blocks[0]
+    size_t block_offset = 0; // number of bytes of blocks[0] already sent
+    // the commands sent right after the export are applied before the first write
+    for (int rounds = CONTROL_POLL_INTERVAL;; ++rounds){
+        if (control.paused || control.rate || rounds >= CONTROL_POLL_INTERVAL){
+            rounds = 0;
+            if (!poll_control(sock, cfg, control, control_input)) co_return false;
+        }
+        bool cork = client_profile.cork && !control.paused && !control.rate;
+        if (cork != corked) set_cork(fd, corked = cork);
+        if (control.paused){
+            co_await sock.owner().readable(sock.file_descriptor());
+            continue;
+        }
+        size_t budget = control.rate ? rate.budget(control.rate, cfg.line_size()) : SIZE_MAX;
+        if (budget == 0){
+            co_await sock.owner().sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        size_t total = 0;
+        for (int i = 0; i < FLUSH_BLOCKS; ++i){
+            if (!blocks[i]) blocks[i] = output_cache.acquire(cfg, first_block + i);
+            size_t skip = i == 0 ? block_offset : 0;
+            iov[i].iov_base = const_cast<char *>(blocks[i]->data.data() + skip);
+            iov[i].iov_len = blocks[i]->data.size() - skip;
+            total += iov[i].iov_len;
+        }
+        int iov_count = FLUSH_BLOCKS;
+        if (total > budget){ // cut the batch at the budget, even in the middle of a line
+            size_t left = budget;
+            for (iov_count = 0; left > 0; ++iov_count){
+                iov[iov_count].iov_len = std::min(iov[iov_count].iov_len, left);
+                left -= iov[iov_count].iov_len;
+            }
+            total = budget;
+        }
+        ssize_t written = 0;
+        if (zerocopy) zerocopy->reap(fd);
+        if (zerocopy && zerocopy->can_send() && total >= client_profile.zerocopy_threshold){
+            std::shared_ptr<const void> owners[FLUSH_BLOCKS];
+            std::copy(blocks.begin(), blocks.end(), owners);
+            written = zerocopy->send(fd, iov, iov_count, owners); // the unsent rest goes in the next round
+            if (written < 0) co_return false;
+        }
+        if (written == 0){ // also when the socket or its optmem is full: the copy waits for the room
+            if (!co_await sock.write_all(iov, iov_count)) co_return false;
+            written = total;
+        }
+        if (control.rate) rate.spend(written);
+
+        // drop the blocks which were sent completely
+        block_offset += written;
+        int sent = 0;
+        while (sent < FLUSH_BLOCKS && block_offset >= blocks[sent]->data.size()){
+            block_offset -= blocks[sent]->data.size();
+            ++sent;
+        }
+        std::rotate(blocks.begin(), blocks.begin() + sent, blocks.end());
+        for (int i = FLUSH_BLOCKS - sent; i < FLUSH_BLOCKS; ++i){
+            blocks[i].reset();
+        }
+        first_block += sent;
+        co_await sock.owner().yield(); // let the other clients of this reactor go
+    }
+}
+
+bool CoroutineServer::poll_control(AsyncSocket& sock, SequenceConfig& cfg, StreamControl& control,
+                                   std::string& input){
+    char buf[MAXLINE];
+    ssize_t n = sock.read_available(buf, sizeof(buf));
+    if (n < 0) return false;
+    input.append(buf, n);
+
+    std::string reply; // not sent, a reply would get in the middle of the output
+    CommandContext ctx{cfg, &control, reply, &output_cache};
+    size_t start = 0, end;
+    while ((end = input.find('\n', start)) != std::string::npos){
+        std::string_view line(input.data() + start, end + 1 - start);
+        start = end + 1;
+        if (run_command(line, ctx, true) == HandleStatus::disconnected){
+            std::cout << "Client " << sock.file_descriptor() << " stopped the export." << std::endl;
+            return false;
+        }
+    }
+    input.erase(0, start);
+    if (input.size() > MAX_COMMAND_LEN) input.clear(); // not a command, drop it
+    return true;
+}
@@ -0,0 +1,178 @@
+#include "../include/alloc_trace.h"
+
+#include <execinfo.h>
+#include <cxxabi.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+struct alignas(64) thread_counters{
+    std::atomic<unsigned long long> allocations{0}, deallocations{0}, bytes{0};
+};
+
+struct alloc_site{
+    std::atomic<size_t> key{0}; // hash of the frames, 0 if the slot is free
+    void * frames[ALLOC_SITE_FRAMES]{};
+    std::atomic<unsigned long long> count{0}, bytes{0};
+};
+
+static thread_counters counters[MAX_TRACED_THREADS];
+static std::atomic<int> traced_threads{0};
+static alloc_site sites[ALLOC_SITES];
+
+static thread_local int counters_slot = -1;
+static thread_local bool in_hook = false; // backtrace() may allocate, those allocations aren't attributed
+
+static thread_counters& my_counters(){
+    if (counters_slot < 0) counters_slot = std::min(traced_threads.fetch_add(1), MAX_TRACED_THREADS - 1);
+    return counters[counters_slot];
+}
+
+/**
+ * Counts the allocation in the table of the call sites, open addressing on the hash of the return addresses.
+ */
+__attribute__((noinline)) static void record_site(size_t size){
+    void * stack[ALLOC_SITE_FRAMES + 2];
+    int depth = backtrace(stack, ALLOC_SITE_FRAMES + 2);
+    void ** frames = stack + 2; // record_site() and operator new
+    depth = std::max(depth - 2, 0);
+
+    size_t key = 14695981039346656037ULL;
+    for (int i = 0; i < depth; ++i) key = (key ^ reinterpret_cast<size_t>(frames[i])) * 1099511628211ULL;
+    key |= 1; // never 0
+
+    for (size_t probe = 0; probe < ALLOC_SITES; ++probe){
+        alloc_site& site = sites[(key + probe) & (ALLOC_SITES - 1)];
+        size_t current = site.key.load(std::memory_order_acquire);
+        if (current == 0){
+            if (site.key.compare_exchange_strong(current, key, std::memory_order_acq_rel)){
+                std::copy(frames, frames + depth, site.frames);
+                current = key;
+            }
+        }
+        if (current == key){
+            site.count.fetch_add(1, std::memory_order_relaxed);
+            site.bytes.fetch_add(size, std::memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+__attribute__((always_inline)) static inline void on_allocation(size_t size){
+    thread_counters& c = my_counters();
+    c.allocations.fetch_add(1, std::memory_order_relaxed);
+    c.bytes.fetch_add(size, std::memory_order_relaxed);
+    if (in_hook) return;
+    in_hook = true;
+    record_site(size);
+    in_hook = false;
+}
+
+static void on_deallocation(void * p){
+    if (p) my_counters().deallocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+__attribute__((always_inline)) static inline void * traced_alloc(size_t size, size_t alignment = 0){
+    if (size == 0) size = 1;
+    void * p;
+    while (!(p = alignment ? aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment) : malloc(size))){
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+    on_allocation(size);
+    return p;
+}
+
+static void traced_free(void * p){
+    on_deallocation(p);
+    free(p);
+}
+
+// ---- Replaced global operators ----
+
+__attribute__((noinline)) void * operator new(size_t size){ return traced_alloc(size); }
+__attribute__((noinline)) void * operator new[](size_t size){ return traced_alloc(size); }
+__attribute__((noinline)) void * operator new(size_t size, std::align_val_t al){
+    return traced_alloc(size, static_cast<size_t>(al));
+}
+__attribute__((noinline)) void * operator new[](size_t size, std::align_val_t al){
+    return traced_alloc(size, static_cast<size_t>(al));
+}
+void * operator new(size_t size, const std::nothrow_t&) noexcept{
+    try{ return traced_alloc(size); } catch(...){ return nullptr; }
+}
+void * operator new[](size_t size, const std::nothrow_t&) noexcept{
+    try{ return traced_alloc(size); } catch(...){ return nullptr; }
+}
+
+void operator delete(void * p) noexcept{ traced_free(p); }
+void operator delete[](void * p) noexcept{ traced_free(p); }
+void operator delete(void * p, size_t) noexcept{ traced_free(p); }
+void operator delete[](void * p, size_t) noexcept{ traced_free(p); }
+void operator delete(void * p, std::align_val_t) noexcept{ traced_free(p); }
+void operator delete[](void * p, std::align_val_t) noexcept{ traced_free(p); }
+void operator delete(void * p, size_t, std::align_val_t) noexcept{ traced_free(p); }
+void operator delete[](void * p, size_t, std::align_val_t) noexcept{ traced_free(p); }
+void operator delete(void * p, const std::nothrow_t&) noexcept{ traced_free(p); }
+void operator delete[](void * p, const std::nothrow_t&) noexcept{ traced_free(p); }
+
+// ---- Reports ----
+
+alloc_stats alloc_totals(){
+    alloc_stats res{};
+    int n = std::min(traced_threads.load(), MAX_TRACED_THREADS);
+    for (int i = 0; i < n; ++i){
+        res.allocations += counters[i].allocations.load(std::memory_order_relaxed);
+        res.deallocations += counters[i].deallocations.load(std::memory_order_relaxed);
+        res.bytes += counters[i].bytes.load(std::memory_order_relaxed);
+    }
+    return res;
+}
+
+alloc_stats thread_alloc_stats(){
+    thread_counters& c = my_counters();
+    return {c.allocations.load(std::memory_order_relaxed), c.deallocations.load(std::memory_order_relaxed),
+            c.bytes.load(std::memory_order_relaxed)};
+}
+
+/**
+ * @return the demangled function name of the backtrace_symbols() entry "binary(name+0x1f) [0x...]"
+ */
+static std::string symbol_name(const char * entry){
+    const char * open = strchr(entry, '(');
+    const char * plus = open ? strchr(open, '+') : nullptr;
+    if (!open || !plus || plus == open + 1) return entry;
+    std::string mangled(open + 1, plus);
+    int status;
+    char * demangled = abi::__cxa_demangle(mangled.c_str(), nullptr, nullptr, &status);
+    std::string res = status == 0 ? demangled : mangled;
+    free(demangled);
+    return res;
+}
+
+void dump_alloc_sites(std::string& out, size_t top){
+    std::vector<std::pair<unsigned long long, size_t>> order;
+    for (size_t i = 0; i < ALLOC_SITES; ++i){
+        if (sites[i].key.load(std::memory_order_acquire) != 0) order.emplace_back(sites[i].count.load(), i);
+    }
+    std::sort(order.rbegin(), order.rend());
+    if (order.size() > top) order.resize(top);
+
+    for (auto& [count, i] : order){
+        alloc_site& site = sites[i];
+        int depth = 0;
+        while (depth < ALLOC_SITE_FRAMES && site.frames[depth]) ++depth;
+        out += "site count=" + std::to_string(count) + " bytes=" + std::to_string(site.bytes.load()) + " at";
+        char ** symbols = backtrace_symbols(site.frames, depth);
+        for (int f = 0; symbols && f < depth; ++f){
+            out += f == 0 ? " " : " < ";
+            out += symbol_name(symbols[f]);
+        }
+        free(symbols);
+        out += "\n";
+    }
+}
@@ -0,0 +1,285 @@
+#include "../include/baum_client.h"
+#include "../include/sockets_io.h"
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
+static const int CLIENT_COLUMN_WIDTH = 25; // SEQ_WIDTH of the server
+static const int CLIENT_MAXLINE = 256;
+static const int RING_POLL_MS = 100; // how often a reader waiting on the ring checks that the server is alive
+
+// ---- SequenceClient functions definition ----
+
+SequenceClient::SequenceClient(const char *host, const char *port): buffer(CLIENT_READ_CHUNK) {
+    addrinfo hints{}, * candidates, * candidate;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(host, port, &hints, &candidates) != 0){
+        throw std::runtime_error(std::string("Could not resolve ") + host + ":" + port);
+    }
+    for (candidate = candidates; candidate; candidate = candidate->ai_next){
+        if ((fd = socket(candidate->ai_family, candidate->ai_socktype | SOCK_CLOEXEC, candidate->ai_protocol)) < 0){
+            continue;
+        }
+        if (connect(fd, candidate->ai_addr, candidate->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(candidates);
+    if (fd == -1){
+        throw std::runtime_error(std::string("Could not connect to ") + host + ":" + port);
+    }
+}
+
+SequenceClient::SequenceClient(const char *unix_path): unix_socket(true), buffer(CLIENT_READ_CHUNK) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    size_t len = strlen(unix_path);
+    if (len == 0 || len >= sizeof(addr.sun_path)){
+        throw std::runtime_error(std::string("Bad Unix socket path ") + unix_path);
+    }
+    memcpy(addr.sun_path, unix_path, len);
+    if (unix_path[0] == '@') addr.sun_path[0] = '\0'; // abstract namespace
+    auto addrlen = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + len);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (sockaddr *) &addr, addrlen) < 0){
+        if (fd >= 0) close(fd);
+        throw std::runtime_error(std::string("Could not connect to ") + unix_path);
+    }
+}
+
+SequenceClient::~SequenceClient(){
+    disconnect();
+}
+
+void SequenceClient::disconnect(){
+    if (fd != -1) close(fd);
+    fd = -1;
+}
+
+SequenceClient& SequenceClient::seq(int n, unsigned long long start, unsigned long long step, const std::string& kind){
+    pending_commands += "seq" + std::to_string(n) + " " + std::to_string(start) + " " + std::to_string(step);
+    pending_commands += kind.empty() ? "\r\n" : " " + kind + "\r\n";
+    if (n < 1 || n > CLIENT_SEQ_COUNT) return *this;
+    // as the server does: a zero turns off only the arithmetic sequence, the other kinds are always on
+    if (kind.empty() || kind == "arithmetic"){
+        if (start == 0 || step == 0) in_use[n - 1] = false;
+    }
+    else if (kind != "xorshift" || start != 0 || step != 0) in_use[n - 1] = true; // the zero seed is rejected
+    return *this;
+}
+
+SequenceClient& SequenceClient::command(const std::string& line){
+    pending_commands += line + "\r\n";
+    if (line == "reset") in_use = {true, true, true};
+    return *this;
+}
+
+bool SequenceClient::send_commands(const std::string& last_command){
+    pending_commands += last_command;
+    columns = 0;
+    for (bool used : in_use) columns += used;
+
+    const char * data = pending_commands.data();
+    size_t left = pending_commands.size();
+    while (left > 0 && fd != -1){
+        ssize_t n = send(fd, data, left, MSG_NOSIGNAL);
+        if (n < 0){
+            if (errno == EINTR) continue;
+            disconnect();
+            break;
+        }
+        data += n;
+        left -= n;
+    }
+    pending_commands.clear();
+    return fd != -1;
+}
+
+std::string SequenceClient::query(const std::string& line){
+    if (!send_commands(line + "\r\n")) return {};
+    return read_reply();
+}
+
+std::string SequenceClient::read_reply(){
+    while (fd != -1){
+        const char * data = buffer.data() + begin;
+        const auto * lf = static_cast<const char *>(memchr(data, '\n', end - begin));
+        if (lf){
+            begin += lf - data + 1;
+            return {data, lf};
+        }
+        if (end == buffer.size()) end = begin = 0; // a reply can't be that long, drop it
+        ssize_t res = recv(fd, buffer.data() + end, buffer.size() - end, 0);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) disconnect();
+        else end += res;
+    }
+    return {};
+}
+
+bool SequenceClient::export_seq(){
+    return send_commands("export seq\r\n");
+}
+
+bool SequenceClient::export_shm(){
+    if (!unix_socket){
+        message = "The shared memory export needs a Unix socket connection.";
+        return false;
+    }
+    if (!send_commands("export shm\r\n")) return false;
+
+    // the replies to the other commands may come first, the ring comes with "shm <frames> <frame size>\n"
+    while (fd != -1){
+        char text[CLIENT_MAXLINE];
+        int fds[2];
+        int nfds = 2;
+        ssize_t n = recv_with_fds(fd, text, sizeof(text) - 1, fds, nfds);
+        if (n <= 0){
+            disconnect();
+            break;
+        }
+        text[n] = '\0';
+        if (nfds == 2){
+            ring.reset(new ShmRingConsumer(fds[0], fds[1]));
+            return true;
+        }
+        for (int i = 0; i < nfds; ++i) close(fds[i]);
+        message.assign(text, n);
+    }
+    return false;
+}
+
+size_t SequenceClient::parse(SeqLine * out, size_t max){
+    const size_t width = columns * CLIENT_COLUMN_WIDTH + 1;
+    size_t count = 0;
+    while (count < max && begin < end){
+        const char * line = buffer.data() + begin;
+        const auto * lf = static_cast<const char *>(memchr(line, '\n', end - begin));
+        if (!lf) break;
+        size_t len = lf - line + 1;
+        begin += len;
+
+        SeqLine& res = out[count];
+        bool is_output = len == width && columns > 0;
+        for (int c = 0; c < columns && is_output; ++c){
+            const char * field = line + c * CLIENT_COLUMN_WIDTH;
+            unsigned long long value = 0;
+            for (int k = 0; k < CLIENT_COLUMN_WIDTH; ++k){
+                char ch = field[k];
+                if (ch >= '0' && ch <= '9') value = value * 10 + (ch - '0');
+                else if (ch != ' '){
+                    is_output = false;
+                    break;
+                }
+            }
+            res.values[c] = value;
+        }
+        if (!is_output){
+            message.assign(line, len - 1);
+            continue;
+        }
+        res.line = next_line++;
+        res.count = columns;
+        ++count;
+    }
+    return count;
+}
+
+size_t SequenceClient::read_ring(SeqLine * out, size_t max, bool block){
+    if (frames.size() < max) frames.resize(max);
+    size_t n;
+    while ((n = ring->read(frames.data(), max)) == 0 && block && fd != -1){
+        if (!ring->wait(RING_POLL_MS)){
+            char c;
+            ssize_t res = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (res == 0 || (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) disconnect();
+        }
+    }
+    const uint32_t mask = ring->seq_mask();
+    for (size_t k = 0; k < n; ++k){
+        SeqLine& res = out[k];
+        res.line = frames[k].line;
+        res.count = 0;
+        for (int i = 0; i < CLIENT_SEQ_COUNT; ++i){
+            if (mask & (1u << i)) res.values[res.count++] = frames[k].values[i];
+        }
+    }
+    if (n > 0) arrival = std::chrono::steady_clock::now();
+    received += n * sizeof(seq_frame);
+    return n;
+}
+
+size_t SequenceClient::read(SeqLine * out, size_t max, bool block){
+    if (batch_pos < batch.size()){ // left by next() or for_each()
+        size_t n = std::min(max, batch.size() - batch_pos);
+        std::copy(batch.begin() + batch_pos, batch.begin() + batch_pos + n, out);
+        batch_pos += n;
+        return n;
+    }
+    if (ring) return read_ring(out, max, block);
+
+    size_t n = parse(out, max);
+    while (n == 0 && fd != -1){
+        if (begin > 0){ // keep the incomplete line, make room for the next chunk
+            memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+        if (end == buffer.size()) end = 0; // a chunk without a single line feed isn't our protocol, drop it
+
+        ssize_t res = recv(fd, buffer.data() + end, buffer.size() - end, block ? 0 : MSG_DONTWAIT);
+        if (res < 0 && errno == EINTR) continue;
+        if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (res <= 0){
+            disconnect();
+            break;
+        }
+        arrival = std::chrono::steady_clock::now();
+        received += res;
+        end += res;
+        n = parse(out, max);
+    }
+    return n;
+}
+
+bool SequenceClient::refill(){
+    batch.resize(CLIENT_READ_CHUNK / (CLIENT_COLUMN_WIDTH + 1));
+    batch_pos = batch.size(); // so read() doesn't return the stale lines
+    batch.resize(read(batch.data(), batch.size()));
+    batch_pos = 0;
+    return !batch.empty();
+}
+
+size_t SequenceClient::for_each(const std::function<bool(const SeqLine&)>& on_line, size_t max_lines){
+    size_t total = 0;
+    while (max_lines == 0 || total < max_lines){
+        if (batch_pos == batch.size() && !refill()) break;
+        ++total;
+        if (!on_line(batch[batch_pos++])) break; // the rest of the batch is left for the next call
+    }
+    return total;
+}
+
+bool SequenceClient::next(SeqLine& line){
+    if (batch_pos == batch.size() && !refill()) return false;
+    line = batch[batch_pos++];
+    return true;
+}
+
+// ---- SequenceClient::iterator functions definition ----
+
+SequenceClient::iterator::iterator(SequenceClient * client): client(client) {
+    if (client) ++*this;
+}
+
+SequenceClient::iterator& SequenceClient::iterator::operator++(){
+    if (!client->next(current)) client = nullptr;
+    return *this;
+}
@@ -0,0 +1,156 @@
+#include "../include/capture.h"
+#include "../include/net.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+static void append_varint(std::string& out, uint64_t value){
+    while (value >= 0x80){
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+// ---- CaptureWriter functions definition ----
+
+/**
+ * @return false if the disk is full or failing
+ */
+static bool write_all(int fd, const std::string& data){
+    size_t done = 0;
+    while (done < data.size()){
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+CaptureWriter::CaptureWriter(const char *path):
+        last_record(std::chrono::steady_clock::now()) {
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0){
+        throw std::runtime_error(std::string("Could not create the capture file ") + path);
+    }
+    buffer.reserve(2 * CAPTURE_FLUSH_BYTES);
+    buffer.append(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    writer = std::thread(&CaptureWriter::write_loop, this);
+}
+
+CaptureWriter::~CaptureWriter(){
+    {
+        std::lock_guard<std::mutex> lk(mut);
+        stopping = true;
+    }
+    wake_writer.notify_one();
+    writer.join();
+    close_fd(fd);
+}
+
+void CaptureWriter::opened(int connfd){
+    std::lock_guard<std::mutex> lk(mut);
+    sessions[connfd] = next_session;
+    append(CaptureType::open, next_session++, nullptr, 0);
+}
+
+void CaptureWriter::received(int connfd, const char *data, size_t size){
+    std::lock_guard<std::mutex> lk(mut);
+    auto it = sessions.find(connfd);
+    if (it != sessions.end()) append(CaptureType::data, it->second, data, size);
+}
+
+void CaptureWriter::closed(int connfd){
+    std::lock_guard<std::mutex> lk(mut);
+    auto it = sessions.find(connfd);
+    if (it == sessions.end()) return;
+    append(CaptureType::close, it->second, nullptr, 0);
+    sessions.erase(it);
+    flush(); // a finished session goes to the file at once
+}
+
+void CaptureWriter::append(CaptureType type, uint32_t session, const char *data, size_t size){
+    auto now = std::chrono::steady_clock::now();
+    buffer += static_cast<char>(type);
+    append_varint(buffer, session);
+    append_varint(buffer, std::chrono::duration_cast<std::chrono::microseconds>(now - last_record).count());
+    last_record = now;
+    if (type == CaptureType::data){
+        append_varint(buffer, size);
+        buffer.append(data, size);
+    }
+    if (buffer.size() >= CAPTURE_FLUSH_BYTES) flush();
+}
+
+void CaptureWriter::flush(){
+    if (flush_requested) return;
+    flush_requested = true;
+    wake_writer.notify_one();
+}
+
+void CaptureWriter::write_loop(){
+    std::string out; // swapped with the buffer, so both keep their capacity
+    out.reserve(2 * CAPTURE_FLUSH_BYTES);
+    bool failed = false;
+    std::unique_lock<std::mutex> lk(mut);
+    while (true){
+        wake_writer.wait_for(lk, std::chrono::milliseconds(CAPTURE_FLUSH_MS),
+                             [this]{ return flush_requested || stopping; });
+        flush_requested = false;
+        const bool last = stopping;
+        buffer.swap(out);
+        lk.unlock();
+        // the disk is full: the capture ends here, the server goes on
+        if (!failed && !out.empty()) failed = !write_all(fd, out);
+        out.clear();
+        lk.lock();
+        if (last && buffer.empty()) return;
+    }
+}
+
+// ---- CaptureReader functions definition ----
+
+CaptureReader::CaptureReader(const char *path){
+    std::ifstream in(path, std::ios::binary);
+    if (!in){
+        throw std::runtime_error(std::string("Could not open the capture file ") + path);
+    }
+    content.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    if (content.size() < sizeof(CAPTURE_MAGIC) || memcmp(content.data(), CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0){
+        throw std::runtime_error(std::string("The file ") + path + " is not a capture");
+    }
+    pos = sizeof(CAPTURE_MAGIC);
+}
+
+bool CaptureReader::read_varint(uint64_t& value){
+    value = 0;
+    for (int shift = 0; pos < content.size() && shift < 64; shift += 7){
+        auto byte = static_cast<uint8_t>(content[pos++]);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+bool CaptureReader::next(CaptureRecord& record){
+    if (pos >= content.size()) return false;
+    auto type = static_cast<uint8_t>(content[pos++]);
+    if (type > static_cast<uint8_t>(CaptureType::close)) return false;
+    record.type = static_cast<CaptureType>(type);
+
+    uint64_t session, delta, size = 0;
+    if (!read_varint(session) || !read_varint(delta)) return false;
+    if (record.type == CaptureType::data && (!read_varint(size) || size > content.size() - pos)) return false;
+    record.session = static_cast<uint32_t>(session);
+    time_us += delta;
+    record.time_us = time_us;
+    record.data.assign(content, pos, size);
+    pos += size;
+    return true;
+}
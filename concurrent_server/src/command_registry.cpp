@@ -0,0 +1,316 @@
+#include "../include/command_registry.h"
+#include "../include/Server.h"
+#include "../include/session_store.h"
+#include "../include/event_trace.h"
+#include "../include/metrics.h"
+#ifdef BAUM_ALLOC_TRACE
+#include "../include/alloc_trace.h"
+#endif
+
+#include <charconv>
+#include <cstdint>
+
+// ---- Commands definition ----
+
+/**
+ * "seqN x y [kind]": the sequence N of the kind, arithmetic if it's left out, starts from x with the parameter y, see
+ * generators.h. A zero turns an arithmetic sequence off; the other kinds accept the zeros, and turn the slot on, except
+ * the all-zero xorshift seed, which is rejected.
+ */
+template<int N>
+static HandleStatus set_sequence(CommandContext& ctx, const CommandArgs& args){
+    SeqKind kind = SeqKind::arithmetic;
+    if (!args.word[2].empty() && !kind_from_name(args.word[2], kind)) return HandleStatus::try_again;
+    if (kind == SeqKind::xorshift && args.number[0] == 0 && args.number[1] == 0) return HandleStatus::try_again;
+    if (kind != SeqKind::arithmetic) ctx.cfg.seq_in_use[N] = true;
+    else if (args.number[0] == 0 || args.number[1] == 0) ctx.cfg.seq_in_use[N] = false;
+    ctx.cfg.kind[N] = kind;
+    ctx.cfg.seq[N] = args.number[0];
+    ctx.cfg.step[N] = args.number[1];
+    return HandleStatus::ok;
+}
+
+static bool parse_number(std::string_view token, unsigned long long& value);
+
+/**
+ * "export seq", "export shm", "export udp <port> [gso]", see udp_export.h.
+ */
+static HandleStatus begin_export(CommandContext& ctx, const CommandArgs& args){
+    if (args.word[0] == "seq") return HandleStatus::switch_mode;
+    if (args.word[0] == "shm") return HandleStatus::switch_mode_shm;
+    if (args.word[0] != "udp") return HandleStatus::try_again;
+
+    unsigned long long port = 0;
+    if (!parse_number(args.word[1], port) || port == 0 || port > UINT16_MAX) return HandleStatus::try_again;
+    if (!args.word[2].empty() && args.word[2] != "gso") return HandleStatus::try_again;
+    if (ctx.control){ // the servers which can't control the export reject the mode anyway
+        ctx.control->udp_port = static_cast<uint16_t>(port);
+        ctx.control->udp_gso = !args.word[2].empty();
+    }
+    return HandleStatus::switch_mode_udp;
+}
+
+static HandleStatus stop_connection(CommandContext&, const CommandArgs&){
+    return HandleStatus::disconnected;
+}
+
+static HandleStatus pause_export(CommandContext& ctx, const CommandArgs&){
+    if (!ctx.control) return HandleStatus::try_again;
+    ctx.control->paused = true;
+    return HandleStatus::ok;
+}
+
+static HandleStatus resume_export(CommandContext& ctx, const CommandArgs&){
+    if (!ctx.control) return HandleStatus::try_again;
+    ctx.control->paused = false;
+    return HandleStatus::ok;
+}
+
+/**
+ * "resume <token>": continues the session from the position its last connection reached, the export is started by the
+ * next "export seq". The session must not be used by another connection.
+ */
+static HandleStatus resume_session(CommandContext& ctx, const CommandArgs& args){
+    if (!ctx.session || !ctx.session->store) return HandleStatus::try_again;
+    std::string_view token = args.word[0];
+    uint64_t value = 0;
+    auto res = std::from_chars(token.data(), token.data() + token.size(), value, 16);
+    if (res.ec != std::errc() || res.ptr != token.data() + token.size()) return HandleStatus::try_again;
+
+    int slot = ctx.session->store->attach(value);
+    if (slot < 0) return HandleStatus::try_again;
+    if (ctx.session->slot >= 0) ctx.session->store->detach(ctx.session->slot);
+    ctx.session->slot = slot;
+    ctx.cfg = ctx.session->store->load_config(slot);
+    return HandleStatus::ok;
+}
+
+/**
+ * "resume" continues the paused export, "resume <token>" continues the session.
+ */
+static HandleStatus resume(CommandContext& ctx, const CommandArgs& args){
+    if (args.word[0].empty()) return resume_export(ctx, args);
+    return resume_session(ctx, args);
+}
+
+/**
+ * "session": replies "session <token>", creates the session of the connection if there's none yet.
+ */
+static HandleStatus open_session(CommandContext& ctx, const CommandArgs&){
+    if (!ctx.session || !ctx.session->store) return HandleStatus::try_again;
+    SessionStore& store = *ctx.session->store;
+    if (ctx.session->slot < 0 && store.create(ctx.session->slot) == 0) return HandleStatus::try_again;
+
+    char token[2 * sizeof(uint64_t)];
+    auto res = std::to_chars(token, token + sizeof(token), store.token(ctx.session->slot), 16);
+    ctx.reply = "session " + std::string(token, res.ptr) + "\n";
+    return HandleStatus::ok;
+}
+
+static HandleStatus set_rate(CommandContext& ctx, const CommandArgs& args){
+    if (!ctx.control) return HandleStatus::try_again;
+    ctx.control->rate = args.number[0];
+    return HandleStatus::ok;
+}
+
+static HandleStatus reset_config(CommandContext& ctx, const CommandArgs&){
+    ctx.cfg = SequenceConfig();
+    if (ctx.control) *ctx.control = StreamControl();
+    return HandleStatus::ok;
+}
+
+static HandleStatus report_status(CommandContext& ctx, const CommandArgs&){
+    std::string& out = ctx.reply;
+    out = "status";
+    for (int i = 0; i < SEQ_COUNT; ++i){
+        out += " seq" + std::to_string(i + 1) + "=";
+        out += ctx.cfg.seq_in_use[i] ? std::to_string(ctx.cfg.seq[i]) + "/" + std::to_string(ctx.cfg.step[i]) : "off";
+        if (ctx.cfg.seq_in_use[i] && ctx.cfg.kind[i] != SeqKind::arithmetic){
+            out += "/" + std::string(generator_of(ctx.cfg.kind[i]).name);
+        }
+    }
+    if (ctx.control){
+        out += " paused=" + std::to_string(ctx.control->paused) + " rate=" + std::to_string(ctx.control->rate);
+    }
+    if (ctx.cache){
+        out += " rendered_blocks=" + std::to_string(ctx.cache->rendered_blocks());
+        out += " shared_blocks=" + std::to_string(ctx.cache->shared_blocks());
+    }
+    if (ctx.overload){
+        codel_controller::stats_t stats = ctx.overload->stats();
+        out += " overloaded=" + std::to_string(ctx.overload->overloaded());
+        out += " shed_accepts=" + std::to_string(stats.shed_accepts);
+        out += " max_sojourn_us=" + std::to_string(stats.max_sojourn_us);
+    }
+#ifdef BAUM_ALLOC_TRACE
+    out += " allocations=" + std::to_string(alloc_totals().allocations);
+#endif
+    out += "\n";
+    return HandleStatus::ok;
+}
+
+/**
+ * "allocs": replies "allocs total=N deallocations=N bytes=B", "allocs sites" adds ALLOCS_REPORT_SITES lines of the call
+ * sites, see alloc_trace.h. Only the builds with BAUM_ALLOC_TRACE count the allocations.
+ */
+static HandleStatus report_allocations([[maybe_unused]] CommandContext& ctx, [[maybe_unused]] const CommandArgs& args){
+#ifdef BAUM_ALLOC_TRACE
+    static const size_t ALLOCS_REPORT_SITES = 16;
+    alloc_stats totals = alloc_totals(); // before the reply allocates anything
+    ctx.reply = "allocs total=" + std::to_string(totals.allocations);
+    ctx.reply += " deallocations=" + std::to_string(totals.deallocations);
+    ctx.reply += " bytes=" + std::to_string(totals.bytes) + "\n";
+    if (args.word[0] == "sites") dump_alloc_sites(ctx.reply, ALLOCS_REPORT_SITES);
+    return HandleStatus::ok;
+#else
+    return HandleStatus::try_again;
+#endif
+}
+
+/**
+ * "trace on", "trace off", "trace dump": switches the event tracing, or dumps it and replies "trace <events> <file>".
+ * Only if the server runs with --trace-control: the tracing slows every thread, so a client mustn't switch it at will,
+ * and the dumps overwrite one file rather than fill the disk.
+ */
+static HandleStatus control_tracing(CommandContext& ctx, const CommandArgs& args){
+    if (!trace_control.load(std::memory_order_relaxed)){
+        ctx.reply = "trace control is off, run the server with --trace-control\n";
+        return HandleStatus::ok;
+    }
+    if (args.word[0] == "on" || args.word[0] == "off"){
+        set_tracing(args.word[0] == "on");
+        return HandleStatus::ok;
+    }
+    if (args.word[0] != "dump") return HandleStatus::try_again;
+    std::string path = "baum-trace-" + std::to_string(getpid()) + ".json";
+    long events = dump_trace(path);
+    if (events < 0) return HandleStatus::try_again;
+    ctx.reply = "trace " + std::to_string(events) + " " + path + "\n";
+    return HandleStatus::ok;
+}
+
+/**
+ * "metrics": replies "metrics <n>" and then n lines "<name> <value>" of the registered sources, see metrics.h.
+ */
+static HandleStatus report_all_metrics(CommandContext& ctx, const CommandArgs&){
+    std::string lines;
+    report_metrics(lines);
+    ctx.reply = "metrics " + std::to_string(std::count(lines.begin(), lines.end(), '\n')) + "\n" + lines;
+    return HandleStatus::ok;
+}
+
+/**
+ * The protocol. Add a line here to add a command.
+ */
+static constexpr Command COMMANDS[] = {
+        {"seq1", {ArgType::number, ArgType::number, ArgType::optional_word}, false, set_sequence<0>},
+        {"seq2", {ArgType::number, ArgType::number, ArgType::optional_word}, false, set_sequence<1>},
+        {"seq3", {ArgType::number, ArgType::number, ArgType::optional_word}, false, set_sequence<2>},
+        {"export", {ArgType::word, ArgType::optional_word, ArgType::optional_word}, false, begin_export},
+        {"stop", {}, true, stop_connection},
+        {"pause", {}, true, pause_export},
+        {"resume", {ArgType::optional_word}, true, resume},
+        {"rate", {ArgType::number}, true, set_rate},
+        {"reset", {}, false, reset_config},
+        {"status", {}, false, report_status},
+        {"session", {}, false, open_session},
+        {"allocs", {ArgType::optional_word}, false, report_allocations},
+        {"trace", {ArgType::word}, false, control_tracing},
+        {"metrics", {}, false, report_all_metrics},
+};
+static constexpr int COMMAND_COUNT = sizeof(COMMANDS) / sizeof(COMMANDS[0]);
+
+// ---- Perfect hash of the verbs ----
+
+static constexpr uint32_t HASH_SLOTS = 32; // power of two, more than the number of commands
+
+static constexpr uint32_t verb_hash(std::string_view verb, uint32_t seed){
+    uint32_t h = 2166136261u ^ seed; // FNV-1a
+    for (char c : verb){
+        h ^= static_cast<unsigned char>(c);
+        h *= 16777619u;
+    }
+    return (h ^ (h >> 15)) & (HASH_SLOTS - 1);
+}
+
+static constexpr bool is_perfect(uint32_t seed){
+    bool used[HASH_SLOTS]{};
+    for (const Command& cmd : COMMANDS){
+        uint32_t slot = verb_hash(cmd.verb, seed);
+        if (used[slot]) return false;
+        used[slot] = true;
+    }
+    return true;
+}
+
+static constexpr uint32_t find_seed(){
+    for (uint32_t seed = 0; seed < 100000; ++seed){
+        if (is_perfect(seed)) return seed;
+    }
+    return UINT32_MAX;
+}
+
+static constexpr uint32_t VERB_SEED = find_seed();
+static_assert(VERB_SEED != UINT32_MAX, "No perfect hash of the verbs, increase HASH_SLOTS");
+
+struct SlotTable{
+    int8_t command[HASH_SLOTS]; // index in COMMANDS, -1 if the slot is free
+};
+
+static constexpr SlotTable build_slots(){
+    SlotTable table{};
+    for (int8_t& slot : table.command) slot = -1;
+    for (int i = 0; i < COMMAND_COUNT; ++i){
+        table.command[verb_hash(COMMANDS[i].verb, VERB_SEED)] = static_cast<int8_t>(i);
+    }
+    return table;
+}
+
+static constexpr SlotTable SLOTS = build_slots();
+
+// ---- run_command definition ----
+
+/**
+ * Splits off the next space separated token.
+ * @return empty view if there are no more tokens
+ */
+static std::string_view next_token(std::string_view& rest){
+    size_t begin = rest.find_first_not_of(' ');
+    if (begin == std::string_view::npos){
+        rest = {};
+        return {};
+    }
+    rest.remove_prefix(begin);
+    size_t end = std::min(rest.find(' '), rest.size());
+    std::string_view token = rest.substr(0, end);
+    rest.remove_prefix(end);
+    return token;
+}
+
+static bool parse_number(std::string_view token, unsigned long long& value){
+    if (token.empty() || token.size() > MAX_NUMBER_DIGITS) return false;
+    auto res = std::from_chars(token.data(), token.data() + token.size(), value);
+    return res.ec == std::errc() && res.ptr == token.data() + token.size();
+}
+
+HandleStatus run_command(std::string_view line, CommandContext& ctx, bool streaming){
+    while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.remove_suffix(1);
+
+    std::string_view verb = next_token(line);
+    int index = SLOTS.command[verb_hash(verb, VERB_SEED)];
+    if (index < 0 || COMMANDS[index].verb != verb) return HandleStatus::try_again;
+    const Command& cmd = COMMANDS[index];
+    if (streaming && !cmd.streaming) return HandleStatus::try_again;
+
+    CommandArgs args;
+    for (int i = 0; i < MAX_COMMAND_ARGS && cmd.args[i] != ArgType::none; ++i){
+        std::string_view token = next_token(line);
+        if (token.empty()){
+            if (cmd.args[i] == ArgType::optional_word) break;
+            return HandleStatus::try_again;
+        }
+        if (cmd.args[i] == ArgType::number && !parse_number(token, args.number[i])) return HandleStatus::try_again;
+        args.word[i] = token;
+    }
+    return cmd.run(ctx, args);
+}
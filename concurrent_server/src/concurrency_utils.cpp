@@ -3,73 +3,47 @@
 //
 
 #include "../include/concurrency_utils.h"
-#include "../include/Server.h"
 
-static const bool SEND_WITH_INTERRUPT = false;
-static const int SLEEP_TIME_MS = 333;
+// ---- codel_controller functions definition ----
 
-template<typename T>
-void threadsafe_queue<T>::push(T new_value){
-    std::lock_guard<std::mutex> lk(mut);
-    data_queue.push(std::move(new_value));
-    data_cond.notify_one();
-}
-
-template<typename T>
-std::shared_ptr<T> threadsafe_queue<T>::try_pop(){
-    std::lock_guard<std::mutex> lk(mut);
-    if(data_queue.empty())
-        return std::shared_ptr<T>();
-    std::shared_ptr<T> res(std::make_shared<T>(std::move(data_queue.front())));
-    data_queue.pop();
-    return res;
-}
+void codel_controller::on_dequeue(std::chrono::steady_clock::duration sojourn, std::chrono::steady_clock::time_point now){
+    long long sojourn_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(sojourn).count();
+    long long prev_max = max_sojourn_ns.load(std::memory_order_relaxed);
+    while (sojourn_ns > prev_max && !max_sojourn_ns.compare_exchange_weak(prev_max, sojourn_ns)) {}
 
-template<typename T>
-bool threadsafe_queue<T>::empty() const{
-    std::lock_guard<std::mutex> lk(mut);
-    return data_queue.empty();
-}
-
-
-void thread_pool::worker_thread(){
-    while(!done){
-        // I decided to not change the design of try_pop(), it's better to adapt the client code
-        std::shared_ptr<std::shared_ptr<Handler>> res = work_queue.try_pop();
-        std::shared_ptr<Handler> handler;
-        if( res != nullptr ){
-            handler = std::move(*res);
-            HandleStatus handle_res = handler->handle();
-            if (handle_res == HandleStatus::disconnected || handle_res == HandleStatus::fatal_error) continue; // we don't push it back, so the object will be destroyed.
-            if (SEND_WITH_INTERRUPT){
-            std::this_thread::sleep_for(std::chrono::milliseconds(SLEEP_TIME_MS));
-            }
-            submit(std::move(handler));
-        }
-        else{
-            std::this_thread::yield();
+    if (sojourn < target){
+        first_above_time.store(0, std::memory_order_relaxed);
+        if (dropping.exchange(false)){
+            std::cerr << "Queue delay is back below the target, accepting new work." << std::endl;
         }
+        return;
     }
-}
 
-/**
- * The constructor of a thread_pool object. If it fails to instantiate the thread objects, the program exits with throw.
- */
-thread_pool::thread_pool(): done(false), joiner(threads){
-    unsigned const thread_count=std::thread::hardware_concurrency();
-    try{
-        for(unsigned i=0;i<thread_count;++i){
-            threads.push_back(
-                    std::thread(&thread_pool::worker_thread, this));
-        }
+    long long now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+    long long first_above = first_above_time.load(std::memory_order_relaxed);
+    if (first_above == 0){
+        long long deadline = now_ns + std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count();
+        first_above_time.compare_exchange_strong(first_above, deadline); // other worker may have started it already
     }
-    catch(std::exception&){
-        done=true;
-        std::cerr << "Cannot instantiate " << std::thread::hardware_concurrency() << " objects defined by your environment. Exiting..." << std::endl;
-        throw;
+    else if (now_ns >= first_above && !dropping.exchange(true)){
+        ++episodes;
+        std::cerr << "Queue delay is above " << target.count() << "us for " << interval.count()
+                  << "us, shedding new accepts and exports." << std::endl;
     }
 }
 
-void thread_pool::submit(std::shared_ptr<Handler> ch){
-    work_queue.push(std::move(ch));
+bool codel_controller::admit_accept(){
+    if (!dropping) return true;
+    ++shed_accepts;
+    return false;
+}
+
+bool codel_controller::admit_export(){
+    if (!dropping) return true;
+    ++deferred_exports;
+    return false;
+}
+
+codel_controller::stats_t codel_controller::stats() const{
+    return {episodes, shed_accepts, deferred_exports, max_sojourn_ns / 1000};
 }
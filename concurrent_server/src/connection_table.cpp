@@ -0,0 +1,99 @@
+#include "../include/connection_table.h"
+
+#include <cstring>
+
+size_t ConnectionTable::add(int fd, const SequenceConfig& cfg){
+    uint8_t mask = 0;
+    for (int i = 0; i < SEQ_COUNT; ++i){
+        value[i].push_back(cfg.seq[i]);
+        step[i].push_back(cfg.step[i]);
+        inits[i].push_back(cfg.inits[i]);
+        if (cfg.seq_in_use[i]) mask |= 1u << i;
+    }
+    in_use.push_back(mask);
+    ready.push_back(1);
+    fds.push_back(fd);
+    pending_output.emplace_back();
+    return fds.size() - 1;
+}
+
+size_t ConnectionTable::add(Row&& row){
+    size_t index = add(row.fd, row.cfg);
+    pending_output[index] = std::move(row.pending);
+    return index;
+}
+
+void ConnectionTable::remove(size_t row){
+    size_t last = fds.size() - 1;
+    for (int i = 0; i < SEQ_COUNT; ++i){
+        value[i][row] = value[i][last];
+        step[i][row] = step[i][last];
+        inits[i][row] = inits[i][last];
+        value[i].pop_back();
+        step[i].pop_back();
+        inits[i].pop_back();
+    }
+    in_use[row] = in_use[last];
+    ready[row] = ready[last];
+    fds[row] = fds[last];
+    pending_output[row].swap(pending_output[last]);
+    in_use.pop_back();
+    ready.pop_back();
+    fds.pop_back();
+    pending_output.pop_back();
+}
+
+ConnectionTable::Row ConnectionTable::take(size_t row){
+    Row res{fds[row], SequenceConfig(), std::move(pending_output[row])};
+    for (int i = 0; i < SEQ_COUNT; ++i){
+        res.cfg.seq[i] = value[i][row];
+        res.cfg.step[i] = step[i][row];
+        res.cfg.inits[i] = inits[i][row];
+        res.cfg.seq_in_use[i] = in_use[row] & (1u << i);
+    }
+    remove(row);
+    return res;
+}
+
+void ConnectionTable::advance(){
+    const size_t n = fds.size();
+    const uint8_t * __restrict rd = ready.data();
+    for (int i = 0; i < SEQ_COUNT; ++i){
+        uint64_t * __restrict v = value[i].data();
+        const uint64_t * __restrict st = step[i].data();
+        const uint64_t * __restrict init = inits[i].data();
+        // the same overflow rule as the arithmetic generator, written with masks only, so it vectorizes
+        for (size_t r = 0; r < n; ++r){
+            uint64_t sum = v[r] + st[r];
+            uint64_t wrap = 0 - static_cast<uint64_t>(sum < v[r]); // all ones if the step overflows
+            uint64_t next = (sum & ~wrap) | (init[r] & wrap);
+            uint64_t keep = static_cast<uint64_t>(rd[r]) - 1; // all ones if the row is not ready
+            v[r] = (next & ~keep) | (v[r] & keep);
+        }
+    }
+}
+
+size_t ConnectionTable::line_size(size_t row) const{
+    size_t size = 1;
+    for (int i = 0; i < SEQ_COUNT; ++i){
+        if (in_use[row] & (1u << i)) size += SEQ_WIDTH;
+    }
+    return size;
+}
+
+size_t ConnectionTable::render(size_t row, char * out) const{
+    char * field = out;
+    for (int i = 0; i < SEQ_COUNT; ++i){
+        if (!(in_use[row] & (1u << i))) continue;
+        memset(field, ' ', SEQ_WIDTH);
+        unsigned long long v = value[i][row];
+        char * p = field + SEQ_WIDTH;
+        do{
+            *--p = static_cast<char>('0' + v % 10);
+            v /= 10;
+        } while (v != 0);
+        field += SEQ_WIDTH;
+    }
+    *field++ = '\n';
+    return static_cast<size_t>(field - out);
+}
@@ -0,0 +1,154 @@
+#include "../include/event_trace.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+struct trace_event{
+    uint64_t begin, end;
+    const char * name;
+    const char * arg_name;
+    long long arg;
+};
+
+struct trace_ring{
+    pid_t tid;
+    std::atomic<uint64_t> head{0}; // number of the events ever recorded, the next one goes to head % TRACE_RING_EVENTS
+    trace_event events[TRACE_RING_EVENTS];
+};
+
+// the rings of the finished threads are kept, so their events are still dumped
+static std::mutex rings_mut;
+static std::vector<trace_ring *> rings;
+static thread_local trace_ring * my_ring = nullptr;
+
+// the TSC is converted to the time at the dump, from the ticks elapsed since this point
+static const uint64_t calibration_ticks = trace_clock();
+static const std::chrono::steady_clock::time_point calibration_time = std::chrono::steady_clock::now();
+
+static std::atomic<int> dumps{0};
+static std::mutex dump_mut; // the dumps of the clients share one file
+static int signal_fd = -1;
+
+uint64_t trace_clock(){
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void trace_record(const char * name, uint64_t begin, uint64_t end, const char * arg_name, long long arg){
+    if (!my_ring){
+        my_ring = new trace_ring;
+        my_ring->tid = gettid();
+        std::lock_guard<std::mutex> lk(rings_mut);
+        rings.push_back(my_ring);
+    }
+    uint64_t head = my_ring->head.load(std::memory_order_relaxed);
+    my_ring->events[head % TRACE_RING_EVENTS] = {begin, end, name, arg_name, arg};
+    my_ring->head.store(head + 1, std::memory_order_release);
+}
+
+void set_tracing(bool on){
+    trace_enabled.store(on, std::memory_order_relaxed);
+}
+
+double trace_ticks_per_us(){
+    double elapsed_us = std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - calibration_time).count();
+    double res = elapsed_us > 0 ? (trace_clock() - calibration_ticks) / elapsed_us : 1;
+    return res > 0 ? res : 1;
+}
+
+void set_trace_control(bool allowed){
+    trace_control.store(allowed, std::memory_order_relaxed);
+}
+
+long dump_trace(std::string& path){
+    std::lock_guard<std::mutex> dump_lk(dump_mut);
+    if (path.empty()){
+        path = "baum-trace-" + std::to_string(getpid()) + "-" + std::to_string(dumps++) + ".json";
+    }
+    std::ofstream out(path);
+    if (!out) return -1;
+
+    const double ticks_per_us = trace_ticks_per_us();
+
+    std::vector<trace_ring *> snapshot;
+    {
+        std::lock_guard<std::mutex> lk(rings_mut);
+        snapshot = rings;
+    }
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    out << R"({"name":"process_name","ph":"M","pid":)" << getpid() << R"(,"args":{"name":"baum"}})";
+
+    long written = 0;
+    std::vector<trace_event> events;
+    for (trace_ring * ring : snapshot){
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+        events.clear();
+        for (uint64_t i = first; i < head; ++i) events.push_back(ring->events[i % TRACE_RING_EVENTS]);
+        // the thread kept recording: the events up to the one it may be writing right now are not reliable. The fence
+        // keeps the copying above from being reordered after the load
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t overwritten = ring->head.load(std::memory_order_acquire) + 1;
+        size_t skip = overwritten > first + TRACE_RING_EVENTS ? overwritten - TRACE_RING_EVENTS - first : 0;
+
+        out << ",\n" << R"({"name":"thread_name","ph":"M","pid":)" << getpid() << ",\"tid\":" << ring->tid
+            << R"(,"args":{"name":"thread )" << ring->tid << "\"}}";
+        for (size_t k = skip; k < events.size(); ++k){
+            const trace_event& e = events[k];
+            out << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":" << getpid() << ",\"tid\":" << ring->tid
+                << ",\"ts\":" << static_cast<double>(e.begin - calibration_ticks) / ticks_per_us
+                << ",\"dur\":" << static_cast<double>(e.end - e.begin) / ticks_per_us;
+            if (e.arg_name) out << ",\"args\":{\"" << e.arg_name << "\":" << e.arg << "}";
+            out << "}";
+            ++written;
+        }
+    }
+    out << "\n]}\n";
+    out.close();
+    return out ? written : -1;
+}
+
+static void on_dump_signal(int){
+    int saved = errno;
+    uint64_t one = 1;
+    ssize_t res = write(signal_fd, &one, sizeof(one)); // the only async-signal-safe way to wake the dumping thread
+    (void) res;
+    errno = saved;
+}
+
+void dump_trace_on_signal(int signo){
+    signal_fd = eventfd(0, EFD_CLOEXEC);
+    if (signal_fd < 0){
+        std::cerr << "Could not create the eventfd, the trace is not dumped on the signal" << std::endl;
+        return;
+    }
+    std::thread([](){
+        uint64_t count;
+        while (true){
+            if (read(signal_fd, &count, sizeof(count)) < 0 && errno != EINTR) return;
+            std::string path;
+            long events = dump_trace(path);
+            if (events < 0) std::cerr << "Could not write the trace to " << path << std::endl;
+            else std::cout << "Trace of " << events << " events dumped to " << path << std::endl;
+        }
+    }).detach();
+    signal(signo, on_dump_signal);
+}
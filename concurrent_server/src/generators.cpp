@@ -0,0 +1,216 @@
+#include "../include/generators.h"
+
+#include <limits>
+
+static const uint64_t MAX_VALUE = std::numeric_limits<uint64_t>::max();
+
+// ---- arithmetic ----
+
+static uint64_t arithmetic_seek(const SeqParams& p, uint64_t n){
+    uint64_t room = (MAX_VALUE - p.start) / p.step; // number of updates before the overflow
+    if (n <= room) return p.start + n * p.step;
+
+    n -= room + 1; // the update which restarted the counter from inits
+    uint64_t cycle = (MAX_VALUE - p.inits) / p.step;
+    if (cycle != MAX_VALUE) n %= cycle + 1; // inits, inits + step, ... repeat every cycle + 1 updates
+    return p.inits + n * p.step;
+}
+
+static void arithmetic_batch(const SeqParams& p, uint64_t n, uint64_t * out, size_t count){
+    if (count == 0) return;
+    uint64_t v = arithmetic_seek(p, n + 1);
+    if ((MAX_VALUE - v) / p.step >= count - 1){ // no overflow inside the batch, the usual case: one vectorized pass
+        for (size_t k = 0; k < count; ++k) out[k] = v + k * p.step;
+        return;
+    }
+    for (size_t k = 0; k < count; ++k){
+        out[k] = v;
+        v = (MAX_VALUE - v) < p.step ? p.inits : v + p.step;
+    }
+}
+
+// ---- geometric ----
+
+static uint64_t geometric_seek(const SeqParams& p, uint64_t n){
+    if (n == 0 || p.step == 1) return p.start;
+    if (p.step == 0 || p.start == 0) return 0;
+    uint64_t period = 1; // start, start * step, ... up to the last value which doesn't overflow
+    for (uint64_t v = p.start; v <= MAX_VALUE / p.step; v *= p.step) ++period;
+    n %= period;
+    uint64_t v = p.start;
+    while (n--) v *= p.step;
+    return v;
+}
+
+static void geometric_batch(const SeqParams& p, uint64_t n, uint64_t * out, size_t count){
+    uint64_t v = geometric_seek(p, n + 1);
+    for (size_t k = 0; k < count; ++k){
+        out[k] = v;
+        uint64_t next;
+        v = __builtin_mul_overflow(v, p.step, &next) ? p.start : next;
+    }
+}
+
+// ---- fibonacci ----
+
+static const size_t FIBONACCI_MAX_TERMS = 96; // the terms below 2^64 even if x or y is 0, the zero sequence stops here
+
+/**
+ * Fills the terms up to the last one which doesn't overflow, the sequence repeats them.
+ * @return the number of the terms, the period
+ */
+static size_t fibonacci_terms(const SeqParams& p, uint64_t * terms){
+    terms[0] = p.start;
+    terms[1] = p.step;
+    size_t count = 2;
+    while (count < FIBONACCI_MAX_TERMS && !__builtin_add_overflow(terms[count - 1], terms[count - 2], &terms[count])){
+        ++count;
+    }
+    return count;
+}
+
+static uint64_t fibonacci_seek(const SeqParams& p, uint64_t n){
+    uint64_t terms[FIBONACCI_MAX_TERMS];
+    return terms[n % fibonacci_terms(p, terms)];
+}
+
+static void fibonacci_batch(const SeqParams& p, uint64_t n, uint64_t * out, size_t count){
+    uint64_t terms[FIBONACCI_MAX_TERMS];
+    const size_t period = fibonacci_terms(p, terms);
+    size_t term = (n + 1) % period;
+    for (size_t k = 0; k < count; ++k){
+        out[k] = terms[term];
+        if (++term == period) term = 0;
+    }
+}
+
+// ---- xorshift ----
+
+static uint64_t xorshift_step(uint64_t v){
+    v ^= v << 13;
+    v ^= v >> 7;
+    v ^= v << 17;
+    return v;
+}
+
+/**
+ * x and y are the halves of the seed, the bits above the 32 of each are dropped rather than overlapped.
+ */
+static uint64_t xorshift_seed(const SeqParams& p){
+    return (p.start & 0xffffffffULL) << 32 | (p.step & 0xffffffffULL);
+}
+
+/**
+ * The step is linear over GF(2), so n steps are the product of the 64x64 bit matrices of the powers of two in n.
+ * power[k][j] is the column j of the matrix of 2^k steps: the image of the bit j.
+ */
+struct xorshift_jumps{
+    uint64_t power[64][64];
+};
+
+static uint64_t apply_matrix(const uint64_t * columns, uint64_t v){
+    uint64_t res = 0;
+    for (int j = 0; j < 64; ++j){
+        res ^= columns[j] & (0 - (v >> j & 1));
+    }
+    return res;
+}
+
+static const xorshift_jumps& jumps(){
+    static const xorshift_jumps * table = []{
+        auto res = new xorshift_jumps;
+        for (int j = 0; j < 64; ++j) res->power[0][j] = xorshift_step(1ULL << j);
+        for (int k = 1; k < 64; ++k){
+            for (int j = 0; j < 64; ++j) res->power[k][j] = apply_matrix(res->power[k - 1], res->power[k - 1][j]);
+        }
+        return res;
+    }();
+    return *table;
+}
+
+static uint64_t xorshift_seek(const SeqParams& p, uint64_t n){
+    const xorshift_jumps& table = jumps();
+    uint64_t v = xorshift_seed(p);
+    for (int k = 0; n != 0; ++k, n >>= 1){
+        if (n & 1) v = apply_matrix(table.power[k], v);
+    }
+    return v;
+}
+
+static void xorshift_batch(const SeqParams& p, uint64_t n, uint64_t * out, size_t count){
+    uint64_t v = xorshift_seek(p, n + 1);
+    for (size_t k = 0; k < count; ++k){
+        out[k] = v;
+        v = xorshift_step(v);
+    }
+}
+
+// ---- pcg ----
+
+static const uint64_t PCG_MULTIPLIER = 6364136223846793005ULL;
+
+static uint64_t pcg_output(uint64_t state){
+    uint64_t word = ((state >> ((state >> 59) + 5)) ^ state) * 12605985483714917081ULL;
+    return (word >> 43) ^ word;
+}
+
+/**
+ * @return the LCG state after n steps from the seeded one, in O(log n)
+ */
+static uint64_t pcg_state(const SeqParams& p, uint64_t n){
+    const uint64_t increment = p.step << 1 | 1;
+    uint64_t state = (increment + p.start) * PCG_MULTIPLIER + increment; // the seeding of the reference pcg
+    uint64_t mult = PCG_MULTIPLIER, plus = increment, acc_mult = 1, acc_plus = 0;
+    for (; n != 0; n >>= 1){
+        if (n & 1){
+            acc_mult *= mult;
+            acc_plus = acc_plus * mult + plus;
+        }
+        plus *= mult + 1;
+        mult *= mult;
+    }
+    return acc_mult * state + acc_plus;
+}
+
+static uint64_t pcg_seek(const SeqParams& p, uint64_t n){
+    return pcg_output(pcg_state(p, n));
+}
+
+static void pcg_batch(const SeqParams& p, uint64_t n, uint64_t * out, size_t count){
+    const uint64_t increment = p.step << 1 | 1;
+    uint64_t state = pcg_state(p, n + 1);
+    for (size_t k = 0; k < count; ++k){
+        out[k] = state;
+        state = state * PCG_MULTIPLIER + increment;
+    }
+    // the output permutation doesn't depend on the previous values, a separate pass vectorizes
+    for (size_t k = 0; k < count; ++k) out[k] = pcg_output(out[k]);
+}
+
+// ---- The table of the generators ----
+
+/**
+ * In the order of SeqKind. Add a line here and a value to SeqKind to add a kind.
+ */
+static constexpr SequenceGenerator GENERATORS[SEQ_KIND_COUNT] = {
+        {"arithmetic", arithmetic_seek, arithmetic_batch},
+        {"geometric", geometric_seek, geometric_batch},
+        {"fibonacci", fibonacci_seek, fibonacci_batch},
+        {"xorshift", xorshift_seek, xorshift_batch},
+        {"pcg", pcg_seek, pcg_batch},
+};
+
+const SequenceGenerator& generator_of(SeqKind kind){
+    auto index = static_cast<size_t>(kind);
+    return GENERATORS[index < SEQ_KIND_COUNT ? index : 0];
+}
+
+bool kind_from_name(std::string_view name, SeqKind& kind){
+    for (int i = 0; i < SEQ_KIND_COUNT; ++i){
+        if (GENERATORS[i].name == name){
+            kind = static_cast<SeqKind>(i);
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,35 @@
+#include "../include/metrics.h"
+
+#include <map>
+#include <mutex>
+
+static std::mutex reporters_mut;
+static std::map<int, metrics_reporter> reporters; // by the id, so the report is in the order of registration
+static int next_id = 0;
+
+// ---- Metrics functions definition ----
+
+int register_metrics(metrics_reporter reporter){
+    std::lock_guard<std::mutex> lk(reporters_mut);
+    reporters.emplace(next_id, std::move(reporter));
+    return next_id++;
+}
+
+void unregister_metrics(int id){
+    std::lock_guard<std::mutex> lk(reporters_mut);
+    reporters.erase(id);
+}
+
+void report_metrics(std::string& out){
+    std::lock_guard<std::mutex> lk(reporters_mut);
+    for (auto& [id, reporter] : reporters){
+        reporter(out);
+    }
+}
+
+void append_metric(std::string& out, const std::string& name, unsigned long long value){
+    out += name;
+    out += ' ';
+    out += std::to_string(value);
+    out += '\n';
+}
@@ -4,6 +4,13 @@
 
 #include "../include/net.h"
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <cerrno>
+#include <cstring>
+#include <cstddef>
+
 void print_error_with_code(int code, const std::string& msg){
     std::cerr << msg << code << " Exiting...." << std::endl;
     throw;
@@ -87,4 +94,100 @@ int open_listen_fd(const char *port, const char * ip) {
     }
 
     return listenfd;
-}
\ No newline at end of file
+}
+
+int open_listen_unix_fd(const char *path){
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(addr.sun_path)){
+        return -1;
+    }
+    memcpy(addr.sun_path, path, len);
+    if (path[0] == '@'){
+        addr.sun_path[0] = '\0'; // abstract namespace: the name is the bytes after the leading zero, not 0-terminated
+    }
+    else{
+        unlink(path); // the file left by the previous run would make bind() fail
+    }
+    auto addrlen = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + len);
+
+    int listenfd;
+    if ((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0){
+        return -1;
+    }
+    if (bind(listenfd, (sockaddr *) &addr, addrlen) < 0 || listen(listenfd, LISTENQ) < 0){
+        close_fd(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+// ---- SocketProfile functions definition ----
+
+SocketProfile SocketProfile::latency(){
+    SocketProfile profile;
+    profile.mode = SocketMode::latency;
+    profile.nodelay = true;
+    return profile;
+}
+
+SocketProfile SocketProfile::throughput(){
+    SocketProfile profile;
+    profile.mode = SocketMode::throughput;
+    profile.cork = true;
+    profile.sndbuf = 4 * 1024 * 1024;
+    profile.rcvbuf = 256 * 1024;
+    profile.zerocopy = true;
+    return profile;
+}
+
+SocketProfile SocketProfile::from_name(const std::string& name){
+    if (name == "latency") return latency();
+    if (name == "throughput") return throughput();
+    return SocketProfile();
+}
+
+/**
+ * Unlike set_sock_opt() doesn't throw, since a failed tuning option is not a reason to drop the client.
+ */
+static bool try_set_sock_opt(int s, int level, int optname, int value, const char * name){
+    if (setsockopt(s, level, optname, &value, sizeof(value)) < 0){
+        std::cerr << "Could not set " << name << " on socket " << s << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+SocketProfile apply_socket_profile(int fd, const SocketProfile& profile){
+    SocketProfile res = profile;
+    sockaddr_storage addr{};
+    socklen_t addrlen = sizeof(addr);
+    if (getsockname(fd, (sockaddr *) &addr, &addrlen) == 0 && addr.ss_family == AF_UNIX){
+        res.nodelay = res.cork = res.zerocopy = false;
+    }
+    if (res.nodelay){
+        res.nodelay = try_set_sock_opt(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    if (profile.sndbuf > 0){
+        try_set_sock_opt(fd, SOL_SOCKET, SO_SNDBUF, profile.sndbuf, "SO_SNDBUF");
+    }
+    if (profile.rcvbuf > 0){
+        try_set_sock_opt(fd, SOL_SOCKET, SO_RCVBUF, profile.rcvbuf, "SO_RCVBUF");
+    }
+    if (res.zerocopy){
+        res.zerocopy = try_set_sock_opt(fd, SOL_SOCKET, SO_ZEROCOPY, 1, "SO_ZEROCOPY");
+    }
+    return res;
+}
+
+void set_cork(int fd, bool on){
+    int value = on ? 1 : 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)); // best effort, the data is sent anyway
+}
+
+void set_busy_poll(int fd, int usecs){
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one));
+}
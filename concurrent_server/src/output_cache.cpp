@@ -0,0 +1,138 @@
+#include "../include/output_cache.h"
+#include "../include/event_trace.h"
+
+#include <limits>
+#include <functional>
+
+// ---- SequenceConfig functions definition ----
+
+bool SequenceConfig::operator==(const SequenceConfig& other) const{
+    return seq == other.seq && step == other.step && seq_in_use == other.seq_in_use && inits == other.inits &&
+           kind == other.kind;
+}
+
+bool SequenceConfig::nothing_to_show() const{
+    for (bool in_use : seq_in_use){
+        if (in_use) return false;
+    }
+    return true;
+}
+
+size_t SequenceConfig::line_size() const{
+    size_t size = 1; // line feed
+    for (bool in_use : seq_in_use){
+        if (in_use) size += SEQ_WIDTH;
+    }
+    return size;
+}
+
+bool SequenceConfig::arithmetic_only() const{
+    for (SeqKind k : kind){
+        if (k != SeqKind::arithmetic) return false;
+    }
+    return true;
+}
+
+size_t SequenceConfigHash::operator()(const SequenceConfig& cfg) const{
+    std::hash<unsigned long long> h;
+    size_t res = 0;
+    auto combine = [&res](size_t v){ res ^= v + 0x9e3779b97f4a7c15ULL + (res << 6) + (res >> 2); };
+    for (int i = 0; i < SEQ_COUNT; ++i){
+        combine(h(cfg.seq[i]));
+        combine(h(cfg.step[i]));
+        combine(h(cfg.inits[i]));
+        combine(cfg.seq_in_use[i]);
+        combine(static_cast<size_t>(cfg.kind[i]));
+    }
+    return res;
+}
+
+// ---- OutputBlock functions definition ----
+
+/**
+ * Writes the number right aligned into the field of SEQ_WIDTH chars, which is already filled with spaces.
+ */
+static void format_column(char * field, unsigned long long value){
+    char * p = field + SEQ_WIDTH;
+    do{
+        *--p = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+}
+
+OutputBlock::OutputBlock(const SequenceConfig& cfg, unsigned long long index): index(index) {
+    render(cfg, index);
+}
+
+void OutputBlock::render(const SequenceConfig& cfg, unsigned long long block_index){
+    trace_span span("format", "block", static_cast<long long>(block_index));
+    index = block_index;
+    const size_t line_size = cfg.line_size();
+    data.assign(line_size * LINES_PER_BLOCK, ' ');
+    // the values of the whole block first, column by column, then the formatting of the lines
+    uint64_t values[SEQ_COUNT][LINES_PER_BLOCK];
+    for (int i = 0; i < SEQ_COUNT; ++i){
+        if (cfg.seq_in_use[i]) cfg.values_after(i, index * LINES_PER_BLOCK, values[i], LINES_PER_BLOCK);
+    }
+
+    char * line = &data[0];
+    for (int l = 0; l < LINES_PER_BLOCK; ++l, line += line_size){
+        char * field = line;
+        for (int i = 0; i < SEQ_COUNT; ++i){
+            if (!cfg.seq_in_use[i]) continue;
+            format_column(field, values[i][l]);
+            field += SEQ_WIDTH;
+        }
+        *field = '\n';
+    }
+}
+
+// ---- OutputCache functions definition ----
+
+size_t OutputCache::KeyHash::operator()(const Key& key) const{
+    return SequenceConfigHash()(key.cfg) ^ std::hash<unsigned long long>()(key.index) * 0x9e3779b97f4a7c15ULL;
+}
+
+OutputCache::OutputCache(){
+    for (Shard& shard : shards){
+        shard.blocks.reserve(SHARD_CAPACITY);
+        shard.order.reserve(SHARD_CAPACITY);
+    }
+}
+
+std::shared_ptr<const OutputBlock> OutputCache::acquire(const SequenceConfig& cfg, unsigned long long index){
+    Key key{cfg, index};
+    // the shard is picked by the config only, so the consecutive blocks of one client stay under the same lock
+    Shard& shard = shards[SequenceConfigHash()(cfg) % SHARDS];
+
+    std::lock_guard<std::mutex> lk(shard.mut);
+    auto it = shard.blocks.find(key);
+    if (it != shard.blocks.end()){
+        ++hits;
+        return it->second;
+    }
+
+    // rendered under the lock: other clients of the same config would need exactly this block anyway
+    ++rendered;
+    if (shard.order.size() < SHARD_CAPACITY){
+        auto block = std::make_shared<OutputBlock>(cfg, index);
+        shard.blocks.emplace(key, block);
+        shard.order.push_back(key);
+        return block;
+    }
+
+    // the map node and, if no subscriber holds it, the block of the oldest key are reused for the new one
+    auto node = shard.blocks.extract(shard.order[shard.oldest]);
+    std::shared_ptr<OutputBlock>& block = node.mapped();
+    if (block.use_count() == 1){ // only the cache holds it, and nobody can take it from the cache without the lock
+        std::atomic_thread_fence(std::memory_order_acquire); // the last subscriber's reads happen before the render
+        block->render(cfg, index);
+    }
+    else{
+        block = std::make_shared<OutputBlock>(cfg, index); // subscribers which still send from it keep it alive
+    }
+    node.key() = key;
+    shard.order[shard.oldest] = key;
+    shard.oldest = (shard.oldest + 1) % SHARD_CAPACITY;
+    return shard.blocks.insert(std::move(node)).position->second;
+}
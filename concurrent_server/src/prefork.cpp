@@ -0,0 +1,109 @@
+#include "../include/prefork.h"
+
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+
+static std::string describe_exit(int status){
+    if (WIFEXITED(status)) return "exited with code " + std::to_string(WEXITSTATUS(status));
+    if (WIFSIGNALED(status)){
+        return "was killed by signal " + std::to_string(WTERMSIG(status)) + " (" + strsignal(WTERMSIG(status)) + ")";
+    }
+    return "stopped";
+}
+
+// ---- PreforkMaster functions definition ----
+
+PreforkMaster::PreforkMaster(unsigned workers, worker_fn worker_main):
+        worker_main(std::move(worker_main)), slots(std::max(workers, 1u)) {
+}
+
+bool PreforkMaster::spawn(unsigned worker){
+    const pid_t master = getpid();
+    pid_t pid = fork();
+    if (pid < 0){
+        std::cerr << "Could not fork worker " << worker << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (pid > 0){
+        slots[worker].pid = pid;
+        slots[worker].started = std::chrono::steady_clock::now();
+        std::cout << "Worker " << worker << " started, pid " << pid << std::endl;
+        return true;
+    }
+
+    sigprocmask(SIG_SETMASK, &worker_mask, nullptr); // a SIGTERM pending since fork() is delivered here
+    prctl(PR_SET_PDEATHSIG, SIGTERM); // the workers don't outlive the master
+    if (getppid() != master) _exit(0); // the master died before prctl()
+    int code = 0;
+    try{
+        worker_main(worker);
+    }
+    catch(std::exception& e){
+        std::cerr << "Worker " << worker << ": " << e.what() << std::endl;
+        code = 1;
+    }
+    std::cout.flush();
+    _exit(code); // the atexit handlers and the static objects belong to the master
+}
+
+int PreforkMaster::run(){
+    sigset_t waited;
+    sigemptyset(&waited);
+    sigaddset(&waited, SIGTERM);
+    sigaddset(&waited, SIGINT);
+    sigaddset(&waited, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &waited, &worker_mask); // pending until sigwaitinfo(), none is lost
+
+    bool stopping = false;
+    while (!stopping){
+        for (unsigned i = 0; i < slots.size(); ++i){
+            if (slots[i].pid == -1 && !spawn(i)){
+                std::this_thread::sleep_for(std::chrono::milliseconds(PREFORK_RESTART_DELAY_MS));
+            }
+        }
+        siginfo_t info;
+        int signo = sigwaitinfo(&waited, &info);
+        if (signo < 0){
+            if (errno != EINTR) std::cerr << "sigwaitinfo: " << strerror(errno) << std::endl;
+            continue;
+        }
+        stopping = signo != SIGCHLD;
+
+        // the SIGCHLDs of the workers which die together merge into one, so all the dead ones are reaped
+        bool crashing = false;
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0){
+            auto slot = std::find_if(slots.begin(), slots.end(), [pid](const worker_slot& s){ return s.pid == pid; });
+            if (slot == slots.end()) continue;
+            slot->pid = -1;
+            if (stopping) continue;
+
+            const bool crashed = std::chrono::steady_clock::now() - slot->started <
+                                 std::chrono::milliseconds(PREFORK_CRASH_WINDOW_MS);
+            std::cout << "Worker " << slot - slots.begin() << " (pid " << pid << ") " << describe_exit(status)
+                      << ", restarting" << (crashed ? " after a pause" : "") << ". Restarts so far: " << ++restarts
+                      << std::endl;
+            crashing |= crashed;
+        }
+        if (crashing) std::this_thread::sleep_for(std::chrono::milliseconds(PREFORK_RESTART_DELAY_MS));
+    }
+
+    std::cout << "Stopping the workers..." << std::endl;
+    for (const worker_slot& slot : slots){
+        if (slot.pid > 0) kill(slot.pid, SIGTERM);
+    }
+    for (const worker_slot& slot : slots){
+        if (slot.pid <= 0) continue;
+        while (waitpid(slot.pid, nullptr, 0) < 0 && errno == EINTR){}
+    }
+    return 0;
+}
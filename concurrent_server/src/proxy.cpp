@@ -0,0 +1,262 @@
+#include "../include/proxy.h"
+#include "../include/net.h"
+#include "../include/concurrency_utils.h"
+
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+static uint32_t fnv1a(const void * data, size_t size, uint32_t h = 2166136261u){
+    const auto * bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i){
+        h ^= bytes[i];
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+static long long steady_now_ns(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Both sockets of the proxied connection, closed when the pumps of both directions are done.
+ */
+struct Proxy::Session{
+    Reactor& reactor;
+    int client, server;
+    Backend& backend;
+
+    Session(Reactor& reactor, int client, int server, Backend& backend):
+            reactor(reactor), client(client), server(server), backend(backend) {}
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+    ~Session(){
+        reactor.remove(client);
+        reactor.remove(server);
+        close_fd(client);
+        close_fd(server);
+        --backend.connections;
+        std::cout << "Client " << client << " disconnected from " << backend.host << ":" << backend.port << std::endl;
+    }
+};
+
+// ---- Proxy functions definition ----
+
+Proxy::Proxy(const char *port, const char *ip, const std::vector<std::string>& backend_names, BalanceMode mode,
+             unsigned reactors): mode(mode), reactor_count(std::max(reactors, 1u)) {
+    for (const std::string& name : backend_names){
+        size_t colon = name.rfind(':');
+        if (colon == std::string::npos){
+            throw std::runtime_error("The backend " + name + " is not host:port. Exiting...");
+        }
+        auto backend = std::make_unique<Backend>();
+        backend->host = name.substr(0, colon);
+        backend->port = name.substr(colon + 1);
+
+        addrinfo hints{}, * res;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+        if (getaddrinfo(backend->host.c_str(), backend->port.c_str(), &hints, &res) != 0){
+            throw std::runtime_error("Could not resolve the backend " + name + ". Exiting...");
+        }
+        memcpy(&backend->addr, res->ai_addr, res->ai_addrlen);
+        backend->addrlen = res->ai_addrlen;
+        freeaddrinfo(res);
+
+        for (int v = 0; v < VIRTUAL_NODES; ++v){
+            std::string point = name + "#" + std::to_string(v);
+            ring.emplace_back(fnv1a(point.data(), point.size()), backends.size());
+        }
+        backends.push_back(std::move(backend));
+    }
+    if (backends.empty()){
+        throw std::runtime_error(std::string("No backends given. Exiting..."));
+    }
+    std::sort(ring.begin(), ring.end());
+
+    listening_fd = open_listen_fd(port, ip);
+    if (listening_fd == -1){
+        throw std::runtime_error(std::string("Could not connect with the given IP, PORT. Exiting..."));
+    }
+    fcntl(listening_fd, F_SETFL, fcntl(listening_fd, F_GETFL) | O_NONBLOCK);
+}
+
+Proxy::~Proxy(){
+    close_fd(listening_fd);
+}
+
+void Proxy::accept_connections(){
+    std::vector<std::thread> threads;
+    join_threads joiner(threads);
+    for (unsigned i = 1; i < reactor_count; ++i){
+        threads.emplace_back(&Proxy::run_reactor, this);
+    }
+    run_reactor();
+}
+
+void Proxy::run_reactor(){
+    Reactor reactor;
+    reactor.add(listening_fd, true); // EPOLLEXCLUSIVE: a new client wakes up only one of the reactors
+    accept_loop(reactor);
+    reactor.run();
+}
+
+Task Proxy::accept_loop(Reactor& reactor){
+    while (true){
+        sockaddr_storage clientaddr{};
+        socklen_t clientlen = sizeof(sockaddr_storage);
+        int connfd = accept4(listening_fd, (sockaddr *) & clientaddr, &clientlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0){
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                co_await reactor.readable(listening_fd);
+            }
+            else if (errno != EINTR && errno != ECONNABORTED){
+                // EMFILE, ENFILE, ENOBUFS, ENOMEM: the sessions of this reactor have to run to release something
+                std::cerr << "Accept error " << errno << std::endl;
+                co_await reactor.sleep_for(std::chrono::milliseconds(ACCEPT_RETRY_MS));
+            }
+            continue;
+        }
+        client_session(reactor, connfd, clientaddr);
+    }
+}
+
+std::vector<size_t> Proxy::candidates(const sockaddr_storage& clientaddr) const{
+    std::vector<size_t> order;
+    if (mode == BalanceMode::consistent_hash){
+        uint32_t key;
+        if (clientaddr.ss_family == AF_INET6){
+            const auto& addr = reinterpret_cast<const sockaddr_in6&>(clientaddr).sin6_addr;
+            key = fnv1a(&addr, sizeof(addr));
+        }
+        else{
+            const auto& addr = reinterpret_cast<const sockaddr_in&>(clientaddr).sin_addr;
+            key = fnv1a(&addr, sizeof(addr));
+        }
+        // the backends in the order of their first points clockwise from the key
+        size_t start = std::lower_bound(ring.begin(), ring.end(), std::make_pair(key, size_t(0))) - ring.begin();
+        std::vector<bool> seen(backends.size());
+        for (size_t k = 0; k < ring.size() && order.size() < backends.size(); ++k){
+            size_t index = ring[(start + k) % ring.size()].second;
+            if (!seen[index]) order.push_back(index);
+            seen[index] = true;
+        }
+    }
+    // the counters change under the other reactors: the sort and the partition work on a snapshot, so their
+    // comparisons stay consistent
+    long long now = steady_now_ns();
+    std::vector<int> connections(backends.size());
+    std::vector<bool> up(backends.size());
+    for (size_t i = 0; i < backends.size(); ++i){
+        connections[i] = backends[i]->connections;
+        up[i] = backends[i]->down_until <= now;
+    }
+    if (mode != BalanceMode::consistent_hash){
+        for (size_t i = 0; i < backends.size(); ++i) order.push_back(i);
+        std::stable_sort(order.begin(), order.end(), [&connections](size_t a, size_t b){
+            return connections[a] < connections[b];
+        });
+    }
+    // the backends which failed recently are the last resort
+    std::stable_partition(order.begin(), order.end(), [&up](size_t i){ return up[i]; });
+    return order;
+}
+
+Lazy<int> Proxy::connect_backend(Reactor& reactor, Backend& backend){
+    int fd = socket(backend.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) co_return -1;
+    ++backend.connections; // counted from now on, so the concurrent clients see it
+
+    int res = connect(fd, (sockaddr *) &backend.addr, backend.addrlen);
+    if (res == 0 || errno == EINPROGRESS){
+        reactor.add(fd);
+        if (res < 0){
+            co_await reactor.writable(fd);
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            res = err == 0 ? 0 : -1;
+        }
+        if (res < 0) reactor.remove(fd);
+    }
+    if (res < 0){
+        std::cerr << "Backend " << backend.host << ":" << backend.port << " is unreachable." << std::endl;
+        --backend.connections;
+        backend.down_until = steady_now_ns() + BACKEND_RETRY_MS * 1000000LL;
+        close_fd(fd);
+        co_return -1;
+    }
+    co_return fd;
+}
+
+Task Proxy::client_session(Reactor& reactor, int connfd, sockaddr_storage clientaddr){
+    try{
+        reactor.add(connfd);
+    }
+    catch(std::runtime_error& e){
+        std::cerr << "Client " << connfd << ": " << e.what() << std::endl;
+        close_fd(connfd);
+        co_return;
+    }
+    for (size_t index : candidates(clientaddr)){
+        Backend& backend = *backends[index];
+        int serverfd = co_await connect_backend(reactor, backend);
+        if (serverfd < 0) continue;
+
+        std::cout << "Client " << connfd << " connected to " << backend.host << ":" << backend.port << " ("
+                  << backend.connections << " connections)" << std::endl;
+        auto session = std::make_shared<Session>(reactor, connfd, serverfd, backend);
+        pump(reactor, session, connfd, serverfd);
+        pump(reactor, session, serverfd, connfd);
+        co_return;
+    }
+    std::cerr << "No backend is available for client " << connfd << std::endl;
+    reactor.remove(connfd);
+    close_fd(connfd);
+}
+
+Task Proxy::pump(Reactor& reactor, [[maybe_unused]] std::shared_ptr<Session> session, int from, int to){
+    int pipefd[2];
+    if (pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) < 0){
+        shutdown(from, SHUT_RDWR);
+        shutdown(to, SHUT_RDWR);
+        co_return;
+    }
+    bool failed = false;
+    while (!failed){
+        // the pipe is empty here, so EAGAIN can only mean there's nothing to read
+        ssize_t n = splice(from, nullptr, pipefd[1], nullptr, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0) break;
+        if (n < 0){
+            if (errno == EAGAIN) co_await reactor.readable(from);
+            else if (errno != EINTR) failed = true;
+            continue;
+        }
+        while (n > 0){
+            ssize_t m = splice(pipefd[0], nullptr, to, nullptr, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (m < 0){
+                if (errno == EAGAIN) co_await reactor.writable(to);
+                else if (errno != EINTR){
+                    failed = true;
+                    break;
+                }
+                continue;
+            }
+            n -= m;
+        }
+    }
+    close_fd(pipefd[0]);
+    close_fd(pipefd[1]);
+    if (failed){
+        shutdown(from, SHUT_RDWR);
+        shutdown(to, SHUT_RDWR);
+    }
+    else{
+        shutdown(to, SHUT_WR);
+    }
+}
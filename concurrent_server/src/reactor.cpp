@@ -0,0 +1,280 @@
+#include "../include/reactor.h"
+#include "../include/net.h"
+#include "../include/event_trace.h"
+#include "../include/metrics.h"
+
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#ifndef EPIOCSPARAMS // Linux 6.9 UAPI, the kernel may support it before the headers do
+struct epoll_params{
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+// ---- frame_pool functions definition ----
+
+namespace {
+    struct free_frame{
+        free_frame * next;
+    };
+    const size_t SIZE_CLASSES = frame_pool::MAX_POOLED_FRAME / frame_pool::FRAME_GRANULARITY;
+    thread_local free_frame * free_lists[SIZE_CLASSES] = {};
+    thread_local size_t frames_in_use = 0;
+    thread_local size_t bytes_in_use = 0;
+
+    size_t size_class(size_t size){
+        return (size + frame_pool::FRAME_GRANULARITY - 1) / frame_pool::FRAME_GRANULARITY - 1;
+    }
+}
+
+void* frame_pool::allocate(size_t size){
+    ++frames_in_use;
+    bytes_in_use += size;
+    if (size > MAX_POOLED_FRAME) return ::operator new(size);
+
+    size_t cls = size_class(size);
+    if (free_frame * frame = free_lists[cls]){
+        free_lists[cls] = frame->next;
+        return frame;
+    }
+    return ::operator new((cls + 1) * FRAME_GRANULARITY);
+}
+
+void frame_pool::deallocate(void * p, size_t size){
+    --frames_in_use;
+    bytes_in_use -= size;
+    if (size > MAX_POOLED_FRAME){
+        ::operator delete(p);
+        return;
+    }
+    // the frames are kept for the next coroutines of the same size, the memory is reused, never returned
+    auto * frame = static_cast<free_frame *>(p);
+    size_t cls = size_class(size);
+    frame->next = free_lists[cls];
+    free_lists[cls] = frame;
+}
+
+size_t frame_pool::live_frames(){
+    return frames_in_use;
+}
+
+size_t frame_pool::live_bytes(){
+    return bytes_in_use;
+}
+
+// ---- Reactor functions definition ----
+
+static const int MAX_EVENTS = 64;
+
+static std::atomic<int> reactors{0}; // numbers the reactors in the metrics
+
+Reactor::Reactor(bool busy_poll): busy_poll(busy_poll) {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0){
+        throw std::runtime_error(std::string("Could not create epoll instance."));
+    }
+    if (busy_poll){
+        epoll_params params{BUSY_POLL_USECS, BUSY_POLL_BUDGET, 1, 0};
+        if (ioctl(epfd, EPIOCSPARAMS, &params) < 0){ // the zero timeout polling works without it
+            std::cerr << "The kernel doesn't busy poll the epoll instance, errno " << errno << std::endl;
+        }
+    }
+    const std::string prefix = "reactor." + std::to_string(reactors++) + ".";
+    metrics_id = register_metrics([this, prefix](std::string& out){
+        append_metric(out, prefix + "resumptions", published_resumptions.load(std::memory_order_relaxed));
+        append_metric(out, prefix + "frames", published_frames.load(std::memory_order_relaxed));
+        append_metric(out, prefix + "frame_bytes", published_frame_bytes.load(std::memory_order_relaxed));
+    });
+}
+
+Reactor::~Reactor(){
+    unregister_metrics(metrics_id);
+    close_fd(epfd);
+}
+
+Reactor::fd_state& Reactor::state(int fd){
+    if (static_cast<size_t>(fd) >= fds.size()) fds.resize(fd + 1);
+    return fds[fd];
+}
+
+void Reactor::add(int fd, bool exclusive){
+    epoll_event ev{};
+    if (exclusive) ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE; // the kernel allows no other flags with it
+    else ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+    ev.data.fd = fd;
+    state(fd) = fd_state();
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+        throw std::runtime_error(std::string("Could not add the socket to epoll."));
+    }
+}
+
+void Reactor::remove(int fd){
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    state(fd) = fd_state();
+}
+
+bool Reactor::io_awaiter::await_suspend(std::coroutine_handle<> h){
+    fd_state& st = reactor.state(fd);
+    bool& pending = write ? st.writable : st.readable;
+    if (pending){ // the edge came before we got EAGAIN, try again right ahead
+        pending = false;
+        return false;
+    }
+    (write ? st.writer : st.reader) = h;
+    return true;
+}
+
+void Reactor::sleep_awaiter::await_suspend(std::coroutine_handle<> h){
+    reactor.sleeping.emplace_back(std::chrono::steady_clock::now() + delay, h);
+}
+
+int Reactor::wake_sleeping(){
+    if (sleeping.empty()) return -1;
+    auto now = std::chrono::steady_clock::now();
+    auto next = std::chrono::steady_clock::time_point::max();
+    for (size_t i = 0; i < sleeping.size();){
+        if (sleeping[i].first <= now){
+            ready.push_back(sleeping[i].second);
+            sleeping[i] = sleeping.back();
+            sleeping.pop_back();
+            continue;
+        }
+        next = std::min(next, sleeping[i].first);
+        ++i;
+    }
+    if (next == std::chrono::steady_clock::time_point::max()) return -1;
+    return static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(next - now).count());
+}
+
+void Reactor::run(){
+    epoll_event events[MAX_EVENTS];
+    while (!done){
+        int timeout = wake_sleeping();
+        int n = epoll_wait(epfd, events, MAX_EVENTS, ready.empty() && !busy_poll ? timeout : 0);
+        if (n < 0 && errno != EINTR){
+            throw std::runtime_error(std::string("epoll_wait error."));
+        }
+        for (int i = 0; i < n; ++i){
+            fd_state& st = state(events[i].data.fd);
+            bool in = events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+            bool out = events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR);
+            if (in){
+                if (st.reader) ready.push_back(std::exchange(st.reader, nullptr));
+                else st.readable = true;
+            }
+            if (out){
+                if (st.writer) ready.push_back(std::exchange(st.writer, nullptr));
+                else st.writable = true;
+            }
+        }
+        // resume only the coroutines which were ready before this round, the yielded ones wait for the next round
+        running.swap(ready);
+        for (std::coroutine_handle<> h : running){
+            ++resumed;
+            trace_span span("resume");
+            h.resume();
+        }
+        running.clear();
+        published_resumptions.store(resumed, std::memory_order_relaxed);
+        published_frames.store(frame_pool::live_frames(), std::memory_order_relaxed);
+        published_frame_bytes.store(frame_pool::live_bytes(), std::memory_order_relaxed);
+    }
+}
+
+// ---- AsyncSocket functions definition ----
+
+AsyncSocket::AsyncSocket(Reactor& reactor, int fd): reactor(reactor), fd(fd) {
+    try{
+        reactor.add(fd);
+    }
+    catch(...){
+        close_fd(fd);
+        throw;
+    }
+}
+
+AsyncSocket::~AsyncSocket(){
+    reactor.remove(fd);
+    close_fd(fd);
+}
+
+Lazy<ssize_t> AsyncSocket::read_line(std::string& line, size_t max_len){
+    line.clear();
+    while (true){
+        while (pos < len){
+            char c = buffer[pos++];
+            line += c;
+            if (c == '\n' || line.size() >= max_len) co_return static_cast<ssize_t>(line.size());
+        }
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n > 0){
+            pos = 0;
+            len = static_cast<int>(n);
+        }
+        else if (n == 0){
+            co_return static_cast<ssize_t>(line.size()); // EOF, 0 if no data read before
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK){
+            co_await reactor.readable(fd);
+        }
+        else if (errno != EINTR){
+            co_return -1;
+        }
+    }
+}
+
+ssize_t AsyncSocket::read_available(char * data, size_t size){
+    if (pos < len){
+        size_t n = std::min<size_t>(size, len - pos);
+        memcpy(data, buffer + pos, n);
+        pos += static_cast<int>(n);
+        return static_cast<ssize_t>(n);
+    }
+    ssize_t n;
+    while ((n = read(fd, data, size)) < 0 && errno == EINTR){}
+    if (n > 0) return n;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    return -1;
+}
+
+Lazy<bool> AsyncSocket::write_all(const char * data, size_t size){
+    iovec iov{const_cast<char *>(data), size};
+    co_return co_await write_all(&iov, 1);
+}
+
+Lazy<bool> AsyncSocket::write_all(struct iovec * iov, int iovcnt){
+    while (iovcnt > 0){
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0){
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                co_await reactor.writable(fd);
+                continue;
+            }
+            else if (errno == EINTR){
+                continue;
+            }
+            co_return false;
+        }
+        // skip what was written
+        while (iovcnt > 0 && static_cast<size_t>(n) >= iov->iov_len){
+            n -= static_cast<ssize_t>(iov->iov_len);
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0){
+            iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
+    }
+    co_return true;
+}
@@ -0,0 +1,120 @@
+#include "../include/session_store.h"
+#include "../include/net.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ctime>
+#include <random>
+#include <stdexcept>
+
+static_assert(sizeof(session_record) == 128, "The record size is a part of the file format");
+
+// ---- SessionStore functions definition ----
+
+SessionStore::SessionStore(const char *path): attached(SESSION_STORE_CAPACITY) {
+    size = sizeof(session_record) * (SESSION_STORE_CAPACITY + 1); // the header takes the place of a record
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0){
+        throw std::runtime_error(std::string("Could not open the session store ") + path);
+    }
+    struct stat st{};
+    bool fresh = fstat(fd, &st) == 0 && st.st_size == 0;
+    if ((fresh && ftruncate(fd, static_cast<off_t>(size)) < 0) || (!fresh && static_cast<size_t>(st.st_size) != size)){
+        close_fd(fd);
+        throw std::runtime_error(std::string("The session store ") + path + " has a wrong size");
+    }
+    void * memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED){
+        close_fd(fd);
+        throw std::runtime_error(std::string("Could not map the session store ") + path);
+    }
+    header = static_cast<session_store_header *>(memory);
+    records = reinterpret_cast<session_record *>(static_cast<char *>(memory) + sizeof(session_record));
+
+    if (fresh){
+        *header = {SESSION_STORE_MAGIC, SESSION_STORE_CAPACITY, sizeof(session_record), 0};
+    }
+    else if (header->magic != SESSION_STORE_MAGIC || header->capacity != SESSION_STORE_CAPACITY ||
+             header->record_size != sizeof(session_record)){
+        munmap(memory, size);
+        close_fd(fd);
+        throw std::runtime_error(std::string("The file ") + path + " is not a session store");
+    }
+    for (int slot = SESSION_STORE_CAPACITY - 1; slot >= 0; --slot){
+        if (records[slot].token == 0) free_slots.push_back(slot);
+    }
+}
+
+SessionStore::~SessionStore(){
+    munmap(header, size);
+    close_fd(fd);
+}
+
+uint64_t SessionStore::create(int& slot){
+    static thread_local std::mt19937_64 random(std::random_device{}());
+    std::lock_guard<std::mutex> lk(mut);
+    if (!free_slots.empty()){
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }
+    else{ // reuse the session which was left the longest time ago
+        slot = -1;
+        for (int i = 0; i < static_cast<int>(SESSION_STORE_CAPACITY); ++i){
+            if (!attached[i] && (slot == -1 || records[i].last_seen < records[slot].last_seen)) slot = i;
+        }
+        if (slot == -1) return 0;
+    }
+    uint64_t nonce;
+    do{
+        nonce = random() >> SESSION_SLOT_BITS;
+    } while (nonce == 0);
+
+    session_record& rec = records[slot];
+    rec = session_record();
+    rec.token = nonce << SESSION_SLOT_BITS | static_cast<uint64_t>(slot);
+    rec.last_seen = time(nullptr);
+    save_config(slot, SequenceConfig());
+    attached[slot] = true;
+    return rec.token;
+}
+
+int SessionStore::attach(uint64_t token){
+    int slot = static_cast<int>(token & (SESSION_STORE_CAPACITY - 1));
+    std::lock_guard<std::mutex> lk(mut);
+    if (token == 0 || records[slot].token != token || attached[slot]) return -1;
+    attached[slot] = true;
+    records[slot].last_seen = time(nullptr);
+    return slot;
+}
+
+void SessionStore::detach(int slot){
+    std::lock_guard<std::mutex> lk(mut);
+    attached[slot] = false;
+    records[slot].last_seen = time(nullptr);
+}
+
+void SessionStore::save_config(int slot, const SequenceConfig& cfg){
+    session_record& rec = records[slot];
+    rec.in_use = 0;
+    for (int i = 0; i < SEQ_COUNT; ++i){
+        rec.seq[i] = cfg.seq[i];
+        rec.step[i] = cfg.step[i];
+        rec.inits[i] = cfg.inits[i];
+        rec.kind[i] = static_cast<uint8_t>(cfg.kind[i]);
+        if (cfg.seq_in_use[i]) rec.in_use |= 1u << i;
+    }
+}
+
+SequenceConfig SessionStore::load_config(int slot) const{
+    const session_record& rec = records[slot];
+    SequenceConfig cfg;
+    for (int i = 0; i < SEQ_COUNT; ++i){
+        cfg.seq[i] = rec.seq[i];
+        cfg.step[i] = rec.step[i];
+        cfg.inits[i] = rec.inits[i];
+        cfg.kind[i] = static_cast<SeqKind>(rec.kind[i]);
+        cfg.seq_in_use[i] = rec.in_use & (1u << i);
+    }
+    return cfg;
+}
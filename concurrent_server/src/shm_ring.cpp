@@ -0,0 +1,121 @@
+#include "../include/shm_ring.h"
+#include "../include/net.h"
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+static size_t ring_memory_size(uint32_t capacity){
+    return sizeof(shm_ring_header) + static_cast<size_t>(capacity) * sizeof(seq_frame);
+}
+
+// ---- ShmRingProducer functions definition ----
+
+ShmRingProducer::ShmRingProducer(uint32_t capacity, uint32_t seq_mask): size(ring_memory_size(capacity)) {
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0){
+        throw std::runtime_error(std::string("Shared memory ring capacity must be a power of two."));
+    }
+    if ((memfd = memfd_create("baum-ring", MFD_CLOEXEC)) < 0){
+        throw std::runtime_error(std::string("memfd_create error: ") + strerror(errno));
+    }
+    if (ftruncate(memfd, static_cast<off_t>(size)) < 0 || (eventfd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0){
+        close_fd(memfd);
+        throw std::runtime_error(std::string("Could not set up the shared memory ring: ") + strerror(errno));
+    }
+    void * memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (memory == MAP_FAILED){
+        close_fd(memfd);
+        close_fd(eventfd);
+        throw std::runtime_error(std::string("mmap error: ") + strerror(errno));
+    }
+    header = new (memory) shm_ring_header(); // the memory of a new memfd is zeroed, the atomics start from 0
+    header->magic = SHM_RING_MAGIC;
+    header->capacity = capacity;
+    header->frame_size = sizeof(seq_frame);
+    header->seq_mask = seq_mask;
+    frames = reinterpret_cast<seq_frame *>(static_cast<char *>(memory) + sizeof(shm_ring_header));
+}
+
+ShmRingProducer::~ShmRingProducer(){
+    munmap(header, size);
+    close_fd(memfd);
+    close_fd(eventfd);
+}
+
+seq_frame* ShmRingProducer::claim(size_t& n){
+    // only this thread writes head, so the relaxed load is enough
+    uint64_t head = header->head.load(std::memory_order_relaxed);
+    uint64_t tail = header->tail.load(std::memory_order_acquire);
+    uint64_t pos = head & (header->capacity - 1);
+    n = std::min<uint64_t>(header->capacity - (head - tail), header->capacity - pos); // free and not wrapped
+    return frames + pos;
+}
+
+void ShmRingProducer::publish(size_t n){
+    header->head.fetch_add(n, std::memory_order_release);
+    // pairs with the fence in ShmRingConsumer::wait(): either it sees the new head, or we see its flag
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (header->consumer_waiting.load(std::memory_order_relaxed)){
+        header->consumer_waiting.store(0, std::memory_order_relaxed);
+        uint64_t one = 1;
+        ssize_t res = write(eventfd, &one, sizeof(one)); // EAGAIN means the counter is already non-zero
+        (void) res;
+    }
+}
+
+// ---- ShmRingConsumer functions definition ----
+
+ShmRingConsumer::ShmRingConsumer(int memfd, int eventfd): memfd(memfd), eventfd(eventfd) {
+    uint32_t prefix[4]; // magic, capacity, frame_size, seq_mask
+    void * memory = MAP_FAILED;
+    if (pread(memfd, prefix, sizeof(prefix), 0) == sizeof(prefix) && prefix[0] == SHM_RING_MAGIC &&
+        prefix[2] == sizeof(seq_frame)){
+        size = ring_memory_size(prefix[1]);
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    }
+    if (memory == MAP_FAILED){
+        close_fd(memfd);
+        close_fd(eventfd);
+        throw std::runtime_error(std::string("The descriptor is not a sequence ring."));
+    }
+    header = static_cast<shm_ring_header *>(memory);
+    frames = reinterpret_cast<const seq_frame *>(static_cast<char *>(memory) + sizeof(shm_ring_header));
+}
+
+ShmRingConsumer::~ShmRingConsumer(){
+    munmap(header, size);
+    close_fd(memfd);
+    close_fd(eventfd);
+}
+
+size_t ShmRingConsumer::read(seq_frame * out, size_t n){
+    uint64_t tail = header->tail.load(std::memory_order_relaxed);
+    uint64_t head = header->head.load(std::memory_order_acquire);
+    n = std::min<uint64_t>(n, head - tail);
+    for (size_t i = 0; i < n; ++i){
+        out[i] = frames[(tail + i) & (header->capacity - 1)];
+    }
+    header->tail.store(tail + n, std::memory_order_release);
+    return n;
+}
+
+bool ShmRingConsumer::wait(int timeout_ms){
+    header->consumer_waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (header->head.load(std::memory_order_relaxed) != header->tail.load(std::memory_order_relaxed)){
+        header->consumer_waiting.store(0, std::memory_order_relaxed);
+        return true; // published in the meantime
+    }
+    pollfd pfd{eventfd, POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms) <= 0){ // the eventfd is non-blocking, so wait for it with poll()
+        return false;
+    }
+    uint64_t count;
+    ssize_t res = ::read(eventfd, &count, sizeof(count));
+    (void) res;
+    return true;
+}
@@ -0,0 +1,124 @@
+#include "../include/slow_consumer.h"
+#include "../include/metrics.h"
+
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <cstddef>
+#include <iostream>
+
+/**
+ * What the kernel knows about the consumer of the socket.
+ */
+struct consumer_sample{
+    unsigned long long delivered; // bytes the peer has taken
+    unsigned long long rwnd_limited_us; // TCP: time the peer's receive window held the sending back
+    unsigned queued; // bytes not taken by the peer yet
+    bool tcp; // the TCP_INFO counters are valid
+};
+
+static bool sample_socket(int fd, unsigned long long written, consumer_sample& sample){
+    int queued = 0;
+    if (ioctl(fd, SIOCOUTQ, &queued) < 0) return false;
+    sample.queued = static_cast<unsigned>(queued);
+    sample.delivered = written > sample.queued ? written - sample.queued : 0;
+    sample.rwnd_limited_us = 0;
+    sample.tcp = false;
+
+    tcp_info info{};
+    socklen_t len = sizeof(info);
+    // the counters are appended to tcp_info over the kernel versions, the older kernels return less
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+        len >= offsetof(tcp_info, tcpi_rwnd_limited) + sizeof(info.tcpi_rwnd_limited)){
+        sample.delivered = info.tcpi_bytes_acked;
+        sample.rwnd_limited_us = info.tcpi_rwnd_limited;
+        sample.tcp = true;
+    }
+    return true;
+}
+
+// ---- slow_consumer_policy functions definition ----
+
+slow_consumer_policy::slow_consumer_policy(){
+    metrics_id = register_metrics([this](std::string& out){
+        append_metric(out, "slow_consumers.samples", samples.load(std::memory_order_relaxed));
+        append_metric(out, "slow_consumers.slow_now", slow_now.load(std::memory_order_relaxed));
+        append_metric(out, "slow_consumers.classified", classified.load(std::memory_order_relaxed));
+        append_metric(out, "slow_consumers.recovered", recovered.load(std::memory_order_relaxed));
+        append_metric(out, "slow_consumers.dropped_lines", dropped_lines.load(std::memory_order_relaxed));
+        append_metric(out, "slow_consumers.skipped_lines", skipped_lines.load(std::memory_order_relaxed));
+        append_metric(out, "slow_consumers.disconnected", disconnected.load(std::memory_order_relaxed));
+    });
+}
+
+slow_consumer_policy::~slow_consumer_policy(){
+    unregister_metrics(metrics_id);
+}
+
+SlowConsumerAction slow_consumer_policy::action_from_name(const std::string& name){
+    if (name == "drop") return SlowConsumerAction::drop;
+    if (name == "downsample") return SlowConsumerAction::downsample;
+    if (name == "disconnect") return SlowConsumerAction::disconnect;
+    return SlowConsumerAction::none;
+}
+
+// ---- slow_consumer_monitor functions definition ----
+
+slow_consumer_monitor::~slow_consumer_monitor(){
+    if (is_slow) policy->slow_now.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void slow_consumer_monitor::reset(){
+    if (is_slow) policy->slow_now.fetch_sub(1, std::memory_order_relaxed);
+    is_slow = false;
+    started = false;
+    good_samples = 0;
+}
+
+SlowConsumerAction slow_consumer_monitor::check(int fd, unsigned long long written, unsigned long long requested_rate){
+    if (!policy || policy->action == SlowConsumerAction::none) return SlowConsumerAction::none;
+    auto now = std::chrono::steady_clock::now();
+    if (started && now - last_sample < std::chrono::milliseconds(SLOW_SAMPLE_INTERVAL_MS)){
+        return is_slow ? policy->action : SlowConsumerAction::none;
+    }
+    consumer_sample sample{};
+    if (!sample_socket(fd, written, sample)) return is_slow ? policy->action : SlowConsumerAction::none;
+    policy->samples.fetch_add(1, std::memory_order_relaxed);
+    if (!started){
+        started = true;
+        last_sample = now;
+        last_delivered = sample.delivered;
+        last_rwnd_limited_us = sample.rwnd_limited_us;
+        return SlowConsumerAction::none;
+    }
+
+    const double interval_us = std::chrono::duration<double, std::micro>(now - last_sample).count();
+    const double rate = (sample.delivered - last_delivered) * 1e6 / interval_us;
+    const bool unread = sample.tcp ? (sample.rwnd_limited_us - last_rwnd_limited_us) * 2 >= interval_us
+                                   : sample.queued >= SLOW_QUEUE_BYTES;
+    const unsigned long long min_rate = requested_rate ? requested_rate / 2 : policy->min_rate;
+    const bool slow_sample = unread && rate < static_cast<double>(min_rate);
+    last_sample = now;
+    last_delivered = sample.delivered;
+    last_rwnd_limited_us = sample.rwnd_limited_us;
+
+    if (slow_sample && !is_slow){
+        is_slow = true;
+        policy->classified.fetch_add(1, std::memory_order_relaxed);
+        policy->slow_now.fetch_add(1, std::memory_order_relaxed);
+        int sndbuf = SLOW_SNDBUF;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)); // the queued output above it stays
+        std::cout << "Client " << fd << " is a slow consumer: " << static_cast<unsigned long long>(rate)
+                  << " bytes/s, " << sample.queued << " bytes unread." << std::endl;
+    }
+    good_samples = slow_sample ? 0 : good_samples + 1;
+    if (is_slow && good_samples >= SLOW_RECOVER_SAMPLES){
+        is_slow = false;
+        policy->recovered.fetch_add(1, std::memory_order_relaxed);
+        policy->slow_now.fetch_sub(1, std::memory_order_relaxed);
+        std::cout << "Client " << fd << " keeps up again." << std::endl;
+    }
+    return is_slow ? policy->action : SlowConsumerAction::none;
+}
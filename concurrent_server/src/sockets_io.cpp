@@ -2,22 +2,103 @@
 // Created by pi on 1/10/23.
 //
 #include "../include/sockets_io.h"
+#include <atomic>
 #include <iostream>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <linux/errqueue.h>
 
 #include "../include/Server.h"
+#include "../include/event_trace.h"
+#include "../include/metrics.h"
+
+static std::mutex recv_pool_mut;
+static std::vector<char *> recv_pool; // free buffers
+static std::atomic<unsigned long long> recv_borrowed{0}, recv_allocated{0};
+
+/**
+ * Puts the buffer to the shared pool, or frees it if the pool is full.
+ */
+static void pool_recv_buffer(char * buffer){
+    {
+        std::lock_guard<std::mutex> lk(recv_pool_mut);
+        if (recv_pool.size() < RECV_BUFFER_POOL_MAX){
+            recv_pool.push_back(buffer);
+            return;
+        }
+    }
+    recv_allocated.fetch_sub(1, std::memory_order_relaxed);
+    delete[] buffer;
+}
+
+/**
+ * The idle connections are polled with a read which finds nothing: the buffer goes back and forth without the lock.
+ * The spare of a thread which exits, e.g. a worker retired by the elastic pool, goes back to the shared pool.
+ */
+struct spare_recv_slot{
+    char * buffer = nullptr;
+    ~spare_recv_slot(){
+        if (buffer) pool_recv_buffer(buffer);
+    }
+};
+static thread_local spare_recv_slot spare_recv;
+
+char * borrow_recv_buffer(){
+    static const int metrics_id = register_metrics([](std::string& out){
+        append_metric(out, "recv_buffers.borrowed", recv_borrowed.load(std::memory_order_relaxed));
+        append_metric(out, "recv_buffers.allocated", recv_allocated.load(std::memory_order_relaxed));
+    });
+    (void) metrics_id;
+    recv_borrowed.fetch_add(1, std::memory_order_relaxed);
+    if (spare_recv.buffer){
+        return std::exchange(spare_recv.buffer, nullptr);
+    }
+    {
+        std::lock_guard<std::mutex> lk(recv_pool_mut);
+        if (!recv_pool.empty()){
+            char * buffer = recv_pool.back();
+            recv_pool.pop_back();
+            return buffer;
+        }
+    }
+    recv_allocated.fetch_add(1, std::memory_order_relaxed);
+    return new char[BUFSIZE];
+}
+
+void return_recv_buffer(char * buffer){
+    recv_borrowed.fetch_sub(1, std::memory_order_relaxed);
+    if (!spare_recv.buffer){
+        spare_recv.buffer = buffer;
+        return;
+    }
+    pool_recv_buffer(buffer);
+}
+
+void ioResult_t::release(){
+    if (!buffer || cntLeft > IO_INLINE_SIZE) return; // the pipelined commands are read from the buffer
+    if (cntLeft > 0) memcpy(inline_buffer, pNextByte, cntLeft);
+    else cntLeft = 0;
+    pNextByte = inline_buffer;
+    return_recv_buffer(buffer);
+    buffer = nullptr;
+}
 
 ssize_t robust_read(ioResult_t * pResult, char * usrBuffer, size_t n) {
     int cnt;
 
     // fill the buffer if it's empty
     while (pResult->cntLeft <= 0) {
-        pResult->cntLeft = static_cast<int>( read(pResult->fd, pResult->buffer, sizeof(pResult->buffer)));
+        if (!pResult->buffer) pResult->buffer = borrow_recv_buffer();
+        pResult->cntLeft = static_cast<int>( read(pResult->fd, pResult->buffer, BUFSIZE));
         if (pResult->cntLeft < 0) {
             if (errno != EINTR) {
+                pResult->release();
                 return -1; // if it's not Unix interruption, return error
             }
         }
         else if (pResult->cntLeft == 0) {
+            pResult->release();
             return 0; // EOF
         }
         else{
@@ -41,10 +122,11 @@ ssize_t robust_read(ioResult_t * pResult, char * usrBuffer, size_t n) {
  * @param fd
  * @return
  */
-HandleStatus readline_wrapper(int fd, std::string& line){
-    int max_len = 50;
-    ioResult_t io_buf(fd);
+HandleStatus readline_wrapper(ioResult_t& io_buf, std::string& line){
+    int max_len = MAX_COMMAND_LEN - static_cast<int>(line.size());
+    if (max_len <= 1) return HandleStatus::ok; // too long for a command, let the parser reject it
     int read_res = robust_readline(&io_buf, line, max_len);
+    io_buf.release(); // an idle connection keeps at most a pipelined command
 
     if (read_res == 0) return HandleStatus::disconnected;
     else if (read_res == -1) return HandleStatus::try_again;
@@ -86,6 +168,7 @@ int robust_readline(ioResult_t * pResult, std::string& line, size_t maxLen){
 }
 
 int robust_write(int fd, const std::string& line){
+    trace_span span("write", "fd", fd);
     size_t nleft = line.size();
     ssize_t nwritten;
     const char * bufp = line.data();
@@ -103,4 +186,126 @@ int robust_write(int fd, const std::string& line){
         bufp += nwritten;
     }
     return static_cast<int>(line.size());
-}
\ No newline at end of file
+}
+
+ssize_t robust_writev(int fd, const struct iovec * iov, int iovcnt){
+    trace_span span("write", "fd", fd);
+    ssize_t nwritten;
+    while ((nwritten = writev(fd, iov, iovcnt)) < 0){
+        if (errno == EAGAIN || errno == EWOULDBLOCK){
+            return 0; // the socket buffer is full, try next time
+        }
+        else if (errno != EINTR){
+            return -1;
+        }
+    }
+    return nwritten;
+}
+
+ssize_t send_with_fds(int fd, const std::string& msg, const int * fds, int nfds){
+    if (nfds > MAX_PASSED_FDS) return -1;
+    iovec iov{const_cast<char *>(msg.data()), msg.size()};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)]{};
+    msghdr mh{};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    cmsghdr * cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+
+    ssize_t nwritten;
+    while ((nwritten = sendmsg(fd, &mh, MSG_NOSIGNAL)) < 0){
+        if (errno != EINTR && errno != EAGAIN) return -1; // the message is short, the buffer of the new client is empty
+    }
+    return nwritten;
+}
+
+ssize_t recv_with_fds(int fd, char * buf, size_t len, int * fds, int& nfds){
+    iovec iov{buf, len};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)]{};
+    msghdr mh{};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+
+    ssize_t nread;
+    while ((nread = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC)) < 0){
+        if (errno != EINTR) return -1;
+    }
+    int capacity = nfds;
+    nfds = 0;
+    for (cmsghdr * cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)){
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        int count = static_cast<int>((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int i = 0; i < count; ++i){
+            int received;
+            memcpy(&received, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            if (nfds < capacity) fds[nfds++] = received;
+            else close(received);
+        }
+    }
+    return nread;
+}
+
+// ---- zerocopy_sender functions definition ----
+
+// all the sockets together, a high share of the copied sends means MSG_ZEROCOPY costs more than it saves
+static std::atomic<unsigned long long> zerocopy_sends{0}, zerocopy_copied{0};
+
+ssize_t zerocopy_sender::send(int fd, const struct iovec * iov, int iovcnt, const std::shared_ptr<const void> * owners){
+    static const int metrics_id = register_metrics([](std::string& out){
+        append_metric(out, "zerocopy.sends", zerocopy_sends.load(std::memory_order_relaxed));
+        append_metric(out, "zerocopy.copied_sends", zerocopy_copied.load(std::memory_order_relaxed));
+    });
+    (void) metrics_id;
+    trace_span span("write", "fd", fd);
+    msghdr msg{};
+    msg.msg_iov = const_cast<iovec *>(iov);
+    msg.msg_iovlen = iovcnt;
+
+    ssize_t nwritten;
+    while ((nwritten = sendmsg(fd, &msg, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL)) < 0){
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS){
+            return 0; // ENOBUFS: the socket is over its optmem limit, pinned pages will be released by reap()
+        }
+        else if (errno != EINTR){
+            return -1;
+        }
+    }
+    for (int i = 0; i < iovcnt; ++i){
+        in_flight.push_back({next_id, owners[i]});
+    }
+    ++next_id;
+    zerocopy_sends.fetch_add(1, std::memory_order_relaxed);
+    return nwritten;
+}
+
+void zerocopy_sender::reap(int fd){
+    char control[128];
+    while (!in_flight.empty()){
+        msghdr msg{};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0){
+            return; // EAGAIN: nothing completed yet
+        }
+        for (cmsghdr * cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)){
+            auto * err = reinterpret_cast<sock_extended_err *>(CMSG_DATA(cm));
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED){
+                // one notification may cover a range of the sends, all of them copied
+                copied += err->ee_data - err->ee_info + 1;
+                zerocopy_copied.fetch_add(err->ee_data - err->ee_info + 1, std::memory_order_relaxed);
+            }
+            // sends [ee_info, ee_data] are completed, TCP completes them in order
+            while (!in_flight.empty() && static_cast<int>(in_flight.front().id - err->ee_data) <= 0){
+                in_flight.pop_front();
+            }
+        }
+    }
+}
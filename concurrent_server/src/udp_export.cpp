@@ -0,0 +1,147 @@
+#include "../include/udp_export.h"
+#include "../include/net.h"
+#include "../include/metrics.h"
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103 // linux/udp.h, for the older C libraries
+#endif
+
+static std::atomic<unsigned long long> udp_calls{0}, udp_datagrams{0}, udp_values{0}, udp_cpu_ns{0};
+
+static unsigned long long thread_cpu_ns(){
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool enable_gso(int fd, bool on){
+    int segment = on ? static_cast<int>(UDP_DATAGRAM_SIZE) : 0;
+    return setsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0;
+}
+
+// ---- UdpExporter functions definition ----
+
+UdpExporter::UdpExporter(int control_fd, uint16_t port, bool gso):
+        gso(gso), buffer(UDP_BATCH_DATAGRAMS * UDP_DATAGRAM_SIZE) {
+    static const int metrics_id = register_metrics([](std::string& out){
+        append_metric(out, "udp.sendmmsg_calls", udp_calls.load(std::memory_order_relaxed));
+        append_metric(out, "udp.datagrams", udp_datagrams.load(std::memory_order_relaxed));
+        append_metric(out, "udp.values", udp_values.load(std::memory_order_relaxed));
+        append_metric(out, "udp.cpu_ns", udp_cpu_ns.load(std::memory_order_relaxed));
+    });
+    (void) metrics_id;
+
+    sockaddr_storage addr{};
+    socklen_t addrlen = sizeof(addr);
+    if (getpeername(control_fd, reinterpret_cast<sockaddr *>(&addr), &addrlen) < 0 ||
+        (addr.ss_family != AF_INET && addr.ss_family != AF_INET6)){
+        throw std::runtime_error("The UDP export needs a TCP control connection");
+    }
+    if (addr.ss_family == AF_INET) reinterpret_cast<sockaddr_in *>(&addr)->sin_port = htons(port);
+    else reinterpret_cast<sockaddr_in6 *>(&addr)->sin6_port = htons(port);
+
+    fd = socket(addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&addr), addrlen) < 0){
+        if (fd >= 0) close_fd(fd);
+        throw std::runtime_error("Could not open the UDP socket to the consumer");
+    }
+    if (gso && !enable_gso(fd, true)){
+        std::cerr << "UDP GSO is not supported, the datagrams are sent one by one" << std::endl;
+        this->gso = false;
+    }
+}
+
+UdpExporter::~UdpExporter(){
+    close_fd(fd);
+    if (calls == 0) return;
+    std::cout << "UDP export: " << datagrams << " datagrams in " << calls << " sendmmsg() calls, " << std::fixed
+              << std::setprecision(1) << static_cast<double>(datagrams) / calls << " per call, "
+              << (values ? static_cast<double>(cpu_ns) / values : 0.0) << " ns of CPU per value" << std::endl;
+}
+
+ssize_t UdpExporter::send_batch(const SequenceConfig& cfg, unsigned long long first_line, size_t max_lines){
+    const unsigned long long cpu_start = thread_cpu_ns();
+    const size_t lines = std::min<size_t>(max_lines, UDP_BATCH_DATAGRAMS * UDP_FRAMES_PER_DATAGRAM);
+    const int count = static_cast<int>((lines + UDP_FRAMES_PER_DATAGRAM - 1) / UDP_FRAMES_PER_DATAGRAM);
+    int in_use = 0;
+    for (bool used : cfg.seq_in_use) in_use += used;
+
+    // pack: every datagram is generated column by column, like an output block
+    uint64_t columns[SEQ_COUNT][UDP_FRAMES_PER_DATAGRAM]{};
+    size_t datagram_size[UDP_BATCH_DATAGRAMS];
+    for (int d = 0; d < count; ++d){
+        const unsigned long long line = first_line + d * UDP_FRAMES_PER_DATAGRAM;
+        const auto frames = static_cast<uint32_t>(std::min<size_t>(lines - d * UDP_FRAMES_PER_DATAGRAM,
+                                                                   UDP_FRAMES_PER_DATAGRAM));
+        for (int i = 0; i < SEQ_COUNT; ++i){
+            if (cfg.seq_in_use[i]) cfg.values_after(i, line - 1, columns[i], frames);
+        }
+        char * out = buffer.data() + d * UDP_DATAGRAM_SIZE;
+        udp_datagram_header header{UDP_DATAGRAM_MAGIC, frames};
+        memcpy(out, &header, sizeof(header));
+        out += sizeof(header);
+        for (uint32_t k = 0; k < frames; ++k, out += sizeof(seq_frame)){
+            seq_frame frame{line + k, {columns[0][k], columns[1][k], columns[2][k]}};
+            memcpy(out, &frame, sizeof(frame));
+        }
+        datagram_size[d] = sizeof(header) + frames * sizeof(seq_frame);
+    }
+
+    // a message is one datagram, or with gso up to UDP_GSO_SEGMENTS of them, of which only the last may be shorter
+    const int per_message = gso ? UDP_GSO_SEGMENTS : 1;
+    mmsghdr messages[UDP_BATCH_DATAGRAMS]{};
+    iovec iov[UDP_BATCH_DATAGRAMS];
+    size_t message_lines[UDP_BATCH_DATAGRAMS];
+    int message_count = 0;
+    for (int d = 0; d < count; d += per_message, ++message_count){
+        const int last = std::min(d + per_message, count) - 1;
+        iov[message_count].iov_base = buffer.data() + d * UDP_DATAGRAM_SIZE;
+        iov[message_count].iov_len = last * UDP_DATAGRAM_SIZE + datagram_size[last] - d * UDP_DATAGRAM_SIZE;
+        messages[message_count].msg_hdr.msg_iov = &iov[message_count];
+        messages[message_count].msg_hdr.msg_iovlen = 1;
+        message_lines[message_count] = std::min<size_t>(lines - d * UDP_FRAMES_PER_DATAGRAM,
+                                                        (last - d + 1) * UDP_FRAMES_PER_DATAGRAM);
+    }
+
+    int sent = sendmmsg(fd, messages, message_count, 0);
+    ++calls;
+    udp_calls.fetch_add(1, std::memory_order_relaxed);
+    ssize_t res;
+    if (sent < 0){
+        if (errno == EIO && gso){
+            std::cerr << "UDP GSO failed on the route, the datagrams are sent one by one" << std::endl;
+            gso = !enable_gso(fd, false);
+            res = 0;
+        }
+        else if (errno == ECONNREFUSED){
+            res = static_cast<ssize_t>(message_lines[0]); // the consumer isn't listening: lost like a dropped datagram
+        }
+        else res = (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == EINTR) ? 0 : -1;
+    }
+    else{
+        res = 0;
+        for (int m = 0; m < sent; ++m) res += static_cast<ssize_t>(message_lines[m]);
+        const auto sent_datagrams = static_cast<unsigned long long>((res + UDP_FRAMES_PER_DATAGRAM - 1) /
+                                                                    UDP_FRAMES_PER_DATAGRAM);
+        datagrams += sent_datagrams;
+        values += static_cast<unsigned long long>(res) * in_use;
+        udp_datagrams.fetch_add(sent_datagrams, std::memory_order_relaxed);
+        udp_values.fetch_add(static_cast<unsigned long long>(res) * in_use, std::memory_order_relaxed);
+    }
+    const unsigned long long cpu = thread_cpu_ns() - cpu_start;
+    cpu_ns += cpu;
+    udp_cpu_ns.fetch_add(cpu, std::memory_order_relaxed);
+    return res;
+}
@@ -0,0 +1,173 @@
+#include "../include/baum_client.h"
+
+#include <sys/socket.h>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+static const char * HOST = "127.0.1.1";
+static const size_t LINES = 10000;
+static const int QUIET_POLLS = 30; // 10 ms each: the server sent everything it is going to
+static const int RESUME_ATTEMPTS = 50; // the session is attached until the server notices the disconnection
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what){
+    if (ok) return;
+    std::cerr << "FAILED: " << what << std::endl;
+    ++failures;
+}
+
+/**
+ * @return true if the line is the line.line-th of "seq1 start step" with the other sequences off
+ */
+static bool is_line_of(const SeqLine& line, unsigned long long start, unsigned long long step){
+    return line.count == 1 && line.values[0] == start + step * line.line;
+}
+
+/**
+ * Sends a control command of the export, SequenceClient queues the commands only until the export.
+ */
+static void send_line(SequenceClient& client, const std::string& line){
+    std::string data = line + "\n";
+    check(send(client.file_descriptor(), data.data(), data.size(), MSG_NOSIGNAL) == (ssize_t) data.size(), line);
+}
+
+/**
+ * Reads the lines until nothing comes for QUIET_POLLS polls.
+ * @return the last line read, or last if there was none
+ */
+static SeqLine drain(SequenceClient& client, SeqLine last){
+    SeqLine lines[256];
+    for (int quiet = 0; quiet < QUIET_POLLS && client.connected();){
+        size_t n = client.read(lines, 256, false);
+        if (n > 0){
+            last = lines[n - 1];
+            quiet = 0;
+            continue;
+        }
+        ++quiet;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return last;
+}
+
+/**
+ * The position of the session is saved after every write, even in the middle of a line: the export paused and read to
+ * the end resumes with the next complete line.
+ */
+static void check_resume(const char * port){
+    std::string token;
+    SeqLine last{};
+    {
+        SequenceClient first(HOST, port);
+        std::string reply = first.query("session");
+        check(reply.rfind("session ", 0) == 0, "session, got: " + reply);
+        token = reply.substr(8);
+        check(first.seq(1, 1, 1).seq(2, 0, 0).seq(3, 0, 0).export_seq(), "export seq");
+        send_line(first, "rate 1000"); // the budget cuts the writes in the middle of the lines
+        first.for_each([&](const SeqLine& line){ last = line; return true; }, 300);
+        send_line(first, "pause");
+        last = drain(first, last);
+    }
+    check(last.count == 1 && last.values[0] >= 300, "read the lines before the resume");
+
+    for (int attempt = 0; attempt < RESUME_ATTEMPTS; ++attempt){
+        SequenceClient resumed(HOST, port);
+        std::string status = resumed.seq(1, 1, 1).seq(2, 0, 0).seq(3, 0, 0).command("resume " + token).query("status");
+        if (status.rfind("status", 0) != 0){ // still attached to the first connection
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            continue;
+        }
+        check(resumed.export_seq(), "export seq");
+        SeqLine next{};
+        check(resumed.read(&next, 1) == 1, "read after the resume");
+        check(next.count == 1 && next.values[0] == last.values[0] + 1 && resumed.last_message().empty(),
+              "the resumed export starts with the line " + std::to_string(last.values[0] + 1) + ", got " +
+              std::to_string(next.values[0]) + (resumed.last_message().empty() ? "" : ", a partial line first"));
+        return;
+    }
+    check(false, "resume " + token);
+}
+
+/**
+ * Usage: client_test PORT UNIX_PATH
+ * Drives the server through SequenceClient: the pipelined setup, the pull and the callback reading over TCP, the shared
+ * memory ring over the Unix socket, the resume of a session. Started by tests/with_server.sh, the server keeps the
+ * sessions.
+ */
+int main(int argc, char * argv[]){
+    if (argc < 3){
+        std::cerr << "Usage: client_test PORT UNIX_PATH" << std::endl;
+        return 2;
+    }
+    const char * port = argv[1];
+    const char * unix_path = argv[2];
+    try{
+        // the setup commands go together with the query in one write, the reply reflects all of them
+        SequenceClient pipelined(HOST, port);
+        std::string status = pipelined.seq(1, 5, 3).seq(2, 0, 0).seq(3, 0, 0).query("status");
+        check(status.rfind("status seq1=5/3 seq2=off seq3=off", 0) == 0, "pipelined setup, got: " + status);
+
+        SequenceClient pull(HOST, port);
+        check(pull.seq(1, 7, 2).seq(2, 0, 0).seq(3, 0, 0).export_seq(), "export seq");
+        size_t count = 0;
+        bool in_order = true;
+        for (const SeqLine& line : pull.lines()){
+            in_order = in_order && line.line == count + 1 && is_line_of(line, 7, 2);
+            if (++count == LINES) break;
+        }
+        check(count == LINES && in_order, "lines() reads " + std::to_string(LINES) + " lines in order");
+
+        SequenceClient callback(HOST, port);
+        check(callback.seq(1, 1, 1).seq(2, 0, 0).seq(3, 0, 0).export_seq(), "export seq");
+        bool correct = true;
+        size_t read = callback.for_each([&](const SeqLine& line){
+            correct = correct && is_line_of(line, 1, 1);
+            return true;
+        }, LINES);
+        check(read == LINES && correct, "for_each() passes " + std::to_string(LINES) + " lines");
+        size_t stopped = callback.for_each([](const SeqLine&){ return false; });
+        check(stopped == 1, "for_each() stops when the callback returns false");
+
+        // a zero doesn't turn off the other kinds: Fibonacci from 0, 1 is 1, 1, 2, 3, 5...
+        SequenceClient fibonacci(HOST, port);
+        check(fibonacci.seq(1, 0, 1, "fibonacci").seq(2, 0, 0).seq(3, 0, 0).export_seq(), "export seq");
+        SeqLine terms[16];
+        count = 0;
+        while (count < 16){
+            size_t n = fibonacci.read(terms + count, 16 - count);
+            if (n == 0) break;
+            count += n;
+        }
+        correct = count == 16 && terms[0].count == 1 && terms[0].values[0] == 1 && terms[1].values[0] == 1;
+        for (size_t i = 2; i < count && correct; ++i){
+            correct = terms[i].count == 1 && terms[i].values[0] == terms[i - 1].values[0] + terms[i - 2].values[0];
+        }
+        check(correct, "a Fibonacci sequence from a zero, last message: " + fibonacci.last_message());
+
+        SequenceClient shm(unix_path);
+        check(shm.seq(1, 3, 4).seq(2, 0, 0).seq(3, 0, 0).export_shm(), "export shm: " + shm.last_message());
+        SeqLine lines[256];
+        count = 0;
+        correct = true;
+        while (count < LINES){
+            size_t n = shm.read(lines, 256);
+            if (n == 0) break;
+            for (size_t i = 0; i < n; ++i){
+                correct = correct && lines[i].line == count + i + 1 && is_line_of(lines[i], 3, 4);
+            }
+            count += n;
+        }
+        check(count >= LINES && correct, "read() from the shared memory ring");
+
+        check_resume(port);
+    }
+    catch(std::exception& e){
+        std::cerr << "FAILED: " << e.what() << std::endl;
+        return 1;
+    }
+    if (failures == 0) std::cout << "SequenceClient: all checks passed" << std::endl;
+    return failures ? 1 : 0;
+}
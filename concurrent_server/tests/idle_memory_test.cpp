@@ -0,0 +1,89 @@
+#include "../include/Server.h"
+#include "../include/metrics.h"
+
+#include <sys/socket.h>
+#include <malloc.h>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+static const int IDLE_CONNECTIONS = 2000;
+// sent before the first handle(): to every second peer the start of a command, to every fourth of the others a
+// command with another one pipelined after it, which stays unread in the inline area of ioResult_t
+static const char PARTIAL_COMMAND[] = "seq1 1000000000000 1000000000000 xorshift"; // within IO_INLINE_SIZE
+static const char PIPELINED_COMMANDS[] = "seq2 1 2\nseq3 3 4\n";
+
+/**
+ * The heap in use, counted by malloc: the bytes of the allocated chunks, so the overhead of the allocator is included.
+ */
+static size_t heap_in_use(){
+    return mallinfo2().uordblks;
+}
+
+/**
+ * @return the value of the metric, or -1 if it isn't reported
+ */
+static long long metric_value(const std::string& name){
+    std::string metrics;
+    report_metrics(metrics);
+    size_t pos = metrics.find(name + " ");
+    if (pos == std::string::npos || (pos > 0 && metrics[pos - 1] != '\n')) return -1;
+    return std::atoll(metrics.c_str() + pos + name.size() + 1);
+}
+
+/**
+ * Measures the memory of the server per idle connection: the ClientHandler made as ThreadPoolServer makes it, with
+ * the control block of make_shared, queued the way the pool queues it, after a handle() which read what the client
+ * sent: nothing, a partial command or a command and the next one pipelined. Fails if it's more than IDLE_CLIENT_BYTES
+ * or if a connection still holds a receive buffer afterwards. The sockets themselves are kernel memory and are not
+ * counted.
+ */
+int main(){
+    OutputCache cache;
+    codel_controller overload;
+    slow_consumer_policy slow_consumers;
+    std::vector<int> peers; // the client ends, allocated before the measurement
+    peers.reserve(IDLE_CONNECTIONS);
+    threadsafe_queue<std::shared_ptr<ClientHandler>> queue; // its ring, i.e. the slot of each handler, is counted
+
+    const size_t before = heap_in_use();
+    for (int i = 0; i < IDLE_CONNECTIONS; ++i){
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0){
+            std::cerr << "socketpair() failed after " << i << " connections" << std::endl;
+            return 1;
+        }
+        peers.push_back(fds[1]);
+        const bool partial = i % 2 == 0, pipelined = i % 8 == 1;
+        if (partial) robust_write(fds[1], PARTIAL_COMMAND);
+        if (pipelined) robust_write(fds[1], PIPELINED_COMMANDS);
+        auto handler = std::make_shared<ClientHandler>(fds[0], cache, SocketProfile(), &overload, nullptr, nullptr,
+                                                       nullptr, &slow_consumers);
+        // the first of the pipelined commands is run, the pool would queue the handler again for the second one
+        const HandleStatus expected = pipelined ? HandleStatus::ok : HandleStatus::try_again;
+        if (handler->handle() != expected){
+            std::cerr << "The idle connection " << i << " is not waiting for the input" << std::endl;
+            return 1;
+        }
+        queue.push(std::move(handler));
+    }
+    const size_t after = heap_in_use();
+
+    const double per_connection = static_cast<double>(after - before) / IDLE_CONNECTIONS;
+    const long long borrowed = metric_value("recv_buffers.borrowed");
+    std::cout << IDLE_CONNECTIONS << " idle connections: " << after - before << " bytes of the heap, "
+              << per_connection << " per connection (budget " << IDLE_CLIENT_BYTES << "), " << borrowed
+              << " receive buffers borrowed" << std::endl;
+    // the pipelined command kept inline is run without reading the socket, which has nothing more
+    bool inline_kept = true;
+    std::shared_ptr<ClientHandler> handler;
+    for (int i = 0; queue.try_pop(handler); ++i){
+        if (i % 8 == 1 && handler->handle() != HandleStatus::ok){
+            std::cerr << "The pipelined command of the connection " << i << " is lost" << std::endl;
+            inline_kept = false;
+        }
+        handler.reset();
+    }
+    for (int fd : peers) close_fd(fd);
+    return per_connection <= IDLE_CLIENT_BYTES && borrowed == 0 && inline_kept ? 0 : 1;
+}
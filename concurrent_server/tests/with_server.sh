@@ -0,0 +1,27 @@
+#!/usr/bin/env bash
+# Usage: with_server.sh SERVER PORT [SERVER_ARGS...] -- CLIENT [ARGS...]
+# Starts SERVER --port=PORT SERVER_ARGS on 127.0.1.1, waits until it accepts the connections, runs the client and stops
+# the server. The exit code is the client's, or 1 if the server didn't come up.
+server=$1 port=$2
+shift 2
+server_args=()
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+    server_args+=("$1")
+    shift
+done
+shift
+
+"$server" --port="$port" "${server_args[@]}" > "server-$port.log" 2>&1 &
+pid=$!
+trap 'kill "$pid" 2>/dev/null; wait "$pid" 2>/dev/null' EXIT
+
+for _ in $(seq 50); do
+    if (exec 3<>"/dev/tcp/127.0.1.1/$port") 2>/dev/null; then
+        "$@"
+        exit $?
+    fi
+    kill -0 "$pid" 2>/dev/null || break
+    sleep 0.1
+done
+echo "The server $server didn't listen on port $port, see server-$port.log" >&2
+exit 1